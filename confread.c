@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "confread.h"
 #include "notify.h"
@@ -263,6 +264,31 @@ String confreadStringCopy(String dest, const String src, int charsToCopy)
 	return dest;
 }
 
+/*
+* Replace a file safely. The contents go to path.tmp, which is renamed
+* over path once writer() has returned TRUE and it is closed, so a crash
+* never leaves half a file behind. Returns FALSE if the file was not replaced.
+*/
+
+Bool confreadReplaceFile(const String path, Bool (*writer)(FILE *file, void *arg), void *arg)
+{
+	char tmpPath[PATH_MAX + 8];
+	FILE *file;
+	Bool written;
+
+	if((!path) || (!writer) || (strlen(path) + 5 > sizeof(tmpPath)))
+		return FALSE;
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	if(!(file = fopen(tmpPath, "w")))
+		return FALSE;
+	written = (*writer)(file, arg);
+	if((fclose(file)) || (!written) || (rename(tmpPath, path))){
+		unlink(tmpPath);
+		return FALSE;
+	}
+	return TRUE;
+}
+
 
 
 /*
@@ -9,6 +9,7 @@
 #ifndef CONFSCAN_H
 #define CONFSCAN_H
 
+#include <stdio.h>
 #include "types.h"
 
 /* Enums */
@@ -100,6 +101,7 @@ void confreadDefErrorHandler( int etype, int linenum, const String info);
 
 String confreadStringCopy(String dest, const String src, int charsToCopy);
 uint32_t confreadHash(const String key);
+Bool confreadReplaceFile(const String path, Bool (*writer)(FILE *file, void *arg), void *arg);
 
 /* Debugging functions */
 void confreadDebugDump(ConfigEntryPtr_t ce);
@@ -0,0 +1,294 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Named device registry
+*
+*    Loads the [devices] section of the config file. Each entry looks like:
+*
+*    kitchen = A1, lamp, extdim, twoway
+*
+*    The first field is the address, the second is the module type
+*    (lamp, appliance, motion, signal or transceiver), and any remaining
+*    fields are capabilities (dimmable, extdim, twoway) or options
+*    (ttl=seconds, refresh=seconds, watts=power). Lamps are dimmable by
+*    default.
+*
+*    Names are looked up through a hash table, and addresses through a
+*    256 entry table.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "notify.h"
+#include "x10.h"
+#include "devreg.h"
+
+#define DEVREG_BUCKETS	256
+
+static const String typeNames[] = {
+	"undefined",
+	"lamp",
+	"appliance",
+	"motion",
+	"signal",
+	"transceiver",
+	NULL
+};
+
+static DevEntryPtr_t nameTable[DEVREG_BUCKETS];
+static DevEntryPtr_t addressTable[16][16];
+
+
+/*
+ * Hash a name of a given length. Same function as confreadHash()
+ */
+
+static uint32_t hashName(const char *name, size_t len)
+{
+	uint32_t hash;
+	size_t i;
+
+	for(hash = i = 0; i < len; ++i){
+		hash += name[i];
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+ 	}
+	hash += (hash << 3);
+	hash ^= (hash >> 11);
+	hash += (hash << 15);
+	return hash;
+}
+
+/*
+ * Parse one device entry value. Returns TRUE if it is valid
+ */
+
+static Bool parseEntry(DevEntryPtr_t de, const String value)
+{
+	char ws[128];
+	String field, next, end;
+	long unit, ttl, refresh, watts;
+	int i;
+	unsigned char hc;
+
+	confreadStringCopy(ws, value, sizeof(ws));
+
+	/* Address */
+	if((next = strchr(ws, ',')))
+		*next++ = 0;
+	if(x10_letter_to_housecode(ws[0], &hc))
+		return FALSE;
+	unit = strtol(ws + 1, &field, 10);
+	if((*field) || (unit < 1) || (unit > 16))
+		return FALSE;
+	de->house = toupper(ws[0]) - 'A';
+	de->unit = (uint8_t) unit - 1;
+
+	/* Type */
+	de->type = DEVICE_UNDEFINED;
+	if((field = next)){
+		if((next = strchr(field, ',')))
+			*next++ = 0;
+		for(i = 0; typeNames[i]; i++){
+			if(!strcmp(field, typeNames[i]))
+				break;
+		}
+		if(!typeNames[i])
+			return FALSE;
+		de->type = i;
+	}
+	de->caps = (de->type == DEVICE_LAMP) ? DEV_CAP_DIMMABLE : 0;
+
+	/* Capabilities */
+	while((field = next)){
+		if((next = strchr(field, ',')))
+			*next++ = 0;
+		if(!strcmp(field, "dimmable"))
+			de->caps |= DEV_CAP_DIMMABLE;
+		else if(!strcmp(field, "extdim"))
+			de->caps |= DEV_CAP_DIMMABLE | DEV_CAP_EXTDIM;
+		else if(!strcmp(field, "twoway"))
+			de->caps |= DEV_CAP_TWOWAY;
+		else if(!strncmp(field, "ttl=", 4)){
+			ttl = strtol(field + 4, &end, 10);
+			if((*end) || (end == field + 4) || (ttl < 0) || (ttl > 65535))
+				return FALSE;
+			de->ttl = (uint16_t) ttl;
+		}
+		else if(!strncmp(field, "refresh=", 8)){
+			refresh = strtol(field + 8, &end, 10);
+			if((*end) || (end == field + 8) || (refresh < 0))
+				return FALSE;
+			de->refresh = (unsigned) refresh;
+		}
+		else if(!strncmp(field, "watts=", 6)){
+			watts = strtol(field + 6, &end, 10);
+			if((*end) || (end == field + 6) || (watts < 0))
+				return FALSE;
+			de->watts = (unsigned) watts;
+		}
+		else
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Free the devices in a name table
+ */
+
+static void freeTable(DevEntryPtr_t *table)
+{
+	int i;
+	DevEntryPtr_t de, next;
+
+	for(i = 0; i < DEVREG_BUCKETS; i++){
+		for(de = table[i]; de; de = next){
+			next = de->next;
+			free(de->name);
+			free(de);
+		}
+		table[i] = NULL;
+	}
+}
+
+/*
+ * Carry the verification counts of a device over from the registry it replaces
+ */
+
+static void keepCounts(DevEntryPtr_t de, DevEntryPtr_t *oldTable)
+{
+	DevEntryPtr_t old;
+
+	for(old = oldTable[de->hash & (DEVREG_BUCKETS - 1)]; old; old = old->next){
+		if((old->hash == de->hash) && (!strcmp(old->name, de->name))){
+			de->verified = old->verified;
+			de->unverified = old->unverified;
+			de->resends = old->resends;
+			return;
+		}
+	}
+}
+
+
+/*
+ * Load the [devices] section of the config file
+ *
+ * Any previously loaded devices are discarded. Their verification counts
+ * are kept by devices of the same name. Returns the number of devices loaded.
+ */
+
+unsigned devregLoad(ConfigEntryPtr_t ce)
+{
+	KeyEntryPtr_t ke;
+	DevEntryPtr_t de;
+	DevEntryPtr_t oldTable[DEVREG_BUCKETS];
+	unsigned count = 0;
+	uint32_t bucket;
+
+	memcpy(oldTable, nameTable, sizeof(oldTable));
+	memset(nameTable, 0, sizeof(nameTable));
+	memset(addressTable, 0, sizeof(addressTable));
+
+	for(ke = confreadGetFirstKeyBySection(ce, "devices"); ke; ke = confreadGetNextKey(ke)){
+		if(!(de = calloc(1, sizeof(DevEntry_t))))
+			fatal("Out of memory in devregLoad()");
+		if(!parseEntry(de, confreadGetValue(ke))){
+			error("Bad device entry for %s on line %u", confreadGetKey(ke), confreadKeyLineNum(ke));
+			free(de);
+			continue;
+		}
+		if(devregFind(confreadGetKey(ke), strlen(confreadGetKey(ke)))){
+			error("Duplicate device name %s on line %u", confreadGetKey(ke), confreadKeyLineNum(ke));
+			free(de);
+			continue;
+		}
+		if(!(de->name = strdup(confreadGetKey(ke))))
+			fatal("Out of memory in devregLoad()");
+		de->hash = hashName(de->name, strlen(de->name));
+		keepCounts(de, oldTable);
+		bucket = de->hash & (DEVREG_BUCKETS - 1);
+		de->next = nameTable[bucket];
+		nameTable[bucket] = de;
+		if(addressTable[de->house][de->unit])
+			debug(DEBUG_EXPECTED, "Device %s shares address %c%u with %s", de->name, 'A' + de->house, de->unit + 1,
+			addressTable[de->house][de->unit]->name);
+		else
+			addressTable[de->house][de->unit] = de;
+		debug(DEBUG_ACTION, "Device %s: %c%u type %s caps %02X ttl %u", de->name, 'A' + de->house, de->unit + 1,
+		typeNames[de->type], de->caps, de->ttl);
+		count++;
+	}
+	freeTable(oldTable);
+	return count;
+}
+
+/*
+ * Free all devices
+ */
+
+void devregFree(void)
+{
+	freeTable(nameTable);
+	memset(addressTable, 0, sizeof(addressTable));
+}
+
+/*
+ * Find a device by name. The name does not need to be NUL terminated.
+ * Returns NULL if there is no such device.
+ */
+
+DevEntryPtr_t devregFind(const char *name, size_t len)
+{
+	uint32_t hash;
+	DevEntryPtr_t de;
+
+	if((!name) || (!len))
+		return NULL;
+	hash = hashName(name, len);
+	for(de = nameTable[hash & (DEVREG_BUCKETS - 1)]; de; de = de->next){
+		if((de->hash == hash) && (!strncmp(de->name, name, len)) && (!de->name[len]))
+			return de;
+	}
+	return NULL;
+}
+
+/*
+ * Find the device at an address. Returns NULL if nothing is registered there.
+ */
+
+DevEntryPtr_t devregByAddress(int house, int unit)
+{
+	if((house < 0) || (house > 15) || (unit < 0) || (unit > 15))
+		return NULL;
+	return addressTable[house][unit];
+}
+
+/*
+ * Return the name of a module type
+ */
+
+const String devregTypeName(unsigned type)
+{
+	if(type > DEVICE_TRANSCEIVER)
+		type = DEVICE_UNDEFINED;
+	return typeNames[type];
+}
@@ -0,0 +1,69 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Named device registry
+*
+*/
+
+#ifndef DEVREG_H
+#define DEVREG_H
+
+#include <stddef.h>
+#include "types.h"
+#include "confread.h"
+
+/* Capability bits */
+
+#define DEV_CAP_DIMMABLE	0x01
+#define DEV_CAP_EXTDIM		0x02	/* Accepts extended code dimming */
+#define DEV_CAP_TWOWAY		0x04	/* Replies to status requests */
+
+/* Typedefs */
+
+typedef struct devent DevEntry_t;
+typedef DevEntry_t * DevEntryPtr_t;
+
+/* Entry for a named device */
+
+struct devent{
+	uint32_t hash;
+	String name;
+	uint8_t house;		/* 0-15 for A-P */
+	uint8_t unit;		/* 0-15 for 1-16 */
+	uint8_t type;		/* DEVICE_ from x10.h */
+	uint8_t caps;
+	uint16_t ttl;		/* Default command time to live in seconds, 0 for none */
+	unsigned refresh;	/* Most seconds a two-way device's state may go unconfirmed, 0 for the default */
+	unsigned watts;		/* Power drawn when fully on, for usage statistics. 0 if not known */
+	unsigned verified;	/* Delivery verification counts */
+	unsigned unverified;
+	unsigned resends;
+	DevEntryPtr_t next;	/* Hash chain */
+};
+
+/*
+* Function prototypes
+*/
+
+unsigned devregLoad(ConfigEntryPtr_t ce);
+void devregFree(void);
+DevEntryPtr_t devregFind(const char *name, size_t len);
+DevEntryPtr_t devregByAddress(int house, int unit);
+const String devregTypeName(unsigned type);
+
+#endif
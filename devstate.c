@@ -0,0 +1,398 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Device state table
+*
+*    Tracks the last known state of all 256 X10 addresses. The table is
+*    updated from the commands we send and from the events the CM11A
+*    reports to us. Every change is passed on to the usage statistics.
+*
+*    The table can also be published in POSIX shared memory, laid out as
+*    in x10shm.h, so local processes can read device state directly.
+*    Every update of the published copy is done under its sequence lock.
+*
+*    So the daemon does not start out knowing nothing, the table is saved
+*    to a snapshot file at most DS_SNAPSHOT_SECS after it changes and at
+*    shutdown, and loaded again at start up. The file is a small header
+*    and one X10ShmEntry_t per address. Restored entries keep their old
+*    update times and are marked DS_RESTORED until the device is next
+*    set or heard from, so users of the table can tell how stale they
+*    are. Two-way devices get refreshed as their update times age.
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "notify.h"
+#include "confread.h"
+#include "x10.h"
+#include "devreg.h"
+#include "devstate.h"
+#include "usage.h"
+#include "x10shm.h"
+
+typedef struct snapheader SnapHeader_t;
+
+/* Snapshot file header, followed by 256 X10ShmEntry_t */
+
+struct snapheader{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entrySize;
+	int64_t saved;			/* When the snapshot was written */
+};
+
+static DevState_t devState[16][16];
+static X10ShmTablePtr_t shmTable = NULL;
+static char shmName[64] = "";
+static char snapPath[256] = "";
+static Bool snapDirty = FALSE;
+static time_t snapSaved = 0;
+
+
+/*
+ * Start and finish an update of the published table
+ */
+
+static void shmBegin(void)
+{
+	if(shmTable){
+		shmTable->seq++; /* Odd, readers wait */
+		__sync_synchronize();
+	}
+}
+
+static void shmEnd(void)
+{
+	if(shmTable){
+		__sync_synchronize();
+		shmTable->seq++;
+	}
+}
+
+/*
+ * Copy one device to the published table. Must be between shmBegin() and shmEnd()
+ */
+
+static void shmCopy(DevStatePtr_t ds)
+{
+	unsigned index = ds - &devState[0][0];
+	X10ShmEntryPtr_t e;
+
+	if(!shmTable)
+		return;
+	e = &shmTable->entry[index / 16][index % 16];
+	e->flags = ds->flags;
+	e->level = ds->level;
+	e->seq = ds->seq;
+	e->changed = (int64_t) ds->changed;
+	e->updated = (int64_t) ds->updated;
+}
+
+/*
+ * Set the state of one device
+ */
+
+static void setState(DevStatePtr_t ds, Bool on, int level, time_t now)
+{
+	uint8_t flags = DS_KNOWN | (on ? DS_ON : 0);
+
+	if(level < 0)
+		level = 0;
+	else if(level > 100)
+		level = 100;
+
+	ds->updated = now;
+	snapDirty = TRUE;
+
+	if(((ds->flags & ~DS_RESTORED) != flags) || (ds->level != level)){
+		ds->level = (uint8_t) level;
+		ds->changed = now;
+		ds->seq++;
+		usageChange((ds - &devState[0][0]) / 16, (ds - &devState[0][0]) % 16, on, ds->level, now);
+	}
+	/* Set or confirmed, so no longer restored */
+	ds->flags = flags;
+	shmCopy(ds);
+}
+
+
+/*
+ * Apply an X10 function to the devices in a unit mask
+ *
+ * Whole house functions ignore the unit mask.
+ * For dim and bright, level is the amount of change in percent.
+ */
+
+void devstateApply(int house, unsigned unitmask, unsigned function, int level)
+{
+	int unit;
+	time_t now = time(NULL);
+	DevStatePtr_t ds;
+	DevEntryPtr_t de;
+
+	if((house < 0) || (house > 15)){
+		debug(DEBUG_UNEXPECTED, "Bad house index passed to devstateApply()");
+		return;
+	}
+
+	switch(function){
+		case COMMAND_ALL_UNITS_OFF:
+		case COMMAND_ALL_LIGHTS_OFF:
+		case COMMAND_ALL_LIGHTS_ON:
+			unitmask = 0xFFFF;
+			break;
+
+		default:
+			break;
+	}
+
+	shmBegin();
+	for(unit = 0; unit < 16; unit++){
+		if(!(unitmask & (1 << unit)))
+			continue;
+		/* All lights on/off only reach lamp modules */
+		if(((function == COMMAND_ALL_LIGHTS_ON) || (function == COMMAND_ALL_LIGHTS_OFF)) &&
+		(de = devregByAddress(house, unit)) && (de->type != DEVICE_LAMP))
+			continue;
+		ds = &devState[house][unit];
+		switch(function){
+			case COMMAND_ALL_LIGHTS_ON:
+				setState(ds, TRUE, 100, now);
+				break;
+
+			case COMMAND_ON:
+			case COMMAND_STATUS_ON:
+				setState(ds, TRUE, ((ds->flags & DS_KNOWN) && ds->level) ? ds->level : 100, now);
+				break;
+
+			case COMMAND_ALL_UNITS_OFF:
+			case COMMAND_ALL_LIGHTS_OFF:
+			case COMMAND_OFF:
+			case COMMAND_STATUS_OFF:
+				setState(ds, FALSE, ds->level, now);
+				break;
+
+			case COMMAND_DIM:
+				if(!(ds->flags & DS_KNOWN))
+					setState(ds, TRUE, 100 - level, now);
+				else
+					setState(ds, ds->level > level, ds->level - level, now);
+				break;
+
+			case COMMAND_BRIGHT:
+				setState(ds, TRUE, ds->level + level, now);
+				break;
+
+			default: /* Function does not change state */
+				break;
+		}
+	}
+	shmEnd();
+}
+
+
+/*
+ * Return a pointer to the state of one device
+ */
+
+DevStatePtr_t devstateGet(int house, int unit)
+{
+	if((house < 0) || (house > 15) || (unit < 0) || (unit > 15))
+		return NULL;
+	return &devState[house][unit];
+}
+
+/*
+ * Return a printable name for the state of a device
+ */
+
+const String devstateName(DevStatePtr_t ds)
+{
+	if((!ds) || (!(ds->flags & DS_KNOWN)))
+		return "unknown";
+	return (ds->flags & DS_ON) ? "on" : "off";
+}
+
+/*
+ * Publish the table in a POSIX shared memory object
+ *
+ * The name starts with a slash, for example /xplx10. The object is
+ * created if need be and filled with the current state. Returns FALSE
+ * if it could not be set up.
+ */
+
+Bool devstatePublish(const String name)
+{
+	int fd, i;
+	void *p;
+
+	if((!name) || (name[0] != '/') || (shmTable))
+		return FALSE;
+	if((fd = shm_open(name, O_CREAT | O_RDWR, 0644)) < 0){
+		debug(DEBUG_UNEXPECTED, "Could not open shared memory %s: %s", name, strerror(errno));
+		return FALSE;
+	}
+	if(ftruncate(fd, sizeof(X10ShmTable_t))){
+		debug(DEBUG_UNEXPECTED, "Could not size shared memory %s: %s", name, strerror(errno));
+		close(fd);
+		return FALSE;
+	}
+	p = mmap(NULL, sizeof(X10ShmTable_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED){
+		debug(DEBUG_UNEXPECTED, "Could not map shared memory %s: %s", name, strerror(errno));
+		return FALSE;
+	}
+	shmTable = p;
+	confreadStringCopy(shmName, name, sizeof(shmName));
+
+	/* An old writer may have left seq odd, make sure readers wait while it is filled */
+	shmTable->seq |= 1;
+	__sync_synchronize();
+	shmTable->magic = X10SHM_MAGIC;
+	shmTable->version = X10SHM_VERSION;
+	shmTable->entrySize = sizeof(X10ShmEntry_t);
+	shmTable->pid = (int32_t) getpid();
+	for(i = 0; i < 256; i++)
+		shmCopy(&devState[0][0] + i);
+	shmEnd();
+	debug(DEBUG_STATUS, "Device state published in shared memory %s", name);
+	return TRUE;
+}
+
+/*
+ * Stop publishing, and remove the shared memory object
+ *
+ * Readers which still have it mapped see pid 0.
+ */
+
+void devstateUnpublish(void)
+{
+	if(!shmTable)
+		return;
+	shmTable->pid = 0;
+	munmap((void *) shmTable, sizeof(X10ShmTable_t));
+	shmTable = NULL;
+	(void) shm_unlink(shmName);
+}
+
+/*
+ * Load the snapshot saved before the last exit, and remember where to save the next
+ *
+ * Called once at start up, before anything sets the state of a device.
+ * Entries are marked restored, unless the snapshot was saved for an
+ * upgrade handoff just now, when they keep the mark they had.
+ */
+
+void devstateRestore(const String path, Bool handoff)
+{
+	FILE *file;
+	SnapHeader_t hdr;
+	X10ShmEntry_t e[256];
+	DevStatePtr_t ds;
+	unsigned i, count = 0;
+	time_t now = time(NULL);
+
+	if((!path) || (!path[0]))
+		return;
+	confreadStringCopy(snapPath, path, sizeof(snapPath));
+	if(!(file = fopen(snapPath, "r")))
+		return;
+	if((fread(&hdr, sizeof(hdr), 1, file) != 1) || (hdr.magic != DS_SNAPSHOT_MAGIC) ||
+	(hdr.version != DS_SNAPSHOT_VERSION) || (hdr.entrySize != sizeof(X10ShmEntry_t)) ||
+	(fread(e, sizeof(e), 1, file) != 1)){
+		debug(DEBUG_UNEXPECTED, "State snapshot %s is not usable", snapPath);
+		fclose(file);
+		return;
+	}
+	fclose(file);
+
+	shmBegin();
+	for(i = 0; i < 256; i++){
+		if(!(e[i].flags & DS_KNOWN))
+			continue;
+		ds = &devState[0][0] + i;
+		ds->flags = (e[i].flags & (DS_KNOWN | DS_ON)) | (handoff ? (e[i].flags & DS_RESTORED) : DS_RESTORED);
+		ds->level = (e[i].level > 100) ? 100 : e[i].level;
+		ds->seq = e[i].seq;
+		ds->changed = (time_t) e[i].changed;
+		ds->updated = (time_t) e[i].updated;
+		shmCopy(ds);
+		usageResume(i / 16, i % 16, (ds->flags & DS_ON) ? TRUE : FALSE, ds->level, now);
+		count++;
+	}
+	shmEnd();
+	snapSaved = now;
+	debug(DEBUG_STATUS, "Restored the state of %u devices from %s, saved %ld seconds ago", count, snapPath,
+	(long) (now - hdr.saved));
+}
+
+/*
+ * Write a snapshot of the table to the snapshot file
+ */
+
+static Bool writeSnapshot(FILE *file, void *arg)
+{
+	SnapHeader_t hdr;
+	X10ShmEntry_t e[256];
+	DevStatePtr_t ds;
+	unsigned i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DS_SNAPSHOT_MAGIC;
+	hdr.version = DS_SNAPSHOT_VERSION;
+	hdr.entrySize = sizeof(X10ShmEntry_t);
+	hdr.saved = (int64_t) snapSaved;
+	memset(e, 0, sizeof(e));
+	for(i = 0; i < 256; i++){
+		ds = &devState[0][0] + i;
+		e[i].flags = ds->flags;
+		e[i].level = ds->level;
+		e[i].seq = ds->seq;
+		e[i].changed = (int64_t) ds->changed;
+		e[i].updated = (int64_t) ds->updated;
+	}
+	return ((fwrite(&hdr, sizeof(hdr), 1, file) == 1) && (fwrite(e, sizeof(e), 1, file) == 1)) ? TRUE : FALSE;
+}
+
+/*
+ * Save a snapshot of the table
+ */
+
+void devstateSave(void)
+{
+	snapDirty = FALSE;
+	snapSaved = time(NULL);
+	if((snapPath[0]) && (!confreadReplaceFile(snapPath, writeSnapshot, NULL)))
+		debug(DEBUG_UNEXPECTED, "Could not save state snapshot %s", snapPath);
+}
+
+/*
+ * Save a snapshot if the table has changed and it is time to. Called once a second
+ */
+
+void devstateTick(void)
+{
+	if((snapDirty) && (time(NULL) - snapSaved >= DS_SNAPSHOT_SECS))
+		devstateSave();
+}
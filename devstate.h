@@ -0,0 +1,71 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Device state table
+*
+*/
+
+#ifndef DEVSTATE_H
+#define DEVSTATE_H
+
+#include <time.h>
+#include "types.h"
+
+/* Flag bits */
+
+#define DS_KNOWN	0x01	/* State has been seen at least once */
+#define DS_ON		0x02	/* Device is on */
+#define DS_RESTORED	0x04	/* Loaded from the snapshot, not yet set or confirmed since */
+
+/* Snapshot file */
+
+#define DS_SNAPSHOT_MAGIC	0x58313057	/* "X10W" */
+#define DS_SNAPSHOT_VERSION	1
+#define DS_SNAPSHOT_SECS	60		/* Most seconds between saves while anything has changed */
+
+/* Typedefs */
+
+typedef struct devstate DevState_t;
+typedef DevState_t * DevStatePtr_t;
+
+/* One entry per X10 address */
+
+struct devstate{
+	uint8_t flags;
+	uint8_t level;		/* 0-100 percent */
+	time_t changed;		/* Time of last change */
+	time_t updated;		/* Time the state was last set or confirmed */
+	uint32_t seq;		/* Bumped on every change */
+};
+
+/*
+* Function prototypes
+*/
+
+/* House is 0-15 for A-P, unit is 0-15 for 1-16, bit 0 of unitmask is unit 1 */
+
+void devstateApply(int house, unsigned unitmask, unsigned function, int level);
+DevStatePtr_t devstateGet(int house, int unit);
+const String devstateName(DevStatePtr_t ds);
+Bool devstatePublish(const String name);
+void devstateUnpublish(void);
+void devstateRestore(const String path, Bool handoff);
+void devstateSave(void);
+void devstateTick(void);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Idle-time discovery of responsive modules
+*
+*    Walks every house with a hail request, then every unit in it with a
+*    status request, one request at a time and only while nothing else
+*    is using the powerline. Each request is a single address and
+*    function, so real work waits at most one frame behind it, and a
+*    request still waiting in the queue is cancelled when work arrives.
+*
+*    Progress and results are saved to a file in config file format after
+*    every step, so a sweep carries on where it left off after a restart.
+*    Units which answered a status request are written out as [devices]
+*    entries which can be pasted into the config file:
+*
+*    [discovery]
+*    cursor = 40
+*    running = yes
+*    hail = A,C
+*
+*    [devices]
+*    discovered-a3 = A3, undefined, twoway
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include "notify.h"
+#include "confread.h"
+#include "x10.h"
+#include "devstate.h"
+#include "txq.h"
+#include "verify.h"
+#include "refresh.h"
+#include "discover.h"
+
+static char filePath[256] = "";
+static Bool running = FALSE;
+static unsigned cursor = 0;		/* Next step. House is cursor / 17, 0 is the hail, 1-16 the units */
+static uint16_t hailHouses = 0;
+static uint16_t responded[16];
+static TxJobPtr_t requestJob = NULL;	/* Request waiting in the queue */
+static time_t deadline = 0;		/* For replies to the request sent */
+static Bool waiting = FALSE;
+
+
+/*
+ * Write the progress and results to the discovery file
+ */
+
+static Bool writeProgress(FILE *file, void *arg)
+{
+	int house, unit;
+	Bool first = TRUE;
+
+	fprintf(file, "[discovery]\ncursor = %u\nrunning = %s\nhail = ", cursor, running ? "yes" : "no");
+	for(house = 0; house < 16; house++){
+		if(hailHouses & (1 << house)){
+			fprintf(file, "%s%c", first ? "" : ",", 'A' + house);
+			first = FALSE;
+		}
+	}
+	fprintf(file, "\n\n[devices]\n");
+	for(house = 0; house < 16; house++){
+		for(unit = 0; unit < 16; unit++){
+			if(responded[house] & (1 << unit))
+				fprintf(file, "discovered-%c%d = %c%d, undefined, twoway\n", 'a' + house, unit + 1, 'A' + house, unit + 1);
+		}
+	}
+	return ferror(file) ? FALSE : TRUE;
+}
+
+/*
+ * Save the progress and results
+ */
+
+static void save(void)
+{
+	if((filePath[0]) && (!confreadReplaceFile(filePath, writeProgress, NULL)))
+		debug(DEBUG_UNEXPECTED, "Could not save discovery file %s", filePath);
+}
+
+/*
+ * Load the progress and results of an earlier sweep
+ */
+
+static void load(void)
+{
+	ConfigEntryPtr_t ce;
+	KeyEntryPtr_t ke;
+	String p;
+	int house, unit;
+	unsigned value;
+
+	if((!filePath[0]) || (access(filePath, R_OK)) || (!(ce = confreadScan(filePath, confreadDefErrorHandler))))
+		return;
+	if((confreadValueBySectKeyAsUnsigned(ce, "discovery", "cursor", &value)) && (value <= DISCOVER_STEPS))
+		cursor = value;
+	if((p = confreadValueBySectKey(ce, "discovery", "running")))
+		running = strcmp(p, "yes") ? FALSE : TRUE;
+	for(p = confreadValueBySectKey(ce, "discovery", "hail"); (p) && (*p); p++){
+		if((toupper(*p) >= 'A') && (toupper(*p) <= 'P'))
+			hailHouses |= 1 << (toupper(*p) - 'A');
+	}
+	for(ke = confreadGetFirstKeyBySection(ce, "devices"); ke; ke = confreadGetNextKey(ke)){
+		p = confreadGetValue(ke);
+		house = toupper(p[0]) - 'A';
+		unit = atoi(p + 1) - 1;
+		if((house >= 0) && (house < 16) && (unit >= 0) && (unit < 16))
+			responded[house] |= 1 << unit;
+	}
+	confreadFree(ce);
+	debug(DEBUG_STATUS, "Discovery resumed at step %u of %u", cursor, DISCOVER_STEPS);
+}
+
+/*
+ * Called by the transmit queue when a request has been sent
+ */
+
+static void requestSent(TxJobPtr_t job)
+{
+	requestJob = NULL;
+	if(job->result == TXQ_OK){
+		deadline = time(NULL) + DISCOVER_REPLY_SECS;
+		waiting = TRUE;
+	}
+}
+
+/*
+ * Match the queued discovery request
+ */
+
+static Bool matchRequest(TxJobPtr_t job, void *arg)
+{
+	return (job == requestJob) ? TRUE : FALSE;
+}
+
+
+/*
+ * Set the path of the discovery file and resume any sweep saved in it
+ */
+
+void discoverInit(const String path)
+{
+	confreadStringCopy(filePath, path, sizeof(filePath));
+	load();
+}
+
+/*
+ * Start the sweep, from the beginning if restart is TRUE, otherwise from where it left off
+ */
+
+void discoverStart(Bool restart)
+{
+	if((restart) || (cursor >= DISCOVER_STEPS)){
+		cursor = 0;
+		hailHouses = 0;
+		memset(responded, 0, sizeof(responded));
+	}
+	running = TRUE;
+	save();
+}
+
+/*
+ * Pause the sweep
+ */
+
+void discoverStop(void)
+{
+	if((requestJob) && (!requestJob->started.tv_sec))
+		txqCancel(matchRequest, NULL);
+	running = FALSE;
+	save();
+}
+
+/*
+ * Send the next request if the powerline is idle. Called once a second
+ */
+
+void discoverTick(void)
+{
+	int house, slot;
+	X10Addrs_t addrs;
+	static X10Plan_t plan;
+
+	if(!running)
+		return;
+
+	/* Yield to everything else */
+	if((txqPending() > (requestJob ? 1U : 0U)) || (!verifyIdle()) || (!refreshIdle())){
+		if((requestJob) && (!requestJob->started.tv_sec))
+			txqCancel(matchRequest, NULL);
+		return;
+	}
+
+	if(requestJob)
+		return;
+	if(waiting){
+		if(time(NULL) < deadline)
+			return;
+		waiting = FALSE;
+		cursor++;
+		save();
+	}
+
+	if(cursor >= DISCOVER_STEPS){
+		debug(DEBUG_STATUS, "Discovery sweep complete");
+		running = FALSE;
+		save();
+		return;
+	}
+
+	house = cursor / 17;
+	slot = cursor % 17;
+	memset(&addrs, 0, sizeof(addrs));
+	addrs.houses = 1 << house;
+	planInit(&plan);
+	if(!slot){
+		/* The planner only sends a function with addresses, so the hail goes out after unit 1 */
+		addrs.units[house] = 1;
+		planAddFunction(&plan, &addrs, COMMAND_HAIL_REQUEST, 0, 0, 0, house);
+	}
+	else{
+		addrs.units[house] = 1 << (slot - 1);
+		planAddFunction(&plan, &addrs, COMMAND_STATUS_REQUEST, 0, 0, 0, house);
+	}
+	debug(DEBUG_ACTION, "Discovery step %u: %s %c%d", cursor, slot ? "status" : "hail", 'A' + house, slot ? slot : 1);
+	requestJob = txqSubmit(NULL, &plan, requestSent);
+}
+
+/*
+ * Record a status reply to the request outstanding
+ *
+ * Returns TRUE if the reply was for discovery.
+ */
+
+Bool discoverStatusReply(int house, unsigned unitmask, Bool on)
+{
+	int unit;
+
+	if((!waiting) || (cursor >= DISCOVER_STEPS) || (!(cursor % 17)) || (house != (int) (cursor / 17)))
+		return FALSE;
+	unit = (cursor % 17) - 1;
+	if((unitmask) && (!(unitmask & (1 << unit))))
+		return FALSE;
+	debug(DEBUG_STATUS, "Discovered two-way module at %c%d", 'A' + house, unit + 1);
+	responded[house] |= 1 << unit;
+	devstateApply(house, 1 << unit, on ? COMMAND_STATUS_ON : COMMAND_STATUS_OFF, 0);
+	return TRUE;
+}
+
+/*
+ * Record a hail acknowledge
+ */
+
+void discoverHailAck(int house)
+{
+	if((house < 0) || (house > 15) || (!running))
+		return;
+	debug(DEBUG_STATUS, "Hail acknowledged in house %c", 'A' + house);
+	hailHouses |= 1 << house;
+}
+
+/*
+ * Return TRUE if a sweep is running
+ */
+
+Bool discoverRunning(void)
+{
+	return running;
+}
+
+/*
+ * Return the number of steps done
+ */
+
+unsigned discoverProgress(void)
+{
+	return cursor;
+}
+
+/*
+ * Return the houses which answered a hail, and the units which answered a status request
+ */
+
+void discoverResults(uint16_t *houses, uint16_t units[16])
+{
+	*houses = hailHouses;
+	memcpy(units, responded, sizeof(responded));
+}
@@ -0,0 +1,48 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Idle-time discovery of responsive modules
+*
+*/
+
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include "types.h"
+
+/* One hail request and 16 status requests per house */
+#define DISCOVER_STEPS		(16 * 17)
+
+/* Seconds to wait for replies once a request has gone out */
+#define DISCOVER_REPLY_SECS	2
+
+/*
+* Function prototypes
+*/
+
+void discoverInit(const String path);
+void discoverStart(Bool restart);
+void discoverStop(void);
+void discoverTick(void);
+Bool discoverStatusReply(int house, unsigned unitmask, Bool on);
+void discoverHailAck(int house);
+Bool discoverRunning(void);
+unsigned discoverProgress(void);
+void discoverResults(uint16_t *hailHouses, uint16_t responded[16]);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    History scan benchmark
+*
+*    Built with make histscan-bench. Fills the column store with a month
+*    of synthetic powerline events, HSCAN_CAPACITY of them, then times
+*    some typical counting queries with the vector and scalar kernels.
+*    The two must agree on every count.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "notify.h"
+#include "histscan.h"
+
+/* Runs of each query. The fastest is reported */
+#define BENCH_RUNS		10
+
+#define BENCH_DAYS		30
+
+char *progName;
+int debugLvl = 0;
+
+/* One query to time */
+
+typedef struct benchquery{
+	const String name;
+	uint16_t houseMask;
+	uint16_t functionMask;
+	uint16_t unitMask;
+	int todFrom;
+	int todTo;
+} BenchQuery_t;
+
+static BenchQuery_t queries[] = {
+	{"house C on/off overnight", 1 << 2, (1 << 2) | (1 << 3), 0xFFFF, 2 * 3600, 5 * 3600},
+	{"A1 anything, all day", 1 << 0, 0xFFFF, 1 << 0, 0, 0},
+	{"dims in any house, evening", 0xFFFF, (1 << 4) | (1 << 5), 0xFFFF, 18 * 3600, 23 * 3600},
+	{NULL, 0, 0, 0, 0, 0}
+};
+
+
+/*
+ * Fill the column store with events spread evenly over the last BENCH_DAYS days
+ *
+ * Mostly on and off to a few busy addresses, with some dims and the
+ * odd house wide function, as a real installation would see.
+ */
+
+static void fill(time_t now)
+{
+	uint64_t n;
+	time_t start = now - BENCH_DAYS * HSCAN_DAY;
+	unsigned r, function, unitmask;
+	int house;
+
+	srand(1);
+	histscanReset();
+	for(n = 0; n < HSCAN_CAPACITY; n++){
+		r = (unsigned) rand();
+		house = ((r & 0x03) ? (r >> 2) & 0x03 : (r >> 2) & 0x0F);
+		switch((r >> 6) & 0x0F){
+			case 0:
+				function = 0x01 + 5 * ((r >> 10) & 1); /* All lights on or off */
+				unitmask = 0;
+				break;
+			case 1:
+			case 2:
+				function = 0x04 + ((r >> 10) & 1); /* Dim or bright */
+				unitmask = 1 << ((r >> 11) & 0x0F);
+				break;
+			default:
+				function = 0x02 + ((r >> 10) & 1); /* On or off */
+				unitmask = 1 << ((r >> 11) & 0x07);
+				break;
+		}
+		histscanAppend(n, start + (time_t) (n * (BENCH_DAYS * HSCAN_DAY) / HSCAN_CAPACITY),
+		house, unitmask, function, (r >> 15) & 1);
+	}
+}
+
+/*
+ * Run a query a few times with one kernel, returning the fastest
+ */
+
+static void timeQuery(HScanQueryPtr_t q, HScanResultPtr_t best)
+{
+	HScanResult_t r;
+	int i;
+
+	for(i = 0; i < BENCH_RUNS; i++){
+		histscanCount(q, &r);
+		if((!i) || (r.usec < best->usec))
+			*best = r;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	HScanQuery_t q;
+	HScanResult_t vr, sr;
+	BenchQuery_t *bq;
+	time_t now = time(NULL);
+	int failed = 0;
+
+	progName = argv[0];
+	fill(now);
+	printf("%u events over %d days, %s kernel, best of %d runs\n", (unsigned) HSCAN_CAPACITY, BENCH_DAYS,
+	histscanKernel(), BENCH_RUNS);
+
+	for(bq = queries; bq->name; bq++){
+		memset(&q, 0, sizeof(q));
+		q.houseMask = bq->houseMask;
+		q.functionMask = bq->functionMask;
+		q.unitMask = bq->unitMask;
+		q.direction = HSCAN_RX | HSCAN_TX;
+		q.from = now - BENCH_DAYS * HSCAN_DAY;
+		q.to = now;
+		q.todFrom = bq->todFrom;
+		q.todTo = bq->todTo;
+		timeQuery(&q, &vr);
+		q.scalar = TRUE;
+		timeQuery(&q, &sr);
+		printf("%-28s %7u matched of %u: %s %6u us, scalar %6u us\n", bq->name, vr.matched, vr.scanned,
+		histscanKernel(), vr.usec, sr.usec);
+		if(vr.matched != sr.matched){
+			printf("  kernels disagree: scalar matched %u\n", sr.matched);
+			failed = 1;
+		}
+	}
+	histscanReset();
+	return failed;
+}
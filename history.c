@@ -0,0 +1,483 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Powerline event history
+*
+*    Every event we send or receive is appended to a memory mapped
+*    segment file as a fixed size record. Segment files are named
+*    history.NNNNNNNN after their number and hold HIST_SEGMENT_RECORDS
+*    records each. When one fills a new one is started, and the oldest
+*    is deleted so at most HIST_SEGMENTS are kept. The files are sparse,
+*    so a new segment only takes disk space as it is written.
+*
+*    Records are numbered across segments, record n being in segment
+*    n / HIST_SEGMENT_RECORDS, and are in time order. Queries by time use
+*    a binary search over the record numbers. Queries by address use an
+*    in-memory index of the last HIST_INDEX_DEPTH record numbers for
+*    each address, rebuilt from the segments when they are opened.
+*
+*    Source names are kept in a small table in each segment header, so
+*    a record only needs a one byte index.
+*
+*    Every record is also passed to the column store in histscan.c, for
+*    queries which count events over long periods.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "notify.h"
+#include "confread.h"
+#include "history.h"
+#include "histscan.h"
+
+typedef struct histindex HistIndex_t;
+typedef HistIndex_t * HistIndexPtr_t;
+
+/* Recent record numbers for one address */
+
+struct histindex{
+	unsigned head;			/* Next slot to write */
+	unsigned count;
+	uint64_t record[HIST_INDEX_DEPTH];
+};
+
+static char histDir[256] = "";
+static HistSegmentPtr_t segment[HIST_SEGMENTS];	/* By segment number modulo HIST_SEGMENTS */
+static uint32_t firstSegment;			/* Oldest segment kept */
+static uint32_t lastSegment;			/* Segment being written */
+static HistIndex_t addrIndex[16][16];
+
+
+/*
+ * Make the path of a segment file
+ */
+
+static void segmentPath(String path, size_t size, uint32_t number)
+{
+	snprintf(path, size, "%s/history.%08u", histDir, number);
+}
+
+/*
+ * Map a segment file, creating it if asked to
+ *
+ * Returns NULL if the file could not be used.
+ */
+
+static HistSegmentPtr_t mapSegment(uint32_t number, Bool create)
+{
+	char path[320];
+	int fd;
+	void *p;
+	HistSegmentPtr_t seg;
+
+	segmentPath(path, sizeof(path), number);
+	if((fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644)) < 0){
+		debug(DEBUG_UNEXPECTED, "Could not open history segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if((create) && (ftruncate(fd, sizeof(HistSegment_t)))){
+		debug(DEBUG_UNEXPECTED, "Could not size history segment %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, sizeof(HistSegment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED){
+		debug(DEBUG_UNEXPECTED, "Could not map history segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	seg = p;
+	if(create){
+		seg->magic = HIST_MAGIC;
+		seg->version = HIST_VERSION;
+		seg->recordSize = sizeof(HistRecord_t);
+		seg->number = number;
+		seg->count = 0;
+		confreadStringCopy(seg->source[0], "powerline", HIST_SOURCE_LEN);
+	}
+	else if((seg->magic != HIST_MAGIC) || (seg->version != HIST_VERSION) ||
+	(seg->recordSize != sizeof(HistRecord_t)) || (seg->number != number) || (seg->count > HIST_SEGMENT_RECORDS)){
+		debug(DEBUG_UNEXPECTED, "History segment %s is not usable", path);
+		munmap(p, sizeof(HistSegment_t));
+		return NULL;
+	}
+	return seg;
+}
+
+/*
+ * Unmap a segment, and delete its file if asked to
+ */
+
+static void dropSegment(uint32_t number, Bool remove)
+{
+	char path[320];
+	HistSegmentPtr_t *sp = &segment[number % HIST_SEGMENTS];
+
+	if((*sp) && ((*sp)->number == number)){
+		munmap(*sp, sizeof(HistSegment_t));
+		*sp = NULL;
+	}
+	if(remove){
+		segmentPath(path, sizeof(path), number);
+		(void) unlink(path);
+	}
+}
+
+/*
+ * Return a record by number, or NULL if it is not kept
+ */
+
+static HistRecordPtr_t recordAt(uint64_t n)
+{
+	uint32_t number = (uint32_t) (n / HIST_SEGMENT_RECORDS);
+	HistSegmentPtr_t seg = segment[number % HIST_SEGMENTS];
+
+	if((!seg) || (seg->number != number) || ((n % HIST_SEGMENT_RECORDS) >= seg->count))
+		return NULL;
+	return &seg->record[n % HIST_SEGMENT_RECORDS];
+}
+
+/*
+ * Return the number the next record will get
+ */
+
+static uint64_t nextRecord(void)
+{
+	HistSegmentPtr_t seg = segment[lastSegment % HIST_SEGMENTS];
+
+	return (uint64_t) lastSegment * HIST_SEGMENT_RECORDS + (seg ? seg->count : 0);
+}
+
+/*
+ * Return the number of the oldest record kept
+ */
+
+static uint64_t firstRecord(void)
+{
+	return (uint64_t) firstSegment * HIST_SEGMENT_RECORDS;
+}
+
+/*
+ * Add a record number to the index of each address it applies to, and to the column store
+ *
+ * House wide functions have no units, and are indexed under every unit in the house.
+ */
+
+static void indexRecord(HistRecordPtr_t r, uint64_t n)
+{
+	int unit;
+	HistIndexPtr_t hi;
+
+	if(r->house > 15)
+		return;
+	histscanAppend(n, (time_t) r->time, r->house, r->unitmask, r->function, (r->flags & HIST_TX) ? TRUE : FALSE);
+	for(unit = 0; unit < 16; unit++){
+		if((r->unitmask) && (!(r->unitmask & (1 << unit))))
+			continue;
+		hi = &addrIndex[r->house][unit];
+		hi->record[hi->head] = n;
+		hi->head = (hi->head + 1) % HIST_INDEX_DEPTH;
+		if(hi->count < HIST_INDEX_DEPTH)
+			hi->count++;
+	}
+}
+
+/*
+ * Start a new segment, deleting the oldest if there are too many
+ */
+
+static Bool rotate(void)
+{
+	uint32_t number = lastSegment + 1;
+	HistSegmentPtr_t seg;
+
+	if(number - firstSegment >= HIST_SEGMENTS){
+		dropSegment(firstSegment, TRUE);
+		firstSegment++;
+		histscanDrop(firstRecord());
+	}
+	if(!(seg = mapSegment(number, TRUE)))
+		return FALSE;
+	segment[number % HIST_SEGMENTS] = seg;
+	lastSegment = number;
+	debug(DEBUG_STATUS, "Started history segment %u", number);
+	return TRUE;
+}
+
+/*
+ * Return the index of a source name in the segment being written, adding it if need be
+ */
+
+static uint8_t sourceIndex(HistSegmentPtr_t seg, const String source)
+{
+	int i;
+
+	for(i = 0; (i < HIST_MAX_SOURCES) && (seg->source[i][0]); i++){
+		if(!strncmp(seg->source[i], source, HIST_SOURCE_LEN - 1))
+			return i;
+	}
+	if(i == HIST_MAX_SOURCES)
+		return HIST_SOURCE_NONE;
+	confreadStringCopy(seg->source[i], source, HIST_SOURCE_LEN);
+	return i;
+}
+
+/*
+ * Fill in an event from a record
+ */
+
+static void copyEvent(HistEventPtr_t e, uint64_t n, HistRecordPtr_t r)
+{
+	HistSegmentPtr_t seg = segment[(n / HIST_SEGMENT_RECORDS) % HIST_SEGMENTS];
+
+	e->time = (time_t) r->time;
+	e->msec = r->msec;
+	e->house = r->house;
+	e->unitmask = r->unitmask;
+	e->function = r->function;
+	e->level = r->level;
+	e->tx = (r->flags & HIST_TX) ? TRUE : FALSE;
+	if(r->source < HIST_MAX_SOURCES)
+		confreadStringCopy(e->source, seg->source[r->source], HIST_SOURCE_LEN);
+	else
+		confreadStringCopy(e->source, "other", HIST_SOURCE_LEN);
+}
+
+/*
+ * Open the history in a directory, picking up the segments already there
+ *
+ * Returns FALSE if history could not be started.
+ */
+
+Bool historyOpen(const String dir)
+{
+	DIR *d;
+	struct dirent *de;
+	unsigned long number;
+	char *end;
+	char path[320];
+	Bool found = FALSE;
+	uint32_t newest = 0;
+	uint64_t n, last;
+
+	if((!dir) || (!dir[0]) || (histDir[0]))
+		return FALSE;
+	if(!(d = opendir(dir))){
+		debug(DEBUG_UNEXPECTED, "Could not open history directory %s: %s", dir, strerror(errno));
+		return FALSE;
+	}
+	confreadStringCopy(histDir, dir, sizeof(histDir));
+
+	/* Find the newest segment */
+	while((de = readdir(d))){
+		if((strlen(de->d_name) != 16) || (strncmp(de->d_name, "history.", 8)))
+			continue;
+		number = strtoul(de->d_name + 8, &end, 10);
+		if((*end) || (end == de->d_name + 8) || (number >= 0xFFFFFFFFUL))
+			continue;
+		if((!found) || (number > newest))
+			newest = (uint32_t) number;
+		found = TRUE;
+	}
+
+	/* Keep the run of usable segments ending with the newest. Only the newest can be part full */
+	if((found) && ((segment[newest % HIST_SEGMENTS] = mapSegment(newest, FALSE)))){
+		firstSegment = lastSegment = newest;
+		while((firstSegment) && (lastSegment - (firstSegment - 1) < HIST_SEGMENTS) &&
+		(segment[(firstSegment - 1) % HIST_SEGMENTS] = mapSegment(firstSegment - 1, FALSE)) &&
+		(segment[(firstSegment - 1) % HIST_SEGMENTS]->count == HIST_SEGMENT_RECORDS))
+			firstSegment--;
+		if(firstSegment)
+			dropSegment(firstSegment - 1, FALSE);
+	}
+	else{
+		firstSegment = lastSegment = found ? newest + 1 : 0;
+		if(!(segment[lastSegment % HIST_SEGMENTS] = mapSegment(lastSegment, TRUE))){
+			closedir(d);
+			histDir[0] = 0;
+			return FALSE;
+		}
+	}
+
+	/* Delete everything else */
+	rewinddir(d);
+	while((de = readdir(d))){
+		if((strlen(de->d_name) != 16) || (strncmp(de->d_name, "history.", 8)))
+			continue;
+		number = strtoul(de->d_name + 8, &end, 10);
+		if((*end) || (end == de->d_name + 8) || ((number >= firstSegment) && (number <= lastSegment)))
+			continue;
+		segmentPath(path, sizeof(path), (uint32_t) number);
+		debug(DEBUG_STATUS, "Removing old history segment %s", path);
+		(void) unlink(path);
+	}
+	closedir(d);
+
+	/* Rebuild the address index */
+	last = nextRecord();
+	for(n = firstRecord(); n < last; n++)
+		indexRecord(recordAt(n), n);
+	debug(DEBUG_STATUS, "History in %s: segments %u to %u, %llu records", histDir, firstSegment, lastSegment,
+	(unsigned long long) (last - firstRecord()));
+	return TRUE;
+}
+
+/*
+ * Return TRUE if history is being kept
+ */
+
+Bool historyEnabled(void)
+{
+	return histDir[0] ? TRUE : FALSE;
+}
+
+/*
+ * Flush and unmap the segments
+ */
+
+void historyClose(void)
+{
+	uint32_t i;
+	HistSegmentPtr_t seg;
+
+	if(!histDir[0])
+		return;
+	for(i = 0; i < HIST_SEGMENTS; i++){
+		if((seg = segment[i])){
+			msync(seg, sizeof(HistSegment_t), MS_SYNC);
+			munmap(seg, sizeof(HistSegment_t));
+			segment[i] = NULL;
+		}
+	}
+	memset(addrIndex, 0, sizeof(addrIndex));
+	histscanReset();
+	histDir[0] = 0;
+}
+
+/*
+ * Append an event
+ *
+ * Source is the transmit queue source name for events we send, NULL for received events.
+ */
+
+void historyAppend(Bool tx, int house, unsigned unitmask, unsigned function, int level, const String source)
+{
+	struct timeval tv;
+	HistSegmentPtr_t seg;
+	HistRecordPtr_t r;
+
+	if((!histDir[0]) || (house < 0) || (house > 15))
+		return;
+	seg = segment[lastSegment % HIST_SEGMENTS];
+	if((!seg) || (seg->count >= HIST_SEGMENT_RECORDS)){
+		if(!rotate())
+			return;
+		seg = segment[lastSegment % HIST_SEGMENTS];
+	}
+	gettimeofday(&tv, NULL);
+	r = &seg->record[seg->count];
+	r->time = (uint32_t) tv.tv_sec;
+	r->msec = (uint16_t) (tv.tv_usec / 1000);
+	r->unitmask = (uint16_t) unitmask;
+	r->house = (uint8_t) house;
+	r->function = (uint8_t) function;
+	r->level = (uint8_t) ((level < 0) ? 0 : (level > 100) ? 100 : level);
+	r->source = tx ? sourceIndex(seg, source ? source : "local") : 0;
+	r->flags = tx ? HIST_TX : 0;
+	memset(r->reserved, 0, sizeof(r->reserved));
+	/* The record is complete before the count says it is there */
+	__sync_synchronize();
+	seg->count++;
+	indexRecord(r, (uint64_t) lastSegment * HIST_SEGMENT_RECORDS + seg->count - 1);
+}
+
+/*
+ * Return up to max of the most recent events for one address, oldest first
+ *
+ * House wide functions sent or received for the house are included.
+ * Returns the number of events put in out.
+ */
+
+unsigned historyByAddress(int house, int unit, unsigned max, HistEventPtr_t out)
+{
+	unsigned i, count, slot;
+	uint64_t first = firstRecord();
+	HistIndexPtr_t hi;
+	HistRecordPtr_t r;
+
+	if((!histDir[0]) || (house < 0) || (house > 15) || (unit < 0) || (unit > 15))
+		return 0;
+	hi = &addrIndex[house][unit];
+	/* Only count the indexed records which have not been rotated away */
+	for(count = 0; (count < hi->count) && (count < max); count++){
+		slot = (hi->head + HIST_INDEX_DEPTH - 1 - count) % HIST_INDEX_DEPTH;
+		if(hi->record[slot] < first)
+			break;
+	}
+	for(i = 0; i < count; i++){
+		slot = (hi->head + HIST_INDEX_DEPTH - count + i) % HIST_INDEX_DEPTH;
+		if(!(r = recordAt(hi->record[slot])))
+			break;
+		copyEvent(&out[i], hi->record[slot], r);
+	}
+	return i;
+}
+
+/*
+ * Return up to max of the most recent events since a time, oldest first
+ *
+ * Total is set to the number of events since then, which may be more than were returned.
+ * Records are in the order they were written, so a step back in the clock can
+ * hide some of the events written before it.
+ */
+
+unsigned historySince(time_t since, unsigned max, HistEventPtr_t out, unsigned *total)
+{
+	uint64_t lo, hi, mid, n;
+	unsigned i;
+
+	*total = 0;
+	if(!histDir[0])
+		return 0;
+	lo = firstRecord();
+	hi = nextRecord();
+
+	/* Find the first record at or after the time */
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if((time_t) recordAt(mid)->time < since)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	hi = nextRecord();
+	*total = (unsigned) (hi - lo);
+	if(hi - lo > max)
+		lo = hi - max;
+	for(i = 0, n = lo; n < hi; n++, i++)
+		copyEvent(&out[i], n, recordAt(n));
+	return i;
+}
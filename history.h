@@ -0,0 +1,106 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Powerline event history
+*
+*/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <time.h>
+#include "types.h"
+
+#define HIST_MAGIC		0x58313048	/* "X10H" */
+#define HIST_VERSION		1
+
+/* Records per segment file, and segments kept */
+#define HIST_SEGMENT_RECORDS	65536
+#define HIST_SEGMENTS		8
+
+/* Source names per segment. Index 0 is the powerline, for received events */
+#define HIST_MAX_SOURCES	64
+#define HIST_SOURCE_LEN		32
+#define HIST_SOURCE_NONE	0xFF
+
+/* Events remembered per address for lookups by address */
+#define HIST_INDEX_DEPTH	256
+
+/* Record flags */
+#define HIST_TX			0x01	/* Sent by us, else received */
+
+/* Typedefs */
+
+typedef struct histrec HistRecord_t;
+typedef HistRecord_t * HistRecordPtr_t;
+typedef struct histseg HistSegment_t;
+typedef HistSegment_t * HistSegmentPtr_t;
+typedef struct histevent HistEvent_t;
+typedef HistEvent_t * HistEventPtr_t;
+
+/* One event as stored, 16 bytes */
+
+struct histrec{
+	uint32_t time;			/* Seconds since the epoch */
+	uint16_t msec;
+	uint16_t unitmask;		/* Bit 0 is unit 1 */
+	uint8_t house;			/* 0-15 for A-P */
+	uint8_t function;		/* X10 function code */
+	uint8_t level;			/* Dim/bright amount in percent */
+	uint8_t source;			/* Index into the segment's source names */
+	uint8_t flags;
+	uint8_t reserved[3];
+};
+
+/* Segment file layout: this header, then the records */
+
+struct histseg{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recordSize;
+	uint32_t number;		/* Segment number, counts up forever */
+	uint32_t count;			/* Records written */
+	char source[HIST_MAX_SOURCES][HIST_SOURCE_LEN];
+	HistRecord_t record[HIST_SEGMENT_RECORDS];
+};
+
+/* An event as returned by queries */
+
+struct histevent{
+	time_t time;
+	unsigned msec;
+	int house;
+	unsigned unitmask;
+	unsigned function;
+	int level;
+	Bool tx;
+	char source[HIST_SOURCE_LEN];
+};
+
+/*
+* Function prototypes
+*/
+
+Bool historyOpen(const String dir);
+void historyClose(void);
+void historyAppend(Bool tx, int house, unsigned unitmask, unsigned function, int level, const String source);
+unsigned historyByAddress(int house, int unit, unsigned max, HistEventPtr_t out);
+unsigned historySince(time_t since, unsigned max, HistEventPtr_t out, unsigned *total);
+Bool historyEnabled(void);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Column store scans over the event history
+*
+*    Counting questions such as "how often did anything in house C
+*    switch between 02:00 and 05:00 last month" have to look at every
+*    event in a range. For those the history keeps a second copy of
+*    each event in memory, one array per field, indexed by record
+*    number modulo HSCAN_CAPACITY:
+*
+*        time     seconds since the epoch
+*        tod      local time of day in seconds
+*        code     house as a one hot bit in 0-15, function in 16-31
+*        units    unit mask in 0-15, 0xFFFF for house wide functions,
+*                 HSCAN_RX or HSCAN_TX shifted up 16
+*
+*    With the house and function one hot, every predicate is an AND
+*    and a compare against zero, and the time of day window is one
+*    unsigned compare after moving the window start to zero. Records
+*    are in time order, so the time range is found by binary search
+*    and only the events inside it are scanned.
+*
+*    The vector kernel uses GCC vector extensions, which become SSE2
+*    on x86 and NEON on ARM. Built with another compiler, or with
+*    -DHSCAN_SCALAR, only the scalar kernel is used. The scalar kernel
+*    also does the few events left over at the end of a vector run.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "notify.h"
+#include "histscan.h"
+
+#if defined(__GNUC__) && !defined(HSCAN_SCALAR)
+#define HSCAN_VECTOR
+#define HSCAN_LANES		4
+typedef uint32_t HScanVec_t __attribute__((vector_size(16)));
+typedef int32_t HScanMask_t __attribute__((vector_size(16)));
+#endif
+
+typedef struct hscanparams HScanParams_t;
+typedef HScanParams_t * HScanParamsPtr_t;
+
+/* A query turned into the masks the kernels test against */
+
+struct hscanparams{
+	uint32_t house;
+	uint32_t function;
+	uint32_t units;
+	uint32_t direction;
+	uint32_t todFrom;
+	uint32_t todLen;
+};
+
+static uint32_t *colTime = NULL;
+static uint32_t *colTod = NULL;
+static uint32_t *colCode = NULL;
+static uint32_t *colUnits = NULL;
+static uint64_t firstRec = 0;		/* Oldest record held */
+static uint64_t nextRec = 0;		/* Number of the next record */
+static time_t hourStart = 0;		/* Cache for working out the local time of day */
+static uint32_t hourTod = 0;
+
+
+/*
+ * Return the local time of day of a time, in seconds
+ *
+ * The start of the last local hour looked up is cached, so a run of
+ * events in the same hour costs one localtime_r().
+ */
+
+static uint32_t timeOfDay(time_t t)
+{
+	struct tm tm;
+
+	if((!hourStart) || (t < hourStart) || (t >= hourStart + 3600)){
+		localtime_r(&t, &tm);
+		hourStart = t - tm.tm_min * 60 - tm.tm_sec;
+		hourTod = tm.tm_hour * 3600;
+	}
+	return hourTod + (uint32_t) (t - hourStart);
+}
+
+/*
+ * Count the matching events in a run of the columns, one at a time
+ */
+
+static unsigned countScalar(HScanParamsPtr_t p, unsigned start, unsigned count)
+{
+	unsigned i, matched = 0;
+	uint32_t c, u, d;
+
+	for(i = start; i < start + count; i++){
+		c = colCode[i];
+		u = colUnits[i];
+		d = colTod[i] - p->todFrom;
+		if(colTod[i] < p->todFrom)
+			d += HSCAN_DAY;
+		matched += ((c & p->house) != 0) & ((c & p->function) != 0) & ((u & p->units) != 0) &
+		((u & p->direction) != 0) & (d < p->todLen);
+	}
+	return matched;
+}
+
+#ifdef HSCAN_VECTOR
+/*
+ * Count the matching events in a run of the columns, HSCAN_LANES at a time
+ *
+ * Each compare gives all ones in the lanes which pass, so subtracting
+ * the ANDed masks from the accumulator counts the matches.
+ */
+
+static unsigned countVector(HScanParamsPtr_t p, unsigned start, unsigned count)
+{
+	unsigned i, end = start + (count & ~(HSCAN_LANES - 1));
+	HScanVec_t c, u, t, d;
+	HScanMask_t acc = {0, 0, 0, 0};
+
+	for(i = start; i < end; i += HSCAN_LANES){
+		memcpy(&c, colCode + i, sizeof(c));
+		memcpy(&u, colUnits + i, sizeof(u));
+		memcpy(&t, colTod + i, sizeof(t));
+		d = t - p->todFrom + ((HScanVec_t) (t < p->todFrom) & HSCAN_DAY);
+		acc -= ((c & p->house) != 0) & ((c & p->function) != 0) & ((u & p->units) != 0) &
+		((u & p->direction) != 0) & (d < p->todLen);
+	}
+	return (unsigned) (acc[0] + acc[1] + acc[2] + acc[3]) + countScalar(p, end, start + count - end);
+}
+#endif
+
+/*
+ * Return the number of the first record held at or after a time
+ */
+
+static uint64_t lowerBound(time_t t)
+{
+	uint64_t lo = firstRec, hi = nextRec, mid;
+
+	if(t <= 0)
+		return lo;
+	if(t > (time_t) 0xFFFFFFFFUL)
+		return hi;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(colTime[mid & (HSCAN_CAPACITY - 1)] < (uint32_t) t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Forget all the events held, and free the columns
+ */
+
+void histscanReset(void)
+{
+	free(colTime);
+	free(colTod);
+	free(colCode);
+	free(colUnits);
+	colTime = colTod = colCode = colUnits = NULL;
+	firstRec = nextRec = 0;
+	hourStart = 0;
+}
+
+/*
+ * Add an event, record n of the history
+ *
+ * Records must be added in order. The oldest are overwritten once HSCAN_CAPACITY are held.
+ */
+
+void histscanAppend(uint64_t n, time_t time, int house, unsigned unitmask, unsigned function, Bool tx)
+{
+	unsigned i = n & (HSCAN_CAPACITY - 1);
+
+	if(!colTime){
+		if((!(colTime = malloc(HSCAN_CAPACITY * sizeof(uint32_t)))) ||
+		(!(colTod = malloc(HSCAN_CAPACITY * sizeof(uint32_t)))) ||
+		(!(colCode = malloc(HSCAN_CAPACITY * sizeof(uint32_t)))) ||
+		(!(colUnits = malloc(HSCAN_CAPACITY * sizeof(uint32_t)))))
+			fatal("Out of memory in histscanAppend()");
+		firstRec = nextRec = n;
+	}
+	if(n != nextRec){
+		debug(DEBUG_UNEXPECTED, "History scan record %llu out of order, expected %llu",
+		(unsigned long long) n, (unsigned long long) nextRec);
+		firstRec = n;
+	}
+	colTime[i] = (uint32_t) time;
+	colTod[i] = timeOfDay(time);
+	colCode[i] = (1U << (house & 0x0F)) | (1U << ((function & 0x0F) + 16));
+	colUnits[i] = (unitmask ? (unitmask & 0xFFFF) : 0xFFFF) | ((tx ? HSCAN_TX : HSCAN_RX) << 16);
+	nextRec = n + 1;
+	if(nextRec - firstRec > HSCAN_CAPACITY)
+		firstRec = nextRec - HSCAN_CAPACITY;
+}
+
+/*
+ * Stop scanning records before the first one the history still keeps
+ */
+
+void histscanDrop(uint64_t first)
+{
+	if(first > firstRec)
+		firstRec = (first > nextRec) ? nextRec : first;
+}
+
+/*
+ * Count the events matching a query
+ */
+
+void histscanCount(HScanQueryPtr_t q, HScanResultPtr_t r)
+{
+	HScanParams_t p;
+	struct timeval start, end;
+	uint64_t lo, hi;
+	unsigned i, span;
+
+	memset(r, 0, sizeof(HScanResult_t));
+	if(!colTime)
+		return;
+	gettimeofday(&start, NULL);
+
+	p.house = q->houseMask;
+	p.function = (uint32_t) q->functionMask << 16;
+	p.units = q->unitMask;
+	p.direction = (q->direction & (HSCAN_RX | HSCAN_TX)) << 16;
+	p.todFrom = (q->todFrom >= 0) ? q->todFrom % HSCAN_DAY : 0;
+	p.todLen = (q->todFrom == q->todTo) ? HSCAN_DAY : (q->todTo - q->todFrom + HSCAN_DAY) % HSCAN_DAY;
+
+	lo = lowerBound(q->from);
+	hi = q->to ? lowerBound(q->to) : nextRec;
+	if(hi < lo)
+		hi = lo;
+	r->scanned = (unsigned) (hi - lo);
+
+	/* The range may wrap around the end of the columns */
+	while(lo < hi){
+		i = lo & (HSCAN_CAPACITY - 1);
+		span = ((hi - lo) < (HSCAN_CAPACITY - i)) ? (unsigned) (hi - lo) : HSCAN_CAPACITY - i;
+#ifdef HSCAN_VECTOR
+		if(!q->scalar)
+			r->matched += countVector(&p, i, span);
+		else
+#endif
+			r->matched += countScalar(&p, i, span);
+		lo += span;
+	}
+
+	gettimeofday(&end, NULL);
+	r->usec = (unsigned) ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec));
+}
+
+/*
+ * Return the name of the kernel used when scalar is not asked for
+ */
+
+const String histscanKernel(void)
+{
+#if defined(HSCAN_VECTOR) && defined(__SSE2__)
+	return "sse2";
+#elif defined(HSCAN_VECTOR) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+	return "neon";
+#elif defined(HSCAN_VECTOR)
+	return "vector";
+#else
+	return "scalar";
+#endif
+}
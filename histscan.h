@@ -0,0 +1,77 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Column store scans over the event history
+*
+*/
+
+#ifndef HISTSCAN_H
+#define HISTSCAN_H
+
+#include <time.h>
+#include "types.h"
+#include "history.h"
+
+/* Records held, the most the history keeps. A power of 2 */
+#define HSCAN_CAPACITY		(HIST_SEGMENTS * HIST_SEGMENT_RECORDS)
+
+/* Direction bits for queries */
+#define HSCAN_RX		0x01
+#define HSCAN_TX		0x02
+
+/* Seconds in a day, for time of day windows */
+#define HSCAN_DAY		86400
+
+/* Typedefs */
+
+typedef struct hscanquery HScanQuery_t;
+typedef HScanQuery_t * HScanQueryPtr_t;
+typedef struct hscanresult HScanResult_t;
+typedef HScanResult_t * HScanResultPtr_t;
+
+/* What to count. An event matches when every field does */
+
+struct hscanquery{
+	uint16_t houseMask;		/* Bit 0 is house A */
+	uint16_t functionMask;		/* Bit n is X10 function code n */
+	uint16_t unitMask;		/* Bit 0 is unit 1. House wide functions match any unit */
+	unsigned direction;		/* HSCAN_RX and/or HSCAN_TX */
+	time_t from;			/* Events at or after */
+	time_t to;			/* Events before */
+	int todFrom;			/* Local time of day window in seconds, may wrap past midnight */
+	int todTo;			/* Equal to todFrom for the whole day */
+	Bool scalar;			/* Use the scalar kernel */
+};
+
+struct hscanresult{
+	unsigned matched;
+	unsigned scanned;		/* Events in the time range */
+	unsigned usec;			/* Time the scan took */
+};
+
+/*
+* Function prototypes
+*/
+
+void histscanReset(void);
+void histscanAppend(uint64_t n, time_t time, int house, unsigned unitmask, unsigned function, Bool tx);
+void histscanDrop(uint64_t first);
+void histscanCount(HScanQueryPtr_t q, HScanResultPtr_t r);
+const String histscanKernel(void);
+
+#endif
@@ -0,0 +1,615 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Transmit queue journal
+*
+*    Commands which have been accepted but not yet sent are written to
+*    a small append-only file, so they survive the daemon being stopped
+*    or killed. Each record is one of:
+*
+*    A - a job was queued, with its frames, deadline and confirm name/values
+*    P - a job has been sent up to a frame it can be carried on from,
+*        see txqResumable()
+*    D - a job has finished, one way or another
+*
+*    Records carry a checksum, so one torn by a crash part way through
+*    a write ends the file rather than being misread.
+*
+*    Jobs are marked for the journal when they are queued, and written
+*    by journalFlush(), which the transmit queue calls before it sends
+*    anything. The file is synced once per flush, so however many
+*    commands arrived together only cost one sync, and no frame of a job
+*    goes out before its record is on disk.
+*
+*    When nothing is left to send the file is cut back to its header.
+*    If it grows past JOURNAL_COMPACT_BYTES anyway, it is rewritten with
+*    just the live jobs.
+*
+*    At start up the jobs still live in the journal are handed back to
+*    be queued again from where they got to.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "notify.h"
+#include "confread.h"
+#include "journal.h"
+
+typedef struct jheader JHeader_t;
+typedef struct jrecord JRecord_t;
+typedef struct jentry JEntry_t;
+typedef JEntry_t * JEntryPtr_t;
+
+/* At the start of the file */
+
+struct jheader{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t frameSize;
+};
+
+/* At the start of every record */
+
+struct jrecord{
+	uint8_t type;
+	uint8_t kind;
+	uint16_t length;		/* Bytes which follow */
+	uint32_t id;			/* Job sequence number */
+	uint32_t check;			/* Over the record with check zero */
+};
+
+/* A job found while reading the journal back */
+
+struct jentry{
+	uint32_t id;
+	unsigned kind;
+	const unsigned char *add;	/* Payload of its add record */
+	unsigned length;
+	unsigned next;
+	Bool done;
+	JEntryPtr_t next_entry;
+};
+
+static char journalPath[256] = "";
+static int journalFd = -1;
+static off_t journalSize;
+static Bool journalDirty;
+static unsigned liveCount;
+static TxJobPtr_t liveHead;		/* Every journaled job not yet finished, oldest first */
+static TxJobPtr_t liveTail;
+
+
+/*
+ * Checksum some bytes, carrying on from a previous value
+ *
+ * The same mixing as confreadHash(), without the final avalanche.
+ */
+
+static uint32_t checkBytes(uint32_t hash, const void *p, size_t len)
+{
+	const unsigned char *b = p;
+
+	while(len--){
+		hash += *b++;
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+	return hash;
+}
+
+/*
+ * Checksum a record
+ */
+
+static uint32_t checkRecord(JRecord_t *r, const void *payload)
+{
+	JRecord_t h = *r;
+
+	h.check = 0;
+	return checkBytes(checkBytes(0, &h, sizeof(h)), payload, r->length);
+}
+
+/*
+ * Put values into a payload buffer
+ */
+
+static unsigned char *putBytes(unsigned char *p, const void *v, size_t len)
+{
+	memcpy(p, v, len);
+	return p + len;
+}
+
+static unsigned char *putString(unsigned char *p, const String s)
+{
+	size_t len = strlen(s);
+
+	if(len > 255)
+		len = 255;
+	*p++ = (unsigned char) len;
+	return putBytes(p, s, len);
+}
+
+/*
+ * Write one record. Returns FALSE if it could not be written whole
+ */
+
+static Bool writeRecord(int fd, off_t *size, unsigned type, TxJobPtr_t job, const void *payload, unsigned length)
+{
+	static unsigned char buf[sizeof(JRecord_t) + 65536];
+	JRecord_t r;
+	ssize_t n;
+
+	r.type = type;
+	r.kind = job->journal;
+	r.length = length;
+	r.id = job->seq;
+	r.check = checkRecord(&r, payload);
+	memcpy(buf, &r, sizeof(r));
+	if(length)
+		memcpy(buf + sizeof(r), payload, length);
+	n = write(fd, buf, sizeof(r) + length);
+	if(n == (ssize_t) (sizeof(r) + length)){
+		*size += n;
+		return TRUE;
+	}
+	debug(DEBUG_UNEXPECTED, "Could not write to journal %s: %s", journalPath, (n < 0) ? strerror(errno) : "short write");
+	/* Don't leave part of a record for later ones to follow */
+	if((n > 0) && (ftruncate(fd, *size)))
+		debug(DEBUG_UNEXPECTED, "Could not truncate journal %s: %s", journalPath, strerror(errno));
+	return FALSE;
+}
+
+/*
+ * Write the add record for a job
+ *
+ * Name/value pairs which would make the record too long are left out.
+ */
+
+static Bool writeAdd(int fd, off_t *size, TxJobPtr_t job)
+{
+	static unsigned char payload[65535];
+	unsigned char *p = payload;
+	unsigned char *nvCountPos;
+	int64_t t;
+	uint16_t u;
+	unsigned i, nvCount;
+	const String source = job->source->name;
+
+	t = (int64_t) job->queued.tv_sec;
+	p = putBytes(p, &t, sizeof(t));
+	t = (int64_t) job->deadline.tv_sec;
+	p = putBytes(p, &t, sizeof(t));
+	u = job->count;
+	p = putBytes(p, &u, sizeof(u));
+	u = job->resumeNext;
+	p = putBytes(p, &u, sizeof(u));
+	p = putString(p, source);
+	p = putBytes(p, job->frames, job->count * sizeof(X10Frame_t));
+	nvCountPos = p++;
+	for(i = nvCount = 0; (i < job->nvCount) && (i < 255); i++){
+		if((p - payload) + 2 + strlen(job->nv[i].name) + strlen(job->nv[i].value) > sizeof(payload))
+			break;
+		p = putString(p, job->nv[i].name);
+		p = putString(p, job->nv[i].value);
+		nvCount++;
+	}
+	*nvCountPos = (unsigned char) nvCount;
+	return writeRecord(fd, size, JOURNAL_REC_ADD, job, payload, p - payload);
+}
+
+/*
+ * Start a journal file with its header
+ */
+
+static int createFile(const String path, off_t *size)
+{
+	JHeader_t hdr;
+	int fd;
+
+	if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0){
+		debug(DEBUG_UNEXPECTED, "Could not create journal %s: %s", path, strerror(errno));
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.version = JOURNAL_VERSION;
+	hdr.frameSize = sizeof(X10Frame_t);
+	if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)){
+		debug(DEBUG_UNEXPECTED, "Could not write journal %s", path);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	*size = sizeof(hdr);
+	return fd;
+}
+
+/*
+ * Rewrite the journal with just the live jobs
+ *
+ * The new file is written and synced beside the old one, then renamed
+ * over it, so a crash part way through leaves one or the other.
+ */
+
+static void compact(void)
+{
+	char tmpPath[sizeof(journalPath) + 8];
+	int fd;
+	off_t size;
+	TxJobPtr_t job;
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", journalPath);
+	if((fd = createFile(tmpPath, &size)) < 0)
+		return;
+	for(job = liveHead; job; job = job->next_journal){
+		if(!writeAdd(fd, &size, job))
+			break;
+	}
+	if((job) || (fdatasync(fd)) || (rename(tmpPath, journalPath))){
+		debug(DEBUG_UNEXPECTED, "Could not rewrite journal %s", journalPath);
+		close(fd);
+		unlink(tmpPath);
+		return;
+	}
+	for(job = liveHead; job; job = job->next_journal)
+		job->journaled = TRUE;
+	if(journalFd >= 0)
+		close(journalFd);
+	journalFd = fd;
+	journalSize = size;
+	journalDirty = FALSE;
+	debug(DEBUG_ACTION, "Journal rewritten with %u live jobs, %ld bytes", liveCount, (long) size);
+}
+
+/*
+ * Read the journal back, returning the jobs in it oldest first
+ *
+ * Reading stops at the first record which is torn or corrupt.
+ */
+
+static JEntryPtr_t readEntries(const unsigned char *buf, size_t len)
+{
+	JHeader_t hdr;
+	JRecord_t r;
+	JEntryPtr_t head = NULL, tail = NULL, e;
+	size_t pos = sizeof(hdr);
+	uint16_t u;
+
+	if(len < sizeof(hdr))
+		return NULL;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if((hdr.magic != JOURNAL_MAGIC) || (hdr.version != JOURNAL_VERSION) || (hdr.frameSize != sizeof(X10Frame_t))){
+		debug(DEBUG_UNEXPECTED, "Journal %s is not in a format we know, ignoring it", journalPath);
+		return NULL;
+	}
+
+	while(pos + sizeof(r) <= len){
+		memcpy(&r, buf + pos, sizeof(r));
+		if((pos + sizeof(r) + r.length > len) || (checkRecord(&r, buf + pos + sizeof(r)) != r.check)){
+			debug(DEBUG_UNEXPECTED, "Journal %s ends with a torn record at offset %lu", journalPath, (unsigned long) pos);
+			break;
+		}
+		pos += sizeof(r);
+		if(r.type == JOURNAL_REC_ADD){
+			if(!(e = calloc(1, sizeof(JEntry_t))))
+				fatal("Out of memory in readEntries()");
+			e->id = r.id;
+			e->kind = r.kind;
+			e->add = buf + pos;
+			e->length = r.length;
+			if(tail)
+				tail->next_entry = e;
+			else
+				head = e;
+			tail = e;
+		}
+		else{
+			for(e = head; (e) && (e->id != r.id); e = e->next_entry);
+			if(!e)
+				debug(DEBUG_UNEXPECTED, "Journal record for unknown job %u", r.id);
+			else if(r.type == JOURNAL_REC_DONE)
+				e->done = TRUE;
+			else if((r.type == JOURNAL_REC_PROGRESS) && (r.length == sizeof(u))){
+				memcpy(&u, buf + pos, sizeof(u));
+				e->next = u;
+			}
+		}
+		pos += r.length;
+	}
+	return head;
+}
+
+/*
+ * Decode the add record of a job and hand it back to be queued again
+ *
+ * Returns FALSE if the record does not make sense.
+ */
+
+static Bool replayEntry(JEntryPtr_t e, void (*replay)(unsigned kind, const String source, X10PlanPtr_t plan,
+time_t queued, time_t deadline, TxNVPtr_t nv, unsigned nvCount))
+{
+	const unsigned char *p = e->add, *end = e->add + e->length;
+	int64_t queued, deadline;
+	uint16_t count, next;
+	unsigned i, len, nvCount;
+	char *strings, *s;
+	char source[256];
+	TxNVPtr_t nv;
+	X10PlanPtr_t plan;
+
+	if(e->length < 2 * sizeof(int64_t) + 2 * sizeof(uint16_t) + 1)
+		return FALSE;
+	memcpy(&queued, p, sizeof(queued));
+	p += sizeof(queued);
+	memcpy(&deadline, p, sizeof(deadline));
+	p += sizeof(deadline);
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+	memcpy(&next, p, sizeof(next));
+	p += sizeof(next);
+	if(e->next > next)
+		next = e->next;
+	len = *p++;
+	if((count > PLAN_MAX_FRAMES) || (next > count) || (p + len + count * sizeof(X10Frame_t) + 1 > end))
+		return FALSE;
+	memcpy(source, p, len);
+	source[len] = '\0';
+	p += len;
+
+	if(!(plan = malloc(sizeof(X10Plan_t))))
+		fatal("Out of memory in replayEntry()");
+	planInit(plan);
+	plan->count = count - next;
+	memcpy(plan->frame, p + next * sizeof(X10Frame_t), plan->count * sizeof(X10Frame_t));
+	p += count * sizeof(X10Frame_t);
+
+	/* Name/value strings are copied out so they can be terminated */
+	nvCount = *p++;
+	if((!(nv = calloc(nvCount + 1, sizeof(TxNV_t)))) || (!(strings = malloc(e->length + 2 * nvCount + 1))))
+		fatal("Out of memory in replayEntry()");
+	for(i = 0, s = strings; i < nvCount; i++){
+		if((p >= end) || (p + 1 + *p > end))
+			break;
+		len = *p++;
+		memcpy(s, p, len);
+		s[len] = '\0';
+		nv[i].name = s;
+		s += len + 1;
+		p += len;
+		if((p >= end) || (p + 1 + *p > end))
+			break;
+		len = *p++;
+		memcpy(s, p, len);
+		s[len] = '\0';
+		nv[i].value = s;
+		s += len + 1;
+		p += len;
+	}
+
+	if(i == nvCount){
+		if(plan->count)
+			(*replay)(e->kind, source, plan, (time_t) queued, (time_t) deadline, nv, nvCount);
+		else
+			debug(DEBUG_ACTION, "Journaled job %u had been sent", e->id);
+	}
+	free(strings);
+	free(nv);
+	free(plan);
+	return (i == nvCount) ? TRUE : FALSE;
+}
+
+/*
+ * Open the journal, replaying the jobs left in it
+ *
+ * replay is called once for each job which had not finished, with the
+ * frames still to be sent, when it was queued and its deadline, zero for
+ * none. It should queue the job again and mark it for the journal.
+ * The journal is then rewritten with just those jobs.
+ *
+ * An empty path turns the journal off. Returns the number of jobs replayed.
+ */
+
+unsigned journalOpen(const String path, void (*replay)(unsigned kind, const String source, X10PlanPtr_t plan,
+time_t queued, time_t deadline, TxNVPtr_t nv, unsigned nvCount))
+{
+	FILE *file;
+	struct stat st;
+	unsigned char *buf = NULL;
+	JEntryPtr_t entries = NULL, e;
+	unsigned replayed = 0;
+
+	journalClose();
+	if((!path) || (!path[0]))
+		return 0;
+	if(strlen(path) >= sizeof(journalPath) - 1){
+		error("Journal path too long: %s", path);
+		return 0;
+	}
+	confreadStringCopy(journalPath, path, sizeof(journalPath));
+
+	if((file = fopen(journalPath, "r"))){
+		if((!fstat(fileno(file), &st)) && (st.st_size > 0)){
+			if(!(buf = malloc(st.st_size)))
+				fatal("Out of memory in journalOpen()");
+			if(fread(buf, st.st_size, 1, file) == 1)
+				entries = readEntries(buf, st.st_size);
+		}
+		fclose(file);
+	}
+
+	for(e = entries; e; e = e->next_entry){
+		if(e->done)
+			continue;
+		if(!replayEntry(e, replay))
+			debug(DEBUG_UNEXPECTED, "Journaled job %u is corrupt, dropped", e->id);
+		else
+			replayed++;
+	}
+	while((e = entries)){
+		entries = e->next_entry;
+		free(e);
+	}
+	free(buf);
+
+	compact();
+	if(journalFd < 0){
+		error("Could not open journal %s, commands will not survive a restart", journalPath);
+		journalClose();
+		return replayed;
+	}
+	debug(DEBUG_STATUS, "Journal %s open, %u jobs replayed", journalPath, replayed);
+	return replayed;
+}
+
+/*
+ * Sync and close the journal
+ *
+ * Jobs still live are left in it for next time.
+ */
+
+void journalClose(void)
+{
+	TxJobPtr_t job;
+
+	if(journalFd >= 0){
+		journalFlush();
+		close(journalFd);
+		journalFd = -1;
+	}
+	for(job = liveHead; job; job = job->next_journal)
+		job->journal = JOURNAL_NONE;
+	liveHead = liveTail = NULL;
+	liveCount = 0;
+	journalPath[0] = '\0';
+}
+
+/*
+ * Return TRUE if accepted commands are being journaled
+ */
+
+Bool journalEnabled(void)
+{
+	return (journalFd >= 0) ? TRUE : FALSE;
+}
+
+/*
+ * Mark a newly queued job for the journal
+ *
+ * It is written at the next flush, so name/values attached to it after
+ * it was queued are included.
+ */
+
+void journalAdd(TxJobPtr_t job, unsigned kind)
+{
+	if((!job) || (!journalPath[0]) || (job->journal))
+		return;
+	job->journal = kind;
+	job->journaled = FALSE;
+	job->next_journal = NULL;
+	job->prev_journal = liveTail;
+	if(liveTail)
+		liveTail->next_journal = job;
+	else
+		liveHead = job;
+	liveTail = job;
+	liveCount++;
+}
+
+/*
+ * Record that a job can be carried on from its next frame
+ */
+
+void journalProgress(TxJobPtr_t job)
+{
+	uint16_t next = job->next;
+
+	job->resumeNext = job->next;
+	if((journalFd < 0) || (!job->journaled))
+		return;
+	if(writeRecord(journalFd, &journalSize, JOURNAL_REC_PROGRESS, job, &next, sizeof(next)))
+		journalDirty = TRUE;
+}
+
+/*
+ * Record that a job has finished, and forget it
+ */
+
+void journalDone(TxJobPtr_t job)
+{
+	if(!job->journal)
+		return;
+	if((journalFd >= 0) && (job->journaled) && (writeRecord(journalFd, &journalSize, JOURNAL_REC_DONE, job, NULL, 0)))
+		journalDirty = TRUE;
+	if(job->prev_journal)
+		job->prev_journal->next_journal = job->next_journal;
+	else
+		liveHead = job->next_journal;
+	if(job->next_journal)
+		job->next_journal->prev_journal = job->prev_journal;
+	else
+		liveTail = job->prev_journal;
+	job->journal = JOURNAL_NONE;
+	liveCount--;
+}
+
+/*
+ * Write the jobs queued since the last flush and sync the file
+ *
+ * Called before anything is sent. Cuts the file back once nothing is live.
+ */
+
+void journalFlush(void)
+{
+	TxJobPtr_t job;
+
+	if(journalFd < 0)
+		return;
+	if((!liveCount) && (journalSize > (off_t) sizeof(JHeader_t))){
+		/* Everything has finished, so nothing before now is needed */
+		if(!ftruncate(journalFd, sizeof(JHeader_t))){
+			journalSize = sizeof(JHeader_t);
+			journalDirty = TRUE;
+		}
+	}
+	else if(journalSize > JOURNAL_COMPACT_BYTES)
+		compact();
+	for(job = liveHead; job; job = job->next_journal){
+		if((!job->journaled) && (writeAdd(journalFd, &journalSize, job))){
+			job->journaled = TRUE;
+			journalDirty = TRUE;
+		}
+	}
+	if((journalDirty) && (fdatasync(journalFd)))
+		debug(DEBUG_UNEXPECTED, "Could not sync journal %s: %s", journalPath, strerror(errno));
+	journalDirty = FALSE;
+}
+
+/*
+ * Return the number of journaled jobs not yet finished
+ */
+
+unsigned journalLive(void)
+{
+	return liveCount;
+}
@@ -0,0 +1,63 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Transmit queue journal
+*
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "types.h"
+#include "plan.h"
+#include "txq.h"
+
+#define JOURNAL_MAGIC		0x5831304A
+#define JOURNAL_VERSION		1
+
+/* The journal is rewritten with just the live jobs once it grows past this */
+#define JOURNAL_COMPACT_BYTES	65536
+
+/* Jobs without a time to live are not replayed if they were queued longer ago than this */
+#define JOURNAL_MAX_AGE		3600
+
+/* Who a journaled job was queued for. 0 is not journaled */
+
+enum {JOURNAL_NONE = 0, JOURNAL_XPL, JOURNAL_LOCAL, JOURNAL_INTERNAL};
+
+/* Record types */
+
+#define JOURNAL_REC_ADD		'A'
+#define JOURNAL_REC_PROGRESS	'P'
+#define JOURNAL_REC_DONE	'D'
+
+/*
+* Function prototypes
+*/
+
+unsigned journalOpen(const String path, void (*replay)(unsigned kind, const String source, X10PlanPtr_t plan,
+time_t queued, time_t deadline, TxNVPtr_t nv, unsigned nvCount));
+void journalClose(void);
+Bool journalEnabled(void);
+void journalAdd(TxJobPtr_t job, unsigned kind);
+void journalProgress(TxJobPtr_t job);
+void journalDone(TxJobPtr_t job);
+void journalFlush(void);
+unsigned journalLive(void);
+
+#endif
@@ -0,0 +1,613 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Local command socket
+*
+*    A Unix domain stream socket for controllers on the same machine.
+*    Commands arrive in a compact binary form (see localapi.h), many to
+*    a write, and each is queued as its own job on the same transmit
+*    queue as xPL commands. Each client is a transmit queue source named
+*    unix-client.uid, so it gets a fair share of the powerline and can
+*    be weighted in [sources]. A completion record goes back for every
+*    command when it has been sent, or at once if it was refused.
+*
+*    A client can also subscribe to powerline events with a filter on
+*    house, unit and function. Matching events are sent as fixed size
+*    records straight from the X10 event handler. Events only use the
+*    first LA_EVENT_LIMIT bytes of a client's output buffer, so a slow
+*    subscriber loses events, counted in the next record, rather than
+*    holding up the daemon or its own command completions.
+*
+*    Clients can also query the event history, by address or by time.
+*
+*    The sockets are non-blocking. The caller polls them and passes
+*    readiness to localapiIO(). Replies that cannot be written at once
+*    are buffered, and a client whose buffer overflows is dropped.
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "notify.h"
+#include "confread.h"
+#include "x10.h"
+#include "plan.h"
+#include "txq.h"
+#include "journal.h"
+#include "history.h"
+#include "localapi.h"
+
+typedef struct laclient LAClient_t;
+typedef LAClient_t * LAClientPtr_t;
+
+/* One connection */
+
+struct laclient{
+	int fd;
+	unsigned id;			/* Matches completions to the connection they came from */
+	Bool writing;			/* Watching for write readiness */
+	uint16_t houseMask;		/* Event subscription filter */
+	uint16_t unitMask;
+	uint16_t functionMask;
+	unsigned dropped;		/* Events lost since the last record sent */
+	unsigned droppedTotal;
+	char source[64];
+	unsigned inLen;
+	unsigned outLen;
+	unsigned char in[LA_HEADER_SIZE + LA_MAX_BODY];
+	unsigned char out[LA_OUT_SIZE];
+};
+
+static char sockPath[108] = "";
+static int listenFd = -1;
+static unsigned budget = 0;
+static unsigned nextId = 1;
+static unsigned commandCount = 0;
+static unsigned refusedCount = 0;
+static unsigned droppedCount = 0;		/* Events lost by clients which have gone */
+static uint32_t eventSeq = 0;
+static LAClientPtr_t client[LA_MAX_CLIENTS];
+static Bool (*watchFd)(int fd, Bool write) = NULL;
+static void (*unwatchFd)(int fd) = NULL;
+
+
+/*
+ * Put integers into a buffer and take them out again, in network byte order
+ */
+
+static void put16(unsigned char *p, unsigned v)
+{
+	p[0] = (v >> 8) & 0xFF;
+	p[1] = v & 0xFF;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static unsigned get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ * Close a connection. Completions still to come for it are dropped
+ */
+
+static void closeClient(int slot)
+{
+	LAClientPtr_t c = client[slot];
+
+	debug(DEBUG_STATUS, "Local client %s disconnected", c->source);
+	droppedCount += c->droppedTotal;
+	if(unwatchFd)
+		(*unwatchFd)(c->fd);
+	close(c->fd);
+	free(c);
+	client[slot] = NULL;
+}
+
+/*
+ * Write out as much buffered output as the socket will take
+ *
+ * Returns FALSE if the connection has failed.
+ */
+
+static Bool flushClient(LAClientPtr_t c)
+{
+	ssize_t n;
+	Bool writing;
+
+	while(c->outLen){
+		if((n = write(c->fd, c->out, c->outLen)) < 0){
+			if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if(errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		memmove(c->out, c->out + n, c->outLen - n);
+		c->outLen -= n;
+	}
+	/* Only ask to hear about write readiness while there is something to write */
+	writing = c->outLen ? TRUE : FALSE;
+	if((writing != c->writing) && (watchFd)){
+		if(unwatchFd)
+			(*unwatchFd)(c->fd);
+		(*watchFd)(c->fd, writing);
+		c->writing = writing;
+	}
+	return TRUE;
+}
+
+/*
+ * Find the slot of a connection by fd or id. Returns -1 if it has gone
+ */
+
+static int findClient(int fd, unsigned id)
+{
+	int i;
+
+	for(i = 0; i < LA_MAX_CLIENTS; i++){
+		if((client[i]) && (((fd >= 0) && (client[i]->fd == fd)) || ((id) && (client[i]->id == id))))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Send a completion record
+ */
+
+static void sendComplete(int slot, uint32_t tag, unsigned index, unsigned result, unsigned err,
+unsigned retries, unsigned queueMs, unsigned txMs)
+{
+	LAClientPtr_t c = client[slot];
+	unsigned char *p;
+
+	if(c->outLen + LA_HEADER_SIZE + LA_REP_COMPLETE_SIZE > sizeof(c->out)){
+		debug(DEBUG_UNEXPECTED, "Local client %s is not reading its replies", c->source);
+		closeClient(slot);
+		return;
+	}
+	p = c->out + c->outLen;
+	put16(p, LA_REP_COMPLETE_SIZE);
+	p[2] = LA_REP_COMPLETE;
+	put32(p + 3, tag);
+	p[7] = index;
+	p[8] = result;
+	p[9] = err;
+	p[10] = (retries > 255) ? 255 : retries;
+	put32(p + 11, queueMs);
+	put32(p + 15, txMs);
+	c->outLen += LA_HEADER_SIZE + LA_REP_COMPLETE_SIZE;
+	if(!flushClient(c))
+		closeClient(slot);
+}
+
+/*
+ * Called by the transmit queue when a command from a local client has been sent
+ */
+
+static void commandDone(TxJobPtr_t job)
+{
+	int slot;
+	const String id = txqGetNV(job, "client");
+	const String tag = txqGetNV(job, "tag");
+	const String index = txqGetNV(job, "index");
+
+	if((!id) || (!tag) || (!index) || ((slot = findClient(-1, (unsigned) strtoul(id, NULL, 10))) < 0))
+		return;
+	sendComplete(slot, (uint32_t) strtoul(tag, NULL, 10), (unsigned) atoi(index), job->result, LA_ERR_NONE,
+	job->retries, txqWaitMs(job), txqTxMs(job));
+}
+
+/*
+ * Queue one command from a request. Returns an LA_ERR_ code
+ */
+
+static int queueCommand(int slot, uint32_t tag, unsigned index, const unsigned char *cmd)
+{
+	char ws[16];
+	unsigned house = cmd[0];
+	unsigned units = get16(cmd + 1);
+	unsigned function = cmd[3];
+	X10Addrs_t addrs;
+	TxJobPtr_t job;
+	static X10Plan_t plan;
+
+	switch(function){
+		case COMMAND_HAIL_ACKNOWLEDGE:
+		case COMMAND_EXTENDED_DATA_TRANSFER:
+		case COMMAND_STATUS_ON:
+		case COMMAND_STATUS_OFF:
+			return LA_ERR_BAD_COMMAND;
+
+		default:
+			if((function > 0x0F) && (function != PLAN_FUNC_NONE))
+				return LA_ERR_BAD_COMMAND;
+			break;
+	}
+	if((house > 15) || (cmd[4] > 100))
+		return LA_ERR_BAD_COMMAND;
+
+	memset(&addrs, 0, sizeof(addrs));
+	addrs.houses = 1 << house;
+	addrs.units[house] = units;
+	planInit(&plan);
+	if(!planAddFunction(&plan, &addrs, function, cmd[4], cmd[5], cmd[6], house))
+		return LA_ERR_BAD_COMMAND;
+
+	/* The same admission control as xPL commands */
+	if((budget) && (!txqEmpty()) && (txqBacklogMs() + planTime(&plan) > budget))
+		return LA_ERR_BUSY;
+
+	job = txqSubmit(client[slot]->source, &plan, commandDone);
+	journalAdd(job, JOURNAL_LOCAL);
+	snprintf(ws, sizeof(ws), "%u", client[slot]->id);
+	txqAddNV(job, "client", ws);
+	snprintf(ws, sizeof(ws), "%lu", (unsigned long) tag);
+	txqAddNV(job, "tag", ws);
+	snprintf(ws, sizeof(ws), "%u", index);
+	txqAddNV(job, "index", ws);
+	commandCount++;
+	return LA_ERR_NONE;
+}
+
+/*
+ * Answer a history query with the matching events, then an end record
+ *
+ * The reply is cut short rather than overflow the client's buffer.
+ */
+
+static void sendHistory(int slot, const unsigned char *body)
+{
+	static HistEvent_t events[LA_HISTORY_MAX];
+	LAClientPtr_t c = client[slot];
+	uint32_t tag = get32(body + 1);
+	unsigned house = body[5];
+	unsigned count = get16(body + 7);
+	unsigned i, n, matched, room;
+	unsigned char *p;
+
+	if(c->outLen + LA_HEADER_SIZE + LA_REP_HISTORY_END_SIZE > sizeof(c->out)){
+		debug(DEBUG_UNEXPECTED, "Local client %s is not reading its replies", c->source);
+		closeClient(slot);
+		return;
+	}
+	room = (sizeof(c->out) - c->outLen - LA_HEADER_SIZE - LA_REP_HISTORY_END_SIZE) / (LA_HEADER_SIZE + LA_REP_HISTORY_SIZE);
+	if(count > LA_HISTORY_MAX)
+		count = LA_HISTORY_MAX;
+	if(count > room)
+		count = room;
+	if(house == LA_HIST_ALL)
+		n = historySince(time(NULL) - (time_t) get32(body + 9), count, events, &matched);
+	else
+		n = matched = historyByAddress(house, body[6], count, events);
+
+	for(i = 0; i < n; i++){
+		p = c->out + c->outLen;
+		memset(p, 0, LA_HEADER_SIZE + LA_REP_HISTORY_SIZE);
+		put16(p, LA_REP_HISTORY_SIZE);
+		p[2] = LA_REP_HISTORY;
+		put32(p + 3, tag);
+		p[7] = events[i].tx ? LA_HIST_TX : 0;
+		p[8] = events[i].house;
+		p[9] = events[i].function;
+		p[10] = events[i].level;
+		put16(p + 11, events[i].unitmask);
+		put32(p + 13, (uint32_t) events[i].time);
+		put16(p + 17, events[i].msec);
+		strncpy((char *) p + 19, events[i].source, LA_HIST_SOURCE_LEN - 1);
+		c->outLen += LA_HEADER_SIZE + LA_REP_HISTORY_SIZE;
+	}
+	p = c->out + c->outLen;
+	put16(p, LA_REP_HISTORY_END_SIZE);
+	p[2] = LA_REP_HISTORY_END;
+	put32(p + 3, tag);
+	put16(p + 7, n);
+	put32(p + 9, matched);
+	c->outLen += LA_HEADER_SIZE + LA_REP_HISTORY_END_SIZE;
+	if(!flushClient(c))
+		closeClient(slot);
+}
+
+/*
+ * Handle one complete message. Returns FALSE if it breaks the protocol
+ */
+
+static Bool handleMessage(int slot, const unsigned char *body, unsigned len)
+{
+	unsigned i, count;
+	int err;
+	uint32_t tag;
+
+	if((len == LA_REQ_SUBSCRIBE_SIZE) && (body[0] == LA_REQ_SUBSCRIBE)){
+		client[slot]->houseMask = get16(body + 1);
+		client[slot]->unitMask = get16(body + 3);
+		client[slot]->functionMask = get16(body + 5);
+		debug(DEBUG_ACTION, "Local client %s subscribed to houses %04X units %04X functions %04X", client[slot]->source,
+		client[slot]->houseMask, client[slot]->unitMask, client[slot]->functionMask);
+		return TRUE;
+	}
+	if((len == LA_REQ_HISTORY_SIZE) && (body[0] == LA_REQ_HISTORY)){
+		if(((body[5] > 15) && (body[5] != LA_HIST_ALL)) || (body[6] > 15))
+			return FALSE;
+		sendHistory(slot, body);
+		return TRUE;
+	}
+	if((!len) || (body[0] != LA_REQ_COMMAND) || (len < LA_REQ_COMMAND_SIZE))
+		return FALSE;
+	tag = get32(body + 1);
+	count = body[5];
+	if(len != LA_REQ_COMMAND_SIZE + count * LA_COMMAND_SIZE)
+		return FALSE;
+	for(i = 0; (i < count) && (client[slot]); i++){
+		if((err = queueCommand(slot, tag, i, body + LA_REQ_COMMAND_SIZE + i * LA_COMMAND_SIZE)) != LA_ERR_NONE){
+			refusedCount++;
+			sendComplete(slot, tag, i, LA_RESULT_FAILED, err, 0, 0, 0);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Read what a client has sent and act on each complete message
+ */
+
+static void readClient(int slot)
+{
+	LAClientPtr_t c = client[slot];
+	unsigned len, pos;
+	ssize_t n;
+
+	if((n = read(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen)) <= 0){
+		if((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+			return;
+		closeClient(slot);
+		return;
+	}
+	c->inLen += n;
+	for(pos = 0; c->inLen - pos >= LA_HEADER_SIZE; pos += LA_HEADER_SIZE + len){
+		if((len = get16(c->in + pos)) > LA_MAX_BODY){
+			debug(DEBUG_UNEXPECTED, "Local client %s sent an oversize message", c->source);
+			closeClient(slot);
+			return;
+		}
+		if(c->inLen - pos < LA_HEADER_SIZE + len)
+			break;
+		if(!handleMessage(slot, c->in + pos + LA_HEADER_SIZE, len)){
+			if(client[slot]){
+				debug(DEBUG_UNEXPECTED, "Local client %s sent a bad message", c->source);
+				closeClient(slot);
+			}
+			return;
+		}
+		if(!client[slot]) /* Dropped while replying */
+			return;
+	}
+	memmove(c->in, c->in + pos, c->inLen - pos);
+	c->inLen -= pos;
+}
+
+/*
+ * Accept a new connection
+ */
+
+static void acceptClient(void)
+{
+	int fd, slot;
+	struct ucred cred;
+	socklen_t credLen = sizeof(cred);
+	LAClientPtr_t c;
+
+	if((fd = accept(listenFd, NULL, NULL)) < 0)
+		return;
+	for(slot = 0; (slot < LA_MAX_CLIENTS) && (client[slot]); slot++);
+	if(slot == LA_MAX_CLIENTS){
+		debug(DEBUG_UNEXPECTED, "Too many local clients, connection refused");
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if(!(c = calloc(1, sizeof(LAClient_t))))
+		fatal("Out of memory in acceptClient()");
+	c->fd = fd;
+	c->id = nextId++;
+	if(!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen))
+		snprintf(c->source, sizeof(c->source), "unix-client.%u", (unsigned) cred.uid);
+	else
+		snprintf(c->source, sizeof(c->source), "unix-client");
+	client[slot] = c;
+	if((watchFd) && (!(*watchFd)(fd, FALSE))){
+		closeClient(slot);
+		return;
+	}
+	debug(DEBUG_STATUS, "Local client %s connected", c->source);
+}
+
+
+/*
+ * Open the command socket
+ *
+ * budgetMs is the queued powerline time above which commands are
+ * refused as busy, 0 for no limit. watch is called to start polling a
+ * socket, for reading and also for writing if write is TRUE, and
+ * unwatch to stop. Returns the listening socket, or -1 on failure.
+ */
+
+int localapiInit(const String path, unsigned budgetMs, Bool (*watch)(int fd, Bool write), void (*unwatch)(int fd))
+{
+	struct sockaddr_un addr;
+
+	budget = budgetMs;
+	watchFd = watch;
+	unwatchFd = unwatch;
+	if((!path) || (!*path) || (strlen(path) >= sizeof(addr.sun_path)))
+		return -1;
+	confreadStringCopy(sockPath, path, sizeof(sockPath));
+
+	if((listenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockPath);
+	(void) unlink(sockPath); /* Left over from a crash */
+	if((bind(listenFd, (struct sockaddr *) &addr, sizeof(addr))) || (listen(listenFd, LA_MAX_CLIENTS))){
+		debug(DEBUG_UNEXPECTED, "Could not open local socket %s: %s", sockPath, strerror(errno));
+		close(listenFd);
+		listenFd = -1;
+		return -1;
+	}
+	(void) chmod(sockPath, 0660);
+	fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+	if((watchFd) && (!(*watchFd)(listenFd, FALSE))){
+		localapiShutdown();
+		return -1;
+	}
+	debug(DEBUG_STATUS, "Listening for local clients on %s", sockPath);
+	return listenFd;
+}
+
+/*
+ * Handle readiness on the listening socket or a client socket
+ */
+
+void localapiIO(int fd, int revents)
+{
+	int slot;
+
+	if(fd == listenFd){
+		acceptClient();
+		return;
+	}
+	if((slot = findClient(fd, 0)) < 0)
+		return;
+	if(revents & (POLLERR | POLLNVAL)){
+		closeClient(slot);
+		return;
+	}
+	if((revents & POLLOUT) && (!flushClient(client[slot]))){
+		closeClient(slot);
+		return;
+	}
+	if(revents & (POLLIN | POLLHUP))
+		readClient(slot);
+}
+
+/*
+ * Send a powerline event to the clients subscribed to it
+ */
+
+void localapiEvent(int house, unsigned unitmask, unsigned function)
+{
+	int i;
+	struct timeval tv;
+	unsigned char *p;
+	LAClientPtr_t c;
+
+	eventSeq++;
+	if((house < 0) || (house > 15) || (function > 15))
+		return;
+	gettimeofday(&tv, NULL);
+	for(i = 0; i < LA_MAX_CLIENTS; i++){
+		if((!(c = client[i])) || (!(c->houseMask & (1 << house))) || (!(c->functionMask & (1 << function))) ||
+		((unitmask) && (!(c->unitMask & unitmask))))
+			continue;
+		if(c->outLen + LA_HEADER_SIZE + LA_REP_EVENT_SIZE > LA_EVENT_LIMIT){
+			c->dropped++;
+			c->droppedTotal++;
+			continue;
+		}
+		p = c->out + c->outLen;
+		put16(p, LA_REP_EVENT_SIZE);
+		p[2] = LA_REP_EVENT;
+		p[3] = house;
+		p[4] = function;
+		put16(p + 5, unitmask);
+		put16(p + 7, (c->dropped > 0xFFFF) ? 0xFFFF : c->dropped);
+		put32(p + 9, eventSeq);
+		put32(p + 13, (uint32_t) tv.tv_sec);
+		put32(p + 17, (uint32_t) tv.tv_usec);
+		c->outLen += LA_HEADER_SIZE + LA_REP_EVENT_SIZE;
+		c->dropped = 0;
+		if(!flushClient(c))
+			closeClient(i);
+	}
+}
+
+/*
+ * Close all the sockets and remove the socket file
+ */
+
+void localapiShutdown(void)
+{
+	int i;
+
+	for(i = 0; i < LA_MAX_CLIENTS; i++){
+		if(client[i])
+			closeClient(i);
+	}
+	if(listenFd >= 0){
+		if(unwatchFd)
+			(*unwatchFd)(listenFd);
+		close(listenFd);
+		listenFd = -1;
+		(void) unlink(sockPath);
+	}
+}
+
+/*
+ * Return the number of connected clients, commands queued, commands
+ * refused and events dropped for slow subscribers
+ */
+
+void localapiStats(unsigned *clients, unsigned *commands, unsigned *refused, unsigned *dropped)
+{
+	int i;
+
+	*dropped = droppedCount;
+	for(i = 0, *clients = 0; i < LA_MAX_CLIENTS; i++){
+		if(client[i]){
+			(*clients)++;
+			*dropped += client[i]->droppedTotal;
+		}
+	}
+	*commands = commandCount;
+	*refused = refusedCount;
+}
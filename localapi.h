@@ -0,0 +1,130 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Local command socket
+*
+*    Wire format. Every message in either direction is a 16 bit length
+*    followed by that many bytes of body. The first byte of the body is
+*    the message type. All integers are in network byte order.
+*
+*    LA_REQ_COMMAND, client to daemon:
+*        type 1, tag 4, count 1, then count commands of LA_COMMAND_SIZE:
+*        house 1 (0-15 for A-P), unit mask 2 (bit 0 is unit 1),
+*        function 1 (X10 function code, 0xFF to address only),
+*        level 1 (percent for dim and bright), data1 1, data2 1
+*
+*    LA_REP_COMPLETE, daemon to client, one per command:
+*        type 1, tag 4, index 1, result 1, error 1, retries 1,
+*        queue ms 4, transmit ms 4
+*
+*    The result is one of the LA_RESULT_ codes. A command refused before
+*    being queued has result LA_RESULT_FAILED and an LA_ERR_ code.
+*
+*    LA_REQ_SUBSCRIBE, client to daemon:
+*        type 1, house mask 2 (bit 0 is A), unit mask 2 (bit 0 is unit 1),
+*        function mask 2 (bit n is X10 function code n)
+*        All zero masks end the subscription.
+*
+*    LA_REP_EVENT, daemon to client, one per matching powerline event:
+*        type 1, house 1, function 1, unit mask 2, dropped 2,
+*        sequence 4, seconds 4, microseconds 4
+*
+*    LA_REQ_HISTORY, client to daemon:
+*        type 1, tag 4, house 1, unit 1 (0-15), count 2, seconds 4
+*        With house 0-15, the last count events for that address.
+*        With house 0xFF, the last count events in the last seconds.
+*
+*    LA_REP_HISTORY, daemon to client, one per event, oldest first:
+*        type 1, tag 4, flags 1 (LA_HIST_TX if we sent it), house 1,
+*        function 1, level 1, unit mask 2, seconds 4, milliseconds 2,
+*        source LA_HIST_SOURCE_LEN (NUL padded)
+*
+*    LA_REP_HISTORY_END, daemon to client, after the events:
+*        type 1, tag 4, sent 2, matched 4
+*
+*    Matched can be more than sent when count, LA_HISTORY_MAX or the
+*    space left in the client's buffer limited the reply.
+*
+*    An event matches when its house and function are in the masks and
+*    it has a unit in the unit mask. House wide functions have no units
+*    and match any unit mask. Dropped is the number of matching events
+*    lost because the client was not reading, since the last record.
+*    The sequence counts every event the daemon has received, so gaps
+*    show events which were filtered out or dropped.
+*
+*/
+
+#ifndef LOCALAPI_H
+#define LOCALAPI_H
+
+#include "types.h"
+
+/* Message types */
+#define LA_REQ_COMMAND		0x01
+#define LA_REQ_SUBSCRIBE	0x02
+#define LA_REQ_HISTORY		0x03
+#define LA_REP_COMPLETE		0x81
+#define LA_REP_EVENT		0x82
+#define LA_REP_HISTORY		0x83
+#define LA_REP_HISTORY_END	0x84
+
+/* Sizes in bytes */
+#define LA_HEADER_SIZE		2
+#define LA_MAX_BODY		2048
+#define LA_COMMAND_SIZE		7
+#define LA_REQ_COMMAND_SIZE	6	/* Body before the commands */
+#define LA_REP_COMPLETE_SIZE	17
+#define LA_REQ_SUBSCRIBE_SIZE	7
+#define LA_REP_EVENT_SIZE	19
+#define LA_REQ_HISTORY_SIZE	13
+#define LA_HIST_SOURCE_LEN	32
+#define LA_REP_HISTORY_SIZE	(17 + LA_HIST_SOURCE_LEN)
+#define LA_REP_HISTORY_END_SIZE	11
+
+/* History records */
+#define LA_HIST_TX		0x01
+#define LA_HIST_ALL		0xFF	/* House for a query by time */
+#define LA_HISTORY_MAX		256
+
+/* Results, the same as the transmit queue's */
+#define LA_RESULT_OK		1
+#define LA_RESULT_FAILED	2
+#define LA_RESULT_EXPIRED	3
+#define LA_RESULT_CANCELLED	4
+
+/* Reasons a command was refused */
+#define LA_ERR_NONE		0
+#define LA_ERR_BAD_COMMAND	1
+#define LA_ERR_BUSY		2
+
+/* Connections and buffering */
+#define LA_MAX_CLIENTS		16
+#define LA_OUT_SIZE		32768
+#define LA_EVENT_LIMIT		16384	/* Buffered output above which events are dropped */
+
+/*
+* Function prototypes
+*/
+
+int localapiInit(const String path, unsigned budgetMs, Bool (*watch)(int fd, Bool write), void (*unwatch)(int fd));
+void localapiIO(int fd, int revents);
+void localapiEvent(int house, unsigned unitmask, unsigned function);
+void localapiShutdown(void);
+void localapiStats(unsigned *clients, unsigned *commands, unsigned *refused, unsigned *dropped);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Occupancy rules
+*
+*    Loads the [occupancy] section of the config file. Each rule is a
+*    sensor address, a device list and a timeout in seconds separated by
+*    colons:
+*
+*    hall = C1:A1,A2:300
+*
+*    An "on" event from the sensor turns the lights on, unless they are
+*    already known to be on, and restarts the rule's timer. When the
+*    timer runs out the lights are turned off. Both go through the
+*    transmit queue as local jobs.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "x10.h"
+#include "devstate.h"
+#include "txq.h"
+#include "journal.h"
+#include "occupancy.h"
+
+static OccRulePtr_t ruleList = NULL;
+static OccRulePtr_t sensorTable[16][16];
+
+
+/*
+ * Compile one function for a set of lights into a plan
+ */
+
+static X10PlanPtr_t compileLights(X10AddrsPtr_t addrs, unsigned function)
+{
+	int house;
+	size_t size;
+	X10PlanPtr_t plan;
+	static X10Plan_t work;
+
+	for(house = 0; (house < 16) && (!(addrs->houses & (1 << house))); house++);
+	planInit(&work);
+	if(!planAddFunction(&work, addrs, function, 0, 0, 0, house & 0x0F))
+		return NULL;
+	size = sizeof(X10Plan_t) - (PLAN_MAX_FRAMES - work.count) * sizeof(X10Frame_t);
+	if(!(plan = malloc(size)))
+		fatal("Out of memory in compileLights()");
+	memcpy(plan, &work, size);
+	return plan;
+}
+
+/*
+ * Return TRUE if all the lights of a rule are known to be on
+ */
+
+static Bool lightsOn(OccRulePtr_t r)
+{
+	int house, unit;
+	DevStatePtr_t ds;
+
+	for(house = 0; house < 16; house++){
+		if(!(r->lights.houses & (1 << house)))
+			continue;
+		for(unit = 0; unit < 16; unit++){
+			if(!(r->lights.units[house] & (1 << unit)))
+				continue;
+			ds = devstateGet(house, unit);
+			if((!(ds->flags & DS_KNOWN)) || (!(ds->flags & DS_ON)))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Queue turning the lights of a rule on or off
+ *
+ * ttl is how long the command may wait before it is dropped, 0 for as
+ * long as it takes.
+ */
+
+static void queueLights(X10PlanPtr_t plan, unsigned ttl)
+{
+	TxJobPtr_t job = txqSubmit(NULL, plan, NULL);
+
+	txqSetTTL(job, ttl);
+	journalAdd(job, JOURNAL_INTERNAL);
+}
+
+/*
+ * Timer handler: no motion for the timeout, turn the lights off
+ */
+
+static void vacant(TimerPtr_t t)
+{
+	OccRulePtr_t r = t->user;
+
+	debug(DEBUG_ACTION, "Occupancy %s: no motion for %u seconds, lights off", r->name, r->timeout);
+	r->offs++;
+	queueLights(r->offPlan, 0);
+}
+
+/*
+ * Parse and compile one rule. Returns NULL if the rule is not valid.
+ */
+
+static OccRulePtr_t parseRule(const String name, const String value, int defaultHouse)
+{
+	char ws[1024];
+	String lights, timeout;
+	int house, unit = 0;
+	X10Addrs_t sensor;
+	OccRulePtr_t r;
+
+	confreadStringCopy(ws, value, sizeof(ws));
+	if((!(lights = strchr(ws, ':'))) || (!(timeout = strchr(lights + 1, ':')))){
+		error("Occupancy rule %s: expected sensor:lights:timeout", name);
+		return NULL;
+	}
+	*lights++ = 0;
+	*timeout++ = 0;
+
+	/* The sensor must be exactly one address */
+	if(!planParseDevices(ws, defaultHouse, &sensor))
+		house = 16;
+	else
+		for(house = 0; (house < 16) && (!sensor.units[house]); house++);
+	if(house < 16)
+		for(unit = 0; !(sensor.units[house] & (1 << unit)); unit++);
+	if((house > 15) || (sensor.houses != (1 << house)) || (sensor.units[house] != (1 << unit))){
+		error("Occupancy rule %s: sensor %s is not a single address", name, ws);
+		return NULL;
+	}
+
+	if(!(r = calloc(1, sizeof(OccRule_t))))
+		fatal("Out of memory in parseRule()");
+	r->house = house;
+	r->unit = unit;
+
+	if((!planParseDevices(lights, defaultHouse, &r->lights)) || (!r->lights.houses)){
+		error("Occupancy rule %s: bad device list %s", name, lights);
+		free(r);
+		return NULL;
+	}
+	if(atoi(timeout) <= 0){
+		error("Occupancy rule %s: bad timeout %s", name, timeout);
+		free(r);
+		return NULL;
+	}
+	r->timeout = atoi(timeout);
+	if((!(r->onPlan = compileLights(&r->lights, COMMAND_ON))) ||
+	(!(r->offPlan = compileLights(&r->lights, COMMAND_OFF)))){
+		error("Occupancy rule %s: too many frames", name);
+		free(r->onPlan);
+		free(r);
+		return NULL;
+	}
+	if(!(r->name = strdup(name)))
+		fatal("Out of memory in parseRule()");
+	return r;
+}
+
+/*
+ * Free a list of rules, stopping their timers
+ */
+
+static void freeRules(OccRulePtr_t list)
+{
+	OccRulePtr_t r, next;
+
+	for(r = list; r; r = next){
+		next = r->next;
+		timerCancel(&r->timer);
+		free(r->onPlan);
+		free(r->offPlan);
+		free(r->name);
+		free(r);
+	}
+}
+
+
+/*
+ * Load and compile the [occupancy] section of the config file
+ *
+ * Any previously loaded rules are discarded. A rule which is reloaded
+ * under the same name keeps its running timer, so lights which are on
+ * still go off. The device registry must already be loaded. Returns
+ * the number of rules loaded.
+ */
+
+unsigned occupancyLoad(ConfigEntryPtr_t ce, int defaultHouse)
+{
+	KeyEntryPtr_t ke;
+	OccRulePtr_t r, old, oldList;
+	unsigned count = 0;
+	time_t now = time(NULL);
+
+	oldList = ruleList;
+	ruleList = NULL;
+	memset(sensorTable, 0, sizeof(sensorTable));
+
+	for(ke = confreadGetFirstKeyBySection(ce, "occupancy"); ke; ke = confreadGetNextKey(ke)){
+		if(!(r = parseRule(confreadGetKey(ke), confreadGetValue(ke), defaultHouse)))
+			continue;
+		for(old = oldList; old; old = old->next){
+			if((!strcmp(old->name, r->name)) && (old->timer.armed)){
+				timerStart(&r->timer, (old->timer.expires > now) ? old->timer.expires - now : 1, vacant, r);
+				break;
+			}
+		}
+		r->nextSensor = sensorTable[r->house][r->unit];
+		sensorTable[r->house][r->unit] = r;
+		r->next = ruleList;
+		ruleList = r;
+		debug(DEBUG_STATUS, "Occupancy rule %s: sensor %c%d, timeout %u seconds", r->name,
+		r->house + 'A', r->unit + 1, r->timeout);
+		count++;
+	}
+	freeRules(oldList);
+	return count;
+}
+
+/*
+ * Free all rules
+ */
+
+void occupancyFree(void)
+{
+	freeRules(ruleList);
+	ruleList = NULL;
+	memset(sensorTable, 0, sizeof(sensorTable));
+}
+
+/*
+ * Handle an X10 event. Motion is an "on" from a sensor address
+ */
+
+void occupancyEvent(int house, unsigned unitmask, unsigned function)
+{
+	int unit;
+	OccRulePtr_t r;
+
+	if((function != COMMAND_ON) || (house < 0) || (house > 15))
+		return;
+	for(unit = 0; unit < 16; unit++){
+		if(!(unitmask & (1 << unit)))
+			continue;
+		for(r = sensorTable[house][unit]; r; r = r->nextSensor){
+			r->triggers++;
+			if(!lightsOn(r)){
+				debug(DEBUG_ACTION, "Occupancy %s: motion, lights on", r->name);
+				queueLights(r->onPlan, OCC_ACTION_TTL);
+			}
+			timerStart(&r->timer, r->timeout, vacant, r);
+		}
+	}
+}
+
+/*
+ * Return the totals over all rules, and the number with a running timer
+ */
+
+void occupancyStats(unsigned *triggers, unsigned *offs, unsigned *active)
+{
+	OccRulePtr_t r;
+
+	*triggers = *offs = *active = 0;
+	for(r = ruleList; r; r = r->next){
+		*triggers += r->triggers;
+		*offs += r->offs;
+		if(r->timer.armed)
+			(*active)++;
+	}
+}
+
+/*
+ * Write the running timers as a [section] of name = expiry time, for occupancyRestoreTimers()
+ */
+
+void occupancySaveTimers(FILE *file, const String section)
+{
+	OccRulePtr_t r;
+
+	fprintf(file, "[%s]\n", section);
+	for(r = ruleList; r; r = r->next){
+		if(r->timer.armed)
+			fprintf(file, "%s = %ld\n", r->name, (long) r->timer.expires);
+	}
+}
+
+/*
+ * Restart the timers saved by occupancySaveTimers(). Timers which ran
+ * out meanwhile fire at the next tick. Returns the number restarted.
+ */
+
+unsigned occupancyRestoreTimers(ConfigEntryPtr_t ce, const String section)
+{
+	KeyEntryPtr_t ke;
+	OccRulePtr_t r;
+	unsigned count = 0;
+	time_t expires, now = time(NULL);
+
+	for(ke = confreadGetFirstKeyBySection(ce, section); ke; ke = confreadGetNextKey(ke)){
+		for(r = ruleList; (r) && (strcmp(r->name, confreadGetKey(ke))); r = r->next);
+		if(!r)
+			continue;
+		expires = (time_t) atol(confreadGetValue(ke));
+		timerStart(&r->timer, (expires > now) ? expires - now : 1, vacant, r);
+		count++;
+	}
+	return count;
+}
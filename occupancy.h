@@ -0,0 +1,71 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Occupancy rules
+*
+*/
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <stdio.h>
+#include "types.h"
+#include "confread.h"
+#include "plan.h"
+#include "timer.h"
+
+/* Seconds a motion "on" may wait in the queue, or in the journal over a
+   restart, before the room may well be empty again. The vacancy "off" has
+   no limit, as dropping it would leave the lights on with no timer left to
+   turn them off */
+#define OCC_ACTION_TTL		30
+
+/* Typedefs */
+
+typedef struct occrule OccRule_t;
+typedef OccRule_t * OccRulePtr_t;
+
+/* One occupancy rule */
+
+struct occrule{
+	String name;
+	uint8_t house;			/* Sensor address */
+	uint8_t unit;
+	unsigned timeout;		/* Seconds without motion before the lights go off */
+	unsigned triggers;		/* Sensor events seen */
+	unsigned offs;			/* Times the lights were turned off */
+	X10Addrs_t lights;
+	X10PlanPtr_t onPlan;
+	X10PlanPtr_t offPlan;
+	Timer_t timer;
+	OccRulePtr_t nextSensor;	/* Other rules for the same sensor */
+	OccRulePtr_t next;
+};
+
+/*
+* Function prototypes
+*/
+
+unsigned occupancyLoad(ConfigEntryPtr_t ce, int defaultHouse);
+void occupancyFree(void);
+void occupancyEvent(int house, unsigned unitmask, unsigned function);
+void occupancyStats(unsigned *triggers, unsigned *offs, unsigned *active);
+void occupancySaveTimers(FILE *file, const String section);
+unsigned occupancyRestoreTimers(ConfigEntryPtr_t ce, const String section);
+
+#endif
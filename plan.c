@@ -0,0 +1,587 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    X10 command planning
+*
+*    Turns device lists and functions into an ordered list of CM11A
+*    transmissions. The device list parser works on the caller's string
+*    and does not allocate memory.
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "notify.h"
+#include "x10.h"
+#include "devreg.h"
+#include "plan.h"
+
+/* x10.basic command names */
+
+static const struct {
+	const String name;
+	unsigned function;
+} commandTable[] = {
+	{"select", PLAN_FUNC_NONE},
+	{"all_units_off", COMMAND_ALL_UNITS_OFF},
+	{"all_lights_on", COMMAND_ALL_LIGHTS_ON},
+	{"all_lights_off", COMMAND_ALL_LIGHTS_OFF},
+	{"on", COMMAND_ON},
+	{"off", COMMAND_OFF},
+	{"dim", COMMAND_DIM},
+	{"bright", COMMAND_BRIGHT},
+	{"extended", COMMAND_EXTENDED_CODE},
+	{"hail_req", COMMAND_HAIL_REQUEST},
+	{"predim1", COMMAND_PRESET_DIM1},
+	{"predim2", COMMAND_PRESET_DIM2},
+	{"status", COMMAND_STATUS_REQUEST},
+	{NULL, 0}
+};
+
+/*
+ * Read a unit number from 1 to 16. Returns 0 if there isn't one
+ */
+
+static int scanUnit(const char **pp)
+{
+	const char *p = *pp;
+	int n = 0;
+
+	while(isdigit(*p) && (n <= 16))
+		n = n * 10 + (*p++ - '0');
+	if((p == *pp) || (n < 1) || (n > 16))
+		return 0;
+	*pp = p;
+	return n;
+}
+
+/*
+ * Read an optional house letter. Returns the house index, or -1 if there isn't one
+ */
+
+static int scanHouse(const char **pp)
+{
+	char c = toupper(**pp);
+
+	if((c < 'A') || (c > 'P'))
+		return -1;
+	(*pp)++;
+	return c - 'A';
+}
+
+
+/*
+ * Parse a unit, a unit range, an address, an address range or "all"
+ *
+ * Returns TRUE if one was found, and leaves *pp pointing after it.
+ */
+
+static Bool scanRange(const char **pp, int defaultHouse, int *house, int *first, int *last)
+{
+	const char *p = *pp;
+	int h;
+
+	if((!strncasecmp(p, "all", 3)) && ((p[3] == ',') || (p[3] == 0) || isspace(p[3]))){
+		*house = defaultHouse;
+		*first = 1;
+		*last = 16;
+		*pp = p + 3;
+		return TRUE;
+	}
+	if((*house = scanHouse(&p)) < 0)
+		*house = defaultHouse;
+	if(!(*first = scanUnit(&p)))
+		return FALSE;
+	*last = *first;
+	if(*p == '-'){
+		p++;
+		/* The end of a range may repeat the house letter */
+		if(((h = scanHouse(&p)) >= 0) && (h != *house))
+			return FALSE;
+		if(!(*last = scanUnit(&p)) || (*last < *first))
+			return FALSE;
+	}
+	*pp = p;
+	return TRUE;
+}
+
+
+/*
+ * Parse a device list into per house unit masks
+ *
+ * Entries are separated by commas and can be a unit (3), a range (1-8),
+ * a full address (A3), an address range (A3-5 or A3-A5), "all" for
+ * all units in the default house, or the name of a device in the
+ * [devices] config section. Entries without a house letter use the
+ * default house.
+ *
+ * Returns TRUE if the whole list was valid.
+ */
+
+Bool planParseDevices(const String list, int defaultHouse, X10AddrsPtr_t addrs)
+{
+	const char *p = list;
+	const char *tok, *end;
+	size_t len;
+	int house, first, last;
+	DevEntryPtr_t de;
+
+	if((!list) || (!addrs) || (defaultHouse < 0) || (defaultHouse > 15))
+		return FALSE;
+
+	memset(addrs, 0, sizeof(X10Addrs_t));
+
+	for(;;){
+		while(isspace(*p))
+			p++;
+		/* Find the end of this entry, less any trailing white space */
+		tok = p;
+		for(end = p; *end && (*end != ','); end++);
+		for(len = end - tok; len && isspace(tok[len - 1]); len--);
+
+		if((!scanRange(&p, defaultHouse, &house, &first, &last)) || (p != tok + len)){
+			/* Not an address, try it as a device name */
+			if(!(de = devregFind(tok, len)))
+				return FALSE;
+			house = de->house;
+			first = last = de->unit + 1;
+		}
+		/* Set bits first through last */
+		addrs->units[house] |= (uint16_t) (((1 << last) - 1) & ~((1 << (first - 1)) - 1));
+		addrs->houses |= (uint16_t) (1 << house);
+
+		if(*end == 0)
+			break;
+		p = end + 1;
+	}
+	return TRUE;
+}
+
+/*
+ * Format a set of addresses as a device list planParseDevices() accepts
+ *
+ * Every entry has its house letter and runs of units are written as
+ * ranges, for example A1-3,A5,B2. Returns FALSE if the list does not fit.
+ */
+
+Bool planFormatDevices(X10AddrsPtr_t addrs, String buf, size_t size)
+{
+	int house, first, last;
+	size_t pos = 0;
+	int n;
+
+	if((!addrs) || (!buf) || (!size))
+		return FALSE;
+	buf[0] = 0;
+	for(house = 0; house < 16; house++){
+		if(!(addrs->houses & (1 << house)))
+			continue;
+		for(first = 0; first < 16; first = last + 1){
+			if(!(addrs->units[house] & (1 << first))){
+				last = first;
+				continue;
+			}
+			for(last = first; (last < 15) && (addrs->units[house] & (1 << (last + 1))); last++);
+			if(last == first)
+				n = snprintf(buf + pos, size - pos, "%s%c%d", pos ? "," : "", 'A' + house, first + 1);
+			else
+				n = snprintf(buf + pos, size - pos, "%s%c%d-%d", pos ? "," : "", 'A' + house, first + 1, last + 1);
+			if((n < 0) || ((size_t) n >= size - pos))
+				return FALSE;
+			pos += n;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Sort the units in a house into the ones a function can be sent to as is,
+ * and the ones where it has to be rewritten into another function.
+ * Units registered as not supporting the function are dropped.
+ *
+ * Unregistered units are always sent the function as is.
+ */
+
+static void filterUnits(int house, uint16_t units, unsigned function, uint16_t *asis, uint16_t *rewrite)
+{
+	int unit;
+	uint16_t bit;
+	Bool ok;
+	DevEntryPtr_t de;
+
+	*asis = units;
+	*rewrite = 0;
+
+	if(function == PLAN_FUNC_NONE)
+		return;
+
+	for(unit = 0; unit < 16; unit++){
+		bit = 1 << unit;
+		if((!(units & bit)) || (!(de = devregByAddress(house, unit))))
+			continue;
+		switch(function){
+			case COMMAND_DIM:
+			case COMMAND_BRIGHT:
+			case COMMAND_PRESET_DIM1:
+			case COMMAND_PRESET_DIM2:
+				ok = (de->caps & DEV_CAP_DIMMABLE) ? TRUE : FALSE;
+				/* Bright on an appliance module is just an on */
+				if((!ok) && (function == COMMAND_BRIGHT) && (de->type == DEVICE_APPLIANCE))
+					*rewrite |= bit;
+				break;
+
+			case COMMAND_EXTENDED_CODE:
+				ok = (de->caps & DEV_CAP_EXTDIM) ? TRUE : FALSE;
+				break;
+
+			case COMMAND_STATUS_REQUEST:
+				ok = (de->caps & DEV_CAP_TWOWAY) ? TRUE : FALSE;
+				break;
+
+			default:
+				ok = TRUE;
+				break;
+		}
+		/* Motion detectors only transmit */
+		if(de->type == DEVICE_MOTION_DETECTOR)
+			ok = FALSE;
+		if(!ok){
+			*asis &= ~bit;
+			if(!(*rewrite & bit))
+				debug(DEBUG_EXPECTED, "Function %u not sent to %s (%s)", function, de->name, devregTypeName(de->type));
+		}
+	}
+}
+
+/*
+ * Empty a plan
+ */
+
+void planInit(X10PlanPtr_t plan)
+{
+	plan->count = 0;
+}
+
+
+/*
+ * Return the house the last frame of a plan was sent to, or the default if the plan is empty
+ */
+
+int planLastHouse(X10PlanPtr_t plan, int defaultHouse)
+{
+	if((!plan) || (!plan->count))
+		return defaultHouse;
+	return plan->frame[plan->count - 1].house;
+}
+
+
+/*
+ * Append the address frames for a unit mask followed by a function frame
+ *
+ * Returns FALSE if the plan would overflow.
+ */
+
+static Bool addFrames(X10PlanPtr_t plan, int house, uint16_t units, Bool address, unsigned function, int level, int data1, int data2)
+{
+	int unit;
+	unsigned char hc;
+	X10FramePtr_t f;
+
+	x10_letter_to_housecode('A' + house, &hc);
+
+	/* Address frames */
+	for(unit = 0; (address) && (unit < 16); unit++){
+		if(!(units & (1 << unit)))
+			continue;
+		if(plan->count >= PLAN_MAX_FRAMES)
+			return FALSE;
+		f = &plan->frame[plan->count++];
+		f->house = house;
+		f->function = PLAN_FUNC_NONE;
+		f->level = 0;
+		f->unitmask = 1 << unit;
+		f->pkt[0] = HEADER_DEFAULT;
+		x10_number_to_devicecode(unit + 1, f->pkt + 1);
+		f->pkt[1] |= (hc << 4);
+		f->len = 2;
+	}
+
+	if(function == PLAN_FUNC_NONE) /* Select only */
+		return TRUE;
+
+	/* Function frame */
+	if(plan->count >= PLAN_MAX_FRAMES)
+		return FALSE;
+	f = &plan->frame[plan->count++];
+	f->house = house;
+	f->function = function;
+	f->level = 0;
+	f->unitmask = units;
+	f->pkt[0] = HEADER_DEFAULT | HEADER_FUNCTION;
+	f->pkt[1] = (hc << 4) | (function & 0x0F);
+	f->len = 2;
+	switch(function){
+		case COMMAND_DIM:
+		case COMMAND_BRIGHT:
+			/* Header holds the number of dims, 22 is 100% */
+			f->level = level;
+			f->pkt[0] |= (((level * 22 + 50) / 100) << 3);
+			break;
+
+		case COMMAND_EXTENDED_CODE:
+			f->pkt[0] |= HEADER_EXTENDED;
+			f->pkt[2] = (unsigned char) data1;
+			f->pkt[3] = (unsigned char) data2;
+			f->len = 4;
+			break;
+
+		default:
+			break;
+	}
+	return TRUE;
+}
+
+
+/*
+ * Append the frames for a function to the units of one house
+ *
+ * Functions which act on a whole house don't need the addresses, so
+ * those are not sent. Units registered as unable to act on the function
+ * are dropped, or sent an equivalent function they do understand.
+ *
+ * selected holds the units currently addressed in this house. Modules stay
+ * addressed after a function until new addresses are sent, so the
+ * addresses are skipped when they are already selected.
+ *
+ * Returns FALSE if the plan would overflow.
+ */
+
+static Bool addHouse(X10PlanPtr_t plan, int house, uint16_t units, uint16_t *selected, unsigned function, int level, int data1, int data2)
+{
+	uint16_t asis, rewrite;
+
+	if((function == COMMAND_ALL_UNITS_OFF) || (function == COMMAND_ALL_LIGHTS_ON) || (function == COMMAND_ALL_LIGHTS_OFF)){
+		*selected = 0;
+		return addFrames(plan, house, units, FALSE, function, level, data1, data2);
+	}
+
+	filterUnits(house, units, function, &asis, &rewrite);
+	if(asis){
+		if(!addFrames(plan, house, asis, (asis != *selected) || (function == PLAN_FUNC_NONE), function, level, data1, data2))
+			return FALSE;
+		*selected = asis;
+	}
+	if(rewrite){
+		if(!addFrames(plan, house, rewrite, rewrite != *selected, COMMAND_ON, 0, 0, 0))
+			return FALSE;
+		*selected = rewrite;
+	}
+	return TRUE;
+}
+
+
+/*
+ * Append the frames for a function to a plan
+ *
+ * Each house is visited once: its addresses are sent followed by the
+ * function. Houses are visited starting with firstHouse so a plan can
+ * continue on the housecode the powerline was last addressed with.
+ *
+ * Returns FALSE if the plan would overflow.
+ */
+
+Bool planAddFunction(X10PlanPtr_t plan, X10AddrsPtr_t addrs, unsigned function, int level, int data1, int data2, int firstHouse)
+{
+	int i, house;
+	uint16_t selected;
+
+	if((!plan) || (!addrs))
+		return FALSE;
+
+	if((level < 0) || (level > 100))
+		level = 100;
+
+	for(i = 0; i < 16; i++){
+		house = (firstHouse + i) & 0x0F;
+		if(!(addrs->houses & (1 << house)))
+			continue;
+		selected = 0;
+		if(!addHouse(plan, house, addrs->units[house], &selected, function, level, data1, data2))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Return the units a function acts on in one house. Whole house functions act on all of them
+ */
+
+static uint16_t actsOn(unsigned function, X10AddrsPtr_t addrs, int house)
+{
+	if(!(addrs->houses & (1 << house)))
+		return 0;
+	if((function == COMMAND_ALL_UNITS_OFF) || (function == COMMAND_ALL_LIGHTS_ON) || (function == COMMAND_ALL_LIGHTS_OFF))
+		return 0xFFFF;
+	return addrs->units[house];
+}
+
+/*
+ * Empty a plan builder
+ */
+
+void planBuilderInit(X10BuilderPtr_t b)
+{
+	b->count = 0;
+}
+
+/*
+ * Add a function to a plan builder
+ *
+ * The function is merged into an earlier group with the same function
+ * and arguments when that can't change the outcome: no later group may
+ * act on the same units, and dim/bright/extended groups must not already
+ * contain them since those functions add up.
+ *
+ * Returns FALSE if there are too many groups.
+ */
+
+Bool planBuilderAdd(X10BuilderPtr_t b, X10AddrsPtr_t addrs, unsigned function, int level, int data1, int data2)
+{
+	int i, house;
+	Bool cumulative, overlap;
+	X10GroupPtr_t g;
+
+	if((!b) || (!addrs))
+		return FALSE;
+
+	if((level < 0) || (level > 100))
+		level = 100;
+
+	cumulative = (function == COMMAND_DIM) || (function == COMMAND_BRIGHT) || (function == COMMAND_EXTENDED_CODE);
+
+	/* Search back for a group to merge with, stopping at the first one acting on the same units */
+	for(i = (int) b->count - 1; i >= 0; i--){
+		g = &b->group[i];
+		for(house = 0, overlap = FALSE; (house < 16) && (!overlap); house++)
+			overlap = (actsOn(g->function, &g->addrs, house) & actsOn(function, addrs, house)) ? TRUE : FALSE;
+		if((g->function == function) && (g->level == level) && (g->data1 == data1) && (g->data2 == data2)){
+			if((!overlap) || (!cumulative)){
+				for(house = 0; house < 16; house++)
+					g->addrs.units[house] |= addrs->units[house];
+				g->addrs.houses |= addrs->houses;
+				return TRUE;
+			}
+			break;
+		}
+		if(overlap)
+			break;
+	}
+
+	if(b->count >= PLAN_MAX_GROUPS)
+		return FALSE;
+	g = &b->group[b->count++];
+	g->addrs = *addrs;
+	g->function = function;
+	g->level = level;
+	g->data1 = data1;
+	g->data2 = data2;
+	return TRUE;
+}
+
+/*
+ * Compile the groups in a plan builder into a plan
+ *
+ * The groups are emitted one house at a time starting with firstHouse,
+ * keeping the order of the groups within each house. Groups in different
+ * houses act on different modules, so this gives the same result as
+ * sending them in order, with the fewest housecode switches.
+ *
+ * Returns FALSE if the plan would overflow.
+ */
+
+Bool planBuilderCompile(X10BuilderPtr_t b, X10PlanPtr_t plan, int firstHouse)
+{
+	int i, house;
+	unsigned g;
+	uint16_t selected;
+
+	if((!b) || (!plan))
+		return FALSE;
+
+	for(i = 0; i < 16; i++){
+		house = (firstHouse + i) & 0x0F;
+		selected = 0;
+		for(g = 0; g < b->count; g++){
+			if(!(b->group[g].addrs.houses & (1 << house)))
+				continue;
+			if(!addHouse(plan, house, b->group[g].addrs.units[house], &selected, b->group[g].function,
+			b->group[g].level, b->group[g].data1, b->group[g].data2))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Look up the X10 function for an x10.basic command name
+ *
+ * Returns TRUE if the command is known.
+ */
+
+Bool planCommandFunction(const String command, unsigned *function)
+{
+	int i;
+
+	if(!command)
+		return FALSE;
+	for(i = 0; commandTable[i].name; i++){
+		if(!strcmp(command, commandTable[i].name)){
+			*function = commandTable[i].function;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Estimate the time a frame takes on the powerline, in milliseconds
+ *
+ * This includes the serial handshake with the CM11A. Each dim step is
+ * another function transmission.
+ */
+
+unsigned planFrameTime(X10FramePtr_t f)
+{
+	if(f->len > 2)
+		return PLAN_EXTENDED_MS;
+	return PLAN_FRAME_MS + (f->pkt[0] >> 3) * PLAN_DIM_STEP_MS;
+}
+
+/*
+ * Estimate the time a plan takes on the powerline, in milliseconds
+ */
+
+unsigned planTime(X10PlanPtr_t plan)
+{
+	unsigned i, t;
+
+	for(i = t = 0; (plan) && (i < plan->count); i++)
+		t += planFrameTime(&plan->frame[i]);
+	return t;
+}
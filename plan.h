@@ -0,0 +1,114 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    X10 command planning
+*
+*/
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stddef.h>
+#include "types.h"
+
+/* Enough for every address in every house plus a function per house, twice over */
+#define PLAN_MAX_FRAMES		576
+
+/* Maximum number of distinct functions in a plan builder */
+#define PLAN_MAX_GROUPS		64
+
+/* Function code used for address frames and for select (address only) */
+#define PLAN_FUNC_NONE		0xFF
+
+/* Powerline time estimates in milliseconds, including the CM11A handshake */
+#define PLAN_FRAME_MS		800
+#define PLAN_DIM_STEP_MS	183
+#define PLAN_EXTENDED_MS	1200
+
+/* Typedefs */
+
+typedef struct x10addrs X10Addrs_t;
+typedef X10Addrs_t * X10AddrsPtr_t;
+typedef struct x10frame X10Frame_t;
+typedef X10Frame_t * X10FramePtr_t;
+typedef struct x10plan X10Plan_t;
+typedef X10Plan_t * X10PlanPtr_t;
+typedef struct x10group X10Group_t;
+typedef X10Group_t * X10GroupPtr_t;
+typedef struct x10builder X10Builder_t;
+typedef X10Builder_t * X10BuilderPtr_t;
+
+/* A set of X10 addresses, one unit mask per house. Bit 0 is unit 1 */
+
+struct x10addrs{
+	uint16_t houses;		/* Bit 0 is house A */
+	uint16_t units[16];
+};
+
+/* One CM11A transmission */
+
+struct x10frame{
+	uint8_t len;
+	uint8_t house;			/* 0-15 for A-P */
+	uint8_t function;		/* COMMAND_ code, or PLAN_FUNC_NONE for an address */
+	uint8_t level;			/* Dim/bright amount in percent */
+	uint16_t unitmask;		/* Units a function frame applies to */
+	unsigned char pkt[4];
+};
+
+/* An ordered list of transmissions */
+
+struct x10plan{
+	unsigned count;
+	X10Frame_t frame[PLAN_MAX_FRAMES];
+};
+
+/* One function and the addresses it is sent to */
+
+struct x10group{
+	uint8_t function;
+	uint8_t level;
+	uint8_t data1;
+	uint8_t data2;
+	X10Addrs_t addrs;
+};
+
+/* Collects functions to be merged and ordered into one plan */
+
+struct x10builder{
+	unsigned count;
+	X10Group_t group[PLAN_MAX_GROUPS];
+};
+
+/*
+* Function prototypes
+*/
+
+Bool planParseDevices(const String list, int defaultHouse, X10AddrsPtr_t addrs);
+Bool planFormatDevices(X10AddrsPtr_t addrs, String buf, size_t size);
+void planInit(X10PlanPtr_t plan);
+Bool planAddFunction(X10PlanPtr_t plan, X10AddrsPtr_t addrs, unsigned function, int level, int data1, int data2, int firstHouse);
+int planLastHouse(X10PlanPtr_t plan, int defaultHouse);
+void planBuilderInit(X10BuilderPtr_t b);
+Bool planBuilderAdd(X10BuilderPtr_t b, X10AddrsPtr_t addrs, unsigned function, int level, int data1, int data2);
+Bool planBuilderCompile(X10BuilderPtr_t b, X10PlanPtr_t plan, int firstHouse);
+Bool planCommandFunction(const String command, unsigned *function);
+unsigned planFrameTime(X10FramePtr_t f);
+unsigned planTime(X10PlanPtr_t plan);
+
+#endif
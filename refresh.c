@@ -0,0 +1,229 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Background status refresh for two-way modules
+*
+*    Each registered two-way device has a staleness limit, its refresh=
+*    option or the configured default. When the transmit queue has been
+*    idle for REFRESH_BACKOFF_SECS and no verifications are running, one
+*    status request at a time is sent to the device closest to its
+*    limit, once it is REFRESH_START_PCT of the way there. The reply
+*    updates the device state table.
+*
+*    Any other work arriving makes the refresher back off. A request
+*    still waiting in the queue is cancelled.
+*
+*    A device which doesn't reply is left alone for the rest of its
+*    refresh window, limit * (100 - REFRESH_START_PCT) / 100 seconds,
+*    so an unplugged module doesn't take every idle moment.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "notify.h"
+#include "x10.h"
+#include "devreg.h"
+#include "devstate.h"
+#include "txq.h"
+#include "verify.h"
+#include "refresh.h"
+
+static unsigned defaultLimit = 0;
+static time_t lastBusy = 0;
+static TxJobPtr_t requestJob = NULL;	/* Request waiting in the queue */
+static int waitHouse = -1;		/* Device waiting for a reply */
+static int waitUnit = -1;
+static time_t deadline = 0;
+static unsigned requestCount = 0;
+static unsigned replyCount = 0;
+static unsigned timeoutCount = 0;
+static time_t missed[16][16];		/* When each device last failed to reply, 0 if it did */
+static unsigned missCount[16][16];	/* Replies missed by each device */
+
+
+/*
+ * Called by the transmit queue when a status request has been sent
+ */
+
+static void requestSent(TxJobPtr_t job)
+{
+	requestJob = NULL;
+	if(job->result == TXQ_OK)
+		deadline = time(NULL) + REFRESH_REPLY_SECS;
+	else
+		waitHouse = waitUnit = -1;
+}
+
+/*
+ * Match the queued refresh request
+ */
+
+static Bool matchRequest(TxJobPtr_t job, void *arg)
+{
+	return (job == requestJob) ? TRUE : FALSE;
+}
+
+/*
+ * Pick the two-way device closest to its staleness limit
+ *
+ * Returns FALSE if no device is far enough into its limit.
+ */
+
+static Bool pickDevice(time_t now, int *house, int *unit)
+{
+	int h, u;
+	long slack, best = 0;
+	unsigned limit;
+	Bool found = FALSE;
+	DevEntryPtr_t de;
+	DevStatePtr_t ds;
+
+	for(h = 0; h < 16; h++){
+		for(u = 0; u < 16; u++){
+			if((!(de = devregByAddress(h, u))) || (!(de->caps & DEV_CAP_TWOWAY)))
+				continue;
+			if(!(limit = de->refresh ? de->refresh : defaultLimit))
+				continue;
+			if((missed[h][u]) && ((now - missed[h][u]) * 100 < (long) limit * (100 - REFRESH_START_PCT)))
+				continue;
+			ds = devstateGet(h, u);
+			if((ds->updated) && ((now - ds->updated) * 100 < (long) limit * REFRESH_START_PCT))
+				continue;
+			slack = (long) limit - (ds->updated ? (long) (now - ds->updated) : (long) limit);
+			if((!found) || (slack < best)){
+				best = slack;
+				*house = h;
+				*unit = u;
+				found = TRUE;
+			}
+		}
+	}
+	return found;
+}
+
+
+/*
+ * Set the staleness limit in seconds for two-way devices without their own. 0 disables them
+ */
+
+void refreshSetDefault(unsigned seconds)
+{
+	defaultLimit = seconds;
+}
+
+/*
+ * Refresh one device if the powerline has been idle long enough. Called once a second
+ */
+
+void refreshTick(void)
+{
+	int house, unit;
+	X10Addrs_t addrs;
+	time_t now = time(NULL);
+	static X10Plan_t plan;
+
+	/* Back off while anything else is using the powerline */
+	if((txqPending() > (requestJob ? 1U : 0U)) || (!verifyIdle())){
+		lastBusy = now;
+		if((requestJob) && (!requestJob->started.tv_sec)){
+			debug(DEBUG_ACTION, "Refresh backing off");
+			txqCancel(matchRequest, NULL);
+		}
+		return;
+	}
+
+	if(waitHouse >= 0){
+		if((!deadline) || (now < deadline))
+			return;
+		debug(DEBUG_EXPECTED, "Refresh %c%d: no reply", 'A' + waitHouse, waitUnit + 1);
+		timeoutCount++;
+		missed[waitHouse][waitUnit] = now;
+		missCount[waitHouse][waitUnit]++;
+		waitHouse = waitUnit = -1;
+		deadline = 0;
+	}
+
+	if((requestJob) || (now - lastBusy < REFRESH_BACKOFF_SECS) || (!pickDevice(now, &house, &unit)))
+		return;
+
+	memset(&addrs, 0, sizeof(addrs));
+	addrs.houses = 1 << house;
+	addrs.units[house] = 1 << unit;
+	planInit(&plan);
+	planAddFunction(&plan, &addrs, COMMAND_STATUS_REQUEST, 0, 0, 0, house);
+	waitHouse = house;
+	waitUnit = unit;
+	deadline = 0;
+	requestCount++;
+	debug(DEBUG_ACTION, "Refresh %c%d: sending status request", 'A' + house, unit + 1);
+	requestJob = txqSubmit(NULL, &plan, requestSent);
+}
+
+/*
+ * Return TRUE if no refresh request is queued or waiting for a reply
+ */
+
+Bool refreshIdle(void)
+{
+	return ((!requestJob) && (waitHouse < 0)) ? TRUE : FALSE;
+}
+
+/*
+ * Match a status reply from the powerline against the refresh request outstanding
+ *
+ * unitmask is 0 if the reply carried no address.
+ * Returns TRUE if the reply was for the refresh request.
+ */
+
+Bool refreshStatusReply(int house, unsigned unitmask, Bool on)
+{
+	if((waitHouse != house) || (!deadline) || ((unitmask) && (!(unitmask & (1 << waitUnit)))))
+		return FALSE;
+	devstateApply(house, 1 << waitUnit, on ? COMMAND_STATUS_ON : COMMAND_STATUS_OFF, 0);
+	replyCount++;
+	missed[house][waitUnit] = 0;
+	waitHouse = waitUnit = -1;
+	deadline = 0;
+	return TRUE;
+}
+
+/*
+ * Return the number of refresh replies a device has missed
+ */
+
+unsigned refreshMisses(int house, int unit)
+{
+	return missCount[house & 0x0F][unit & 0x0F];
+}
+
+/*
+ * Return the refresh counters
+ */
+
+void refreshStats(unsigned *requests, unsigned *replies, unsigned *timeouts)
+{
+	if(requests)
+		*requests = requestCount;
+	if(replies)
+		*replies = replyCount;
+	if(timeouts)
+		*timeouts = timeoutCount;
+}
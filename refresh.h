@@ -0,0 +1,48 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Background status refresh for two-way modules
+*
+*/
+
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include "types.h"
+
+/* Seconds the powerline must be idle before refreshing starts again */
+#define REFRESH_BACKOFF_SECS	10
+
+/* Seconds a refreshed device has to answer before it counts as a miss and is skipped for a while */
+#define REFRESH_REPLY_SECS	3
+
+/* Devices are refreshed once they are this far (percent) into their staleness limit */
+#define REFRESH_START_PCT	75
+
+/*
+* Function prototypes
+*/
+
+void refreshSetDefault(unsigned seconds);
+void refreshTick(void);
+Bool refreshIdle(void);
+Bool refreshStatusReply(int house, unsigned unitmask, Bool on);
+unsigned refreshMisses(int house, int unit);
+void refreshStats(unsigned *requests, unsigned *replies, unsigned *timeouts);
+
+#endif
@@ -0,0 +1,460 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Event to action rules
+*
+*    Loads the [rules] section of the config file. Each rule is a
+*    trigger and an action separated by >, followed by any guards, each
+*    starting with &:
+*
+*    hall = B1:on>A1-3:on
+*    night = C5:off>C1:all_lights_off&time=22:00-06:00
+*    porch = D2:on>evening&state=A1:off
+*
+*    The trigger is a device list and the function received. A house
+*    letter on its own matches the function from any unit in the house,
+*    which is how house wide functions such as all_lights_off are
+*    caught. The action is an action list in [scenes] syntax, compiled
+*    when the rules are loaded, or the name of a scene. A time guard
+*    holds between two times of day, and a state guard holds when all
+*    the devices listed are on, off or unknown.
+*
+*    Rules are kept in a table indexed by house, unit and function, so
+*    finding the rules for an event takes no searching. Actions go
+*    through the transmit queue as local jobs.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "notify.h"
+#include "x10.h"
+#include "devstate.h"
+#include "txq.h"
+#include "journal.h"
+#include "scene.h"
+#include "schedule.h"
+#include "rules.h"
+
+#define RULES_BUCKETS	64
+
+typedef struct rulelink RuleLink_t;
+typedef RuleLink_t * RuleLinkPtr_t;
+
+/* Entry in a lookup table slot */
+
+struct rulelink{
+	RulePtr_t rule;
+	RuleLinkPtr_t next;
+};
+
+static RuleLinkPtr_t ruleTable[16][RULES_ANY_UNIT + 1][16];
+static RulePtr_t ruleHash[RULES_BUCKETS];
+static RulePtr_t ruleList = NULL;
+static RulePtr_t ruleTail = NULL;
+static unsigned eventStamp = 0;
+
+/* Event function names, as published in x10.basic triggers */
+
+static const struct{
+	const char *name;
+	unsigned function;
+} eventTable[] = {
+	{"all_units_off", COMMAND_ALL_UNITS_OFF},
+	{"all_lights_on", COMMAND_ALL_LIGHTS_ON},
+	{"all_lights_off", COMMAND_ALL_LIGHTS_OFF},
+	{"on", COMMAND_ON},
+	{"off", COMMAND_OFF},
+	{"dim", COMMAND_DIM},
+	{"bright", COMMAND_BRIGHT},
+	{"extended_code", COMMAND_EXTENDED_CODE},
+	{"hail_request", COMMAND_HAIL_REQUEST},
+	{"hail_ack", COMMAND_HAIL_ACKNOWLEDGE},
+	{"predim1", COMMAND_PRESET_DIM1},
+	{"predim2", COMMAND_PRESET_DIM2},
+	{"extended", COMMAND_EXTENDED_DATA_TRANSFER},
+	{"status_on", COMMAND_STATUS_ON},
+	{"status_off", COMMAND_STATUS_OFF},
+	{"status", COMMAND_STATUS_REQUEST},
+	{NULL, 0}
+};
+
+
+/*
+ * Add a rule to one lookup table slot
+ */
+
+static void addLink(RulePtr_t r, int house, int unit, unsigned function)
+{
+	RuleLinkPtr_t rl;
+
+	if(!(rl = malloc(sizeof(RuleLink_t))))
+		fatal("Out of memory in addLink()");
+	rl->rule = r;
+	rl->next = ruleTable[house][unit][function];
+	ruleTable[house][unit][function] = rl;
+}
+
+/*
+ * Empty the lookup table
+ */
+
+static void freeLinks(void)
+{
+	int house, unit, function;
+	RuleLinkPtr_t rl, next;
+
+	for(house = 0; house < 16; house++){
+		for(unit = 0; unit <= RULES_ANY_UNIT; unit++){
+			for(function = 0; function < 16; function++){
+				for(rl = ruleTable[house][unit][function]; rl; rl = next){
+					next = rl->next;
+					free(rl);
+				}
+				ruleTable[house][unit][function] = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * Parse a guard. Returns FALSE if it is not valid
+ */
+
+static Bool parseGuard(String text, int defaultHouse, RuleGuardPtr_t g)
+{
+	String arg;
+
+	memset(g, 0, sizeof(RuleGuard_t));
+	if(!strncmp(text, "time=", 5)){
+		g->type = RG_TIME;
+		if(!(arg = strchr(text + 5, '-')))
+			return FALSE;
+		*arg++ = 0;
+		return (((g->from = scheduleParseTime(text + 5)) >= 0) && ((g->to = scheduleParseTime(arg)) >= 0)) ? TRUE : FALSE;
+	}
+	if(!strncmp(text, "state=", 6)){
+		g->type = RG_STATE;
+		if(!(arg = strrchr(text + 6, ':')))
+			return FALSE;
+		*arg++ = 0;
+		if(!strcmp(arg, "on"))
+			g->state = 1;
+		else if(!strcmp(arg, "off"))
+			g->state = 0;
+		else if(!strcmp(arg, "unknown"))
+			g->state = -1;
+		else
+			return FALSE;
+		return planParseDevices(text + 6, defaultHouse, &g->addrs);
+	}
+	return FALSE;
+}
+
+/*
+ * Return TRUE if a guard holds now
+ */
+
+static Bool checkGuard(RuleGuardPtr_t g, int secs)
+{
+	int house, unit, state;
+	DevStatePtr_t ds;
+
+	if(g->type == RG_TIME){
+		if(g->from <= g->to)
+			return ((secs >= g->from) && (secs < g->to)) ? TRUE : FALSE;
+		return ((secs >= g->from) || (secs < g->to)) ? TRUE : FALSE; /* Past midnight */
+	}
+	for(house = 0; house < 16; house++){
+		for(unit = 0; (g->addrs.units[house]) && (unit < 16); unit++){
+			if(!(g->addrs.units[house] & (1 << unit)))
+				continue;
+			ds = devstateGet(house, unit);
+			state = (ds->flags & DS_KNOWN) ? ((ds->flags & DS_ON) ? 1 : 0) : -1;
+			if(state != g->state)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Called by the transmit queue when a rule's action has been sent
+ */
+
+static void actionSent(TxJobPtr_t job)
+{
+	unsigned ms;
+	RulePtr_t r;
+
+	/* The rules may have been reloaded since, so look it up again */
+	if((job->result != TXQ_OK) || (!(r = rulesFind(txqGetNV(job, "rule")))))
+		return;
+	ms = txqWaitMs(job) + txqTxMs(job);
+	r->completed++;
+	r->lastMs = ms;
+	r->totalMs += ms;
+	if(ms > r->maxMs)
+		r->maxMs = ms;
+}
+
+/*
+ * Parse and compile one rule, and add it to the lookup table
+ *
+ * Returns NULL if the rule is not valid.
+ */
+
+static RulePtr_t parseRule(const String name, const String value, int defaultHouse)
+{
+	char ws[1024];
+	String action, function, guard, next;
+	int house, unit;
+	unsigned i, fn;
+	X10Addrs_t trigger;
+	RuleGuard_t guards[RULES_MAX_GUARDS];
+	unsigned guardCount = 0;
+	X10PlanPtr_t plan = NULL;
+	RulePtr_t r;
+
+	confreadStringCopy(ws, value, sizeof(ws));
+	if(!(action = strchr(ws, '>'))){
+		error("Rule %s: expected trigger>action", name);
+		return NULL;
+	}
+	*action++ = 0;
+	if((guard = strchr(action, '&')))
+		*guard++ = 0;
+	for(; guard; guard = next){
+		if((next = strchr(guard, '&')))
+			*next++ = 0;
+		if((guardCount == RULES_MAX_GUARDS) || (!parseGuard(guard, defaultHouse, &guards[guardCount]))){
+			error("Rule %s: bad or too many guards at %s", name, guard);
+			return NULL;
+		}
+		guardCount++;
+	}
+
+	/* Trigger */
+	if(!(function = strrchr(ws, ':'))){
+		error("Rule %s: trigger needs a function", name);
+		return NULL;
+	}
+	*function++ = 0;
+	for(i = 0; (eventTable[i].name) && (strcmp(eventTable[i].name, function)); i++);
+	if(!eventTable[i].name){
+		error("Rule %s: unknown function %s", name, function);
+		return NULL;
+	}
+	fn = eventTable[i].function;
+	memset(&trigger, 0, sizeof(trigger));
+	if((strlen(ws) == 1) && (toupper(ws[0]) >= 'A') && (toupper(ws[0]) <= 'P'))
+		trigger.houses = 1 << (toupper(ws[0]) - 'A'); /* Any unit */
+	else if(!planParseDevices(ws, defaultHouse, &trigger)){
+		error("Rule %s: bad trigger device list %s", name, ws);
+		return NULL;
+	}
+
+	/* Action */
+	if(strchr(action, ':')){
+		if(!(plan = sceneCompile(name, action, defaultHouse)))
+			return NULL;
+	}
+	else if(!sceneFind(action)){
+		error("Rule %s: unknown scene %s", name, action);
+		return NULL;
+	}
+
+	if(!(r = calloc(1, sizeof(Rule_t))) || !(r->name = strdup(name)))
+		fatal("Out of memory in parseRule()");
+	if((!plan) && (!(r->scene = strdup(action))))
+		fatal("Out of memory in parseRule()");
+	r->plan = plan;
+	r->guardCount = guardCount;
+	memcpy(r->guard, guards, sizeof(RuleGuard_t) * guardCount);
+
+	for(house = 0; house < 16; house++){
+		if(!(trigger.houses & (1 << house)))
+			continue;
+		if(!trigger.units[house])
+			addLink(r, house, RULES_ANY_UNIT, fn);
+		for(unit = 0; unit < 16; unit++){
+			if(trigger.units[house] & (1 << unit))
+				addLink(r, house, unit, fn);
+		}
+	}
+	return r;
+}
+
+/*
+ * Fire one rule for an event, if its guards allow. Returns TRUE if it fired
+ */
+
+static Bool fireRule(RulePtr_t r, int secs)
+{
+	unsigned i;
+	X10PlanPtr_t plan = r->plan;
+	SceneEntryPtr_t se;
+	TxJobPtr_t job;
+
+	if(r->stamp == eventStamp)
+		return FALSE;
+	r->stamp = eventStamp;
+	for(i = 0; i < r->guardCount; i++){
+		if(!checkGuard(&r->guard[i], secs)){
+			r->blocked++;
+			return FALSE;
+		}
+	}
+	if((!plan) && (se = sceneFind(r->scene)))
+		plan = se->plan;
+	if(!plan)
+		return FALSE;
+	r->hits++;
+	debug(DEBUG_ACTION, "Rule %s fired", r->name);
+	job = txqSubmit(NULL, plan, actionSent);
+	txqSetTTL(job, RULES_ACTION_TTL);
+	journalAdd(job, JOURNAL_INTERNAL);
+	txqAddNV(job, "rule", r->name);
+	return TRUE;
+}
+
+
+/*
+ * Load and compile the [rules] section of the config file
+ *
+ * Any previously loaded rules are discarded. The device registry and
+ * scenes must already be loaded. Returns the number of rules loaded.
+ */
+
+unsigned rulesLoad(ConfigEntryPtr_t ce, int defaultHouse)
+{
+	KeyEntryPtr_t ke;
+	RulePtr_t r;
+	unsigned count = 0;
+	uint32_t bucket;
+
+	rulesFree();
+
+	for(ke = confreadGetFirstKeyBySection(ce, "rules"); ke; ke = confreadGetNextKey(ke)){
+		if(rulesFind(confreadGetKey(ke))){
+			error("Duplicate rule name %s on line %u", confreadGetKey(ke), confreadKeyLineNum(ke));
+			continue;
+		}
+		if(!(r = parseRule(confreadGetKey(ke), confreadGetValue(ke), defaultHouse)))
+			continue;
+		r->hash = confreadHash(r->name);
+		bucket = r->hash & (RULES_BUCKETS - 1);
+		r->nextHash = ruleHash[bucket];
+		ruleHash[bucket] = r;
+		/* Keep config file order for reports */
+		if(ruleTail)
+			ruleTail->next = r;
+		else
+			ruleList = r;
+		ruleTail = r;
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Free all rules
+ */
+
+void rulesFree(void)
+{
+	RulePtr_t r, next;
+
+	freeLinks();
+	for(r = ruleList; r; r = next){
+		next = r->next;
+		free(r->plan);
+		free(r->scene);
+		free(r->name);
+		free(r);
+	}
+	ruleList = ruleTail = NULL;
+	memset(ruleHash, 0, sizeof(ruleHash));
+}
+
+/*
+ * Fire the rules matching an X10 event. Returns the number fired
+ */
+
+unsigned rulesEvent(int house, unsigned unitmask, unsigned function)
+{
+	int unit, secs = -1;
+	unsigned hits = 0;
+	time_t now;
+	struct tm tm;
+	RuleLinkPtr_t rl;
+
+	if((house < 0) || (house > 15) || (function > 15))
+		return 0;
+	eventStamp++;
+	for(unit = 0; unit <= RULES_ANY_UNIT; unit++){
+		if((unit < RULES_ANY_UNIT) && (!(unitmask & (1 << unit))))
+			continue;
+		for(rl = ruleTable[house][unit][function]; rl; rl = rl->next){
+			if(secs < 0){ /* Only look at the clock when a rule matches */
+				now = time(NULL);
+				localtime_r(&now, &tm);
+				secs = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+			}
+			if(fireRule(rl->rule, secs))
+				hits++;
+		}
+	}
+	return hits;
+}
+
+/*
+ * Find a rule by name. Returns NULL if there is no such rule.
+ */
+
+RulePtr_t rulesFind(const String name)
+{
+	uint32_t hash;
+	RulePtr_t r;
+
+	if(!name)
+		return NULL;
+	hash = confreadHash(name);
+	for(r = ruleHash[hash & (RULES_BUCKETS - 1)]; r; r = r->nextHash){
+		if((r->hash == hash) && (!strcmp(r->name, name)))
+			return r;
+	}
+	return NULL;
+}
+
+/*
+ * Iterate over the rules in config file order
+ */
+
+RulePtr_t rulesFirst(void)
+{
+	return ruleList;
+}
+
+RulePtr_t rulesNext(RulePtr_t r)
+{
+	return r ? r->next : NULL;
+}
@@ -0,0 +1,91 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Event to action rules
+*
+*/
+
+#ifndef RULES_H
+#define RULES_H
+
+#include "types.h"
+#include "confread.h"
+#include "plan.h"
+
+/* Lookup table slot for rules triggered by any unit in a house */
+#define RULES_ANY_UNIT		16
+
+/* Most guards on one rule */
+#define RULES_MAX_GUARDS	4
+
+/* Seconds a rule's action may wait in the queue, or in the journal over a restart.
+   A reflex to a trigger that late would be taken for a fresh command */
+#define RULES_ACTION_TTL	30
+
+/* Guard types */
+enum {RG_TIME = 0, RG_STATE};
+
+/* Typedefs */
+
+typedef struct ruleguard RuleGuard_t;
+typedef RuleGuard_t * RuleGuardPtr_t;
+typedef struct rule Rule_t;
+typedef Rule_t * RulePtr_t;
+
+/* A condition which must hold for a rule to fire */
+
+struct ruleguard{
+	int type;
+	int from;			/* RG_TIME: seconds after midnight, may wrap */
+	int to;
+	int state;			/* RG_STATE: 0 off, 1 on, -1 unknown */
+	X10Addrs_t addrs;		/* RG_STATE: devices which must all be in that state */
+};
+
+/* One rule */
+
+struct rule{
+	uint32_t hash;
+	String name;
+	String scene;			/* Scene to activate, or NULL */
+	X10PlanPtr_t plan;		/* Compiled action list, or NULL */
+	unsigned guardCount;
+	RuleGuard_t guard[RULES_MAX_GUARDS];
+	unsigned hits;			/* Times fired */
+	unsigned blocked;		/* Times a guard stopped it */
+	unsigned completed;		/* Actions sent */
+	unsigned lastMs;		/* Event to action sent, in milliseconds */
+	unsigned maxMs;
+	uint64_t totalMs;
+	unsigned stamp;			/* Last event seen, so one event fires a rule once */
+	RulePtr_t nextHash;		/* Name hash chain */
+	RulePtr_t next;
+};
+
+/*
+* Function prototypes
+*/
+
+unsigned rulesLoad(ConfigEntryPtr_t ce, int defaultHouse);
+void rulesFree(void);
+unsigned rulesEvent(int house, unsigned unitmask, unsigned function);
+RulePtr_t rulesFind(const String name);
+RulePtr_t rulesFirst(void);
+RulePtr_t rulesNext(RulePtr_t r);
+
+#endif
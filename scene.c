@@ -0,0 +1,203 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Precompiled scenes
+*
+*    Loads the [scenes] section of the config file. Each scene is a list of
+*    actions separated by slashes. An action is a device list and an
+*    x10.basic command separated by colons, followed by the level for dim
+*    and bright, or data1 and data2 for extended:
+*
+*    evening = A1-3:on/A4,kitchen:dim:40/B7:off
+*
+*    Scenes are compiled into ready to send plans when they are loaded, so
+*    activating one does no parsing or encoding.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "x10.h"
+#include "scene.h"
+
+#define SCENE_BUCKETS	64
+
+static SceneEntryPtr_t sceneTable[SCENE_BUCKETS];
+
+
+/*
+ * Compile a scene into a plan. Returns NULL if the scene is not valid.
+ *
+ * The plan is allocated to fit, and belongs to the caller.
+ */
+
+X10PlanPtr_t sceneCompile(const String name, const String value, int defaultHouse)
+{
+	char ws[1024];
+	String action, next, devices, command, arg1, arg2;
+	int level, data1, data2, house;
+	unsigned function;
+	size_t size;
+	X10Addrs_t addrs;
+	X10PlanPtr_t plan;
+	static X10Builder_t builder;
+	static X10Plan_t work;
+
+	confreadStringCopy(ws, value, sizeof(ws));
+	planBuilderInit(&builder);
+
+	for(action = ws; action; action = next){
+		if((next = strchr(action, '/')))
+			*next++ = 0;
+		devices = action;
+		arg1 = arg2 = NULL;
+		if((command = strchr(devices, ':'))){
+			*command++ = 0;
+			if((arg1 = strchr(command, ':'))){
+				*arg1++ = 0;
+				if((arg2 = strchr(arg1, ':')))
+					*arg2++ = 0;
+			}
+		}
+		if((!command) || (!planCommandFunction(command, &function))){
+			error("Scene %s: bad command in %s", name, devices);
+			return NULL;
+		}
+		if(!planParseDevices(devices, defaultHouse, &addrs)){
+			error("Scene %s: bad device list %s", name, devices);
+			return NULL;
+		}
+		level = data1 = data2 = 0;
+		if((function == COMMAND_DIM) || (function == COMMAND_BRIGHT)){
+			level = arg1 ? atoi(arg1) : -1;
+			if((level < 0) || (level > 100)){
+				error("Scene %s: bad level for %s", name, devices);
+				return NULL;
+			}
+		}
+		else if(function == COMMAND_EXTENDED_CODE){
+			data1 = arg1 ? atoi(arg1) : -1;
+			data2 = arg2 ? atoi(arg2) : -1;
+			if((data1 < 0) || (data1 > 255) || (data2 < 0) || (data2 > 255)){
+				error("Scene %s: bad extended data for %s", name, devices);
+				return NULL;
+			}
+		}
+		if(!planBuilderAdd(&builder, &addrs, function, level, data1, data2)){
+			error("Scene %s: too many actions", name);
+			return NULL;
+		}
+	}
+
+	/* Start with the first house the scene acts on */
+	for(house = 0; (builder.count) && (house < 16) && (!(builder.group[0].addrs.houses & (1 << house))); house++);
+
+	planInit(&work);
+	if(!planBuilderCompile(&builder, &work, house & 0x0F)){
+		error("Scene %s: too many frames", name);
+		return NULL;
+	}
+
+	/* Only keep the frames used */
+	size = sizeof(X10Plan_t) - (PLAN_MAX_FRAMES - work.count) * sizeof(X10Frame_t);
+	if(!(plan = malloc(size)))
+		fatal("Out of memory in sceneCompile()");
+	memcpy(plan, &work, size);
+	return plan;
+}
+
+
+/*
+ * Load and compile the [scenes] section of the config file
+ *
+ * Any previously loaded scenes are discarded. The device registry must
+ * already be loaded. Returns the number of scenes loaded.
+ */
+
+unsigned sceneLoad(ConfigEntryPtr_t ce, int defaultHouse)
+{
+	KeyEntryPtr_t ke;
+	SceneEntryPtr_t se;
+	X10PlanPtr_t plan;
+	unsigned count = 0;
+	uint32_t bucket;
+
+	sceneFree();
+
+	for(ke = confreadGetFirstKeyBySection(ce, "scenes"); ke; ke = confreadGetNextKey(ke)){
+		if(sceneFind(confreadGetKey(ke))){
+			error("Duplicate scene name %s on line %u", confreadGetKey(ke), confreadKeyLineNum(ke));
+			continue;
+		}
+		if(!(plan = sceneCompile(confreadGetKey(ke), confreadGetValue(ke), defaultHouse)))
+			continue;
+		if(!(se = calloc(1, sizeof(SceneEntry_t))) || !(se->name = strdup(confreadGetKey(ke))))
+			fatal("Out of memory in sceneLoad()");
+		se->plan = plan;
+		se->ms = planTime(plan);
+		se->hash = confreadHash(se->name);
+		bucket = se->hash & (SCENE_BUCKETS - 1);
+		se->next = sceneTable[bucket];
+		sceneTable[bucket] = se;
+		debug(DEBUG_STATUS, "Scene %s: %u frames, estimated %u.%03u seconds", se->name, plan->count,
+		se->ms / 1000, se->ms % 1000);
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Free all scenes
+ */
+
+void sceneFree(void)
+{
+	int i;
+	SceneEntryPtr_t se, next;
+
+	for(i = 0; i < SCENE_BUCKETS; i++){
+		for(se = sceneTable[i]; se; se = next){
+			next = se->next;
+			free(se->plan);
+			free(se->name);
+			free(se);
+		}
+		sceneTable[i] = NULL;
+	}
+}
+
+/*
+ * Find a scene by name. Returns NULL if there is no such scene.
+ */
+
+SceneEntryPtr_t sceneFind(const String name)
+{
+	uint32_t hash;
+	SceneEntryPtr_t se;
+
+	if(!name)
+		return NULL;
+	hash = confreadHash(name);
+	for(se = sceneTable[hash & (SCENE_BUCKETS - 1)]; se; se = se->next){
+		if((se->hash == hash) && (!strcmp(se->name, name)))
+			return se;
+	}
+	return NULL;
+}
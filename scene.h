@@ -0,0 +1,54 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Precompiled scenes
+*
+*/
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "types.h"
+#include "confread.h"
+#include "plan.h"
+
+/* Typedefs */
+
+typedef struct sceneent SceneEntry_t;
+typedef SceneEntry_t * SceneEntryPtr_t;
+
+/* Entry for a scene */
+
+struct sceneent{
+	uint32_t hash;
+	String name;
+	unsigned ms;		/* Estimated powerline time */
+	X10PlanPtr_t plan;
+	SceneEntryPtr_t next;	/* Hash chain */
+};
+
+/*
+* Function prototypes
+*/
+
+X10PlanPtr_t sceneCompile(const String name, const String value, int defaultHouse);
+unsigned sceneLoad(ConfigEntryPtr_t ce, int defaultHouse);
+void sceneFree(void);
+SceneEntryPtr_t sceneFind(const String name);
+
+#endif
@@ -0,0 +1,458 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Scheduled and delayed commands
+*
+*    Actions are one-shot, from an x10.basic command with delay= or at=,
+*    or daily, from the [schedule] section of the config file:
+*
+*    porch-off = 22:30,A3:off
+*    night = 23:00:30,bedtime
+*
+*    The time is HH:MM or HH:MM:SS local time, and the action is either
+*    an action list in [scenes] syntax or the name of a scene. Each
+*    action has a timer in the timer wheel, so adding and cancelling are
+*    O(1).
+*
+*    One-shot actions are saved to the schedule file in config file
+*    format so they survive a restart. The file is rewritten from the
+*    tick handler at most once a second when something has changed:
+*
+*    [pending]
+*    17 = 1381352400,A,hwstar-panel.kitchen,42,off,A3-4:off
+*
+*    The fields are due time, default house, source, id n/v and command,
+*    with - for none, then the action.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "notify.h"
+#include "plan.h"
+#include "scene.h"
+#include "schedule.h"
+
+#define SCHEDULE_BUCKETS	1024
+
+static char filePath[256] = "";
+static void (*runAction)(SchedEntryPtr_t se) = NULL;
+static SchedEntryPtr_t idTable[SCHEDULE_BUCKETS];
+static SchedEntryPtr_t entryList = NULL;	/* One-shot actions */
+static SchedEntryPtr_t dailyList = NULL;	/* Daily actions from the config file */
+static unsigned pendingCount = 0;
+static unsigned nextId = 1;
+static Bool dirty = FALSE;
+
+
+/*
+ * Duplicate a string which may be NULL
+ */
+
+static String dupField(const String s)
+{
+	String d;
+
+	if(!s)
+		return NULL;
+	if(!(d = strdup(s)))
+		fatal("Out of memory in dupField()");
+	return d;
+}
+
+/*
+ * Return TRUE if a field can be saved as is in a comma separated line
+ */
+
+static Bool plainField(const String s)
+{
+	const char *p;
+
+	if((!s) || (!*s) || (!strcmp(s, "-")))
+		return FALSE;
+	for(p = s; *p; p++){
+		if((*p == ',') || (*p == '#') || (*p == ';') || (isspace((unsigned char) *p)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Free an action
+ */
+
+static void freeEntry(SchedEntryPtr_t se)
+{
+	timerCancel(&se->timer);
+	free(se->name);
+	free(se->source);
+	free(se->reqId);
+	free(se->command);
+	free(se->action);
+	free(se);
+}
+
+/*
+ * Take a one-shot action out of the list and the id table
+ */
+
+static void unlinkEntry(SchedEntryPtr_t se)
+{
+	SchedEntryPtr_t *pp;
+
+	for(pp = &idTable[se->id & (SCHEDULE_BUCKETS - 1)]; *pp; pp = &(*pp)->hashNext){
+		if(*pp == se){
+			*pp = se->hashNext;
+			break;
+		}
+	}
+	if(se->prev)
+		se->prev->next = se->next;
+	else
+		entryList = se->next;
+	if(se->next)
+		se->next->prev = se->prev;
+	pendingCount--;
+	dirty = TRUE;
+}
+
+/*
+ * Timer handler for one-shot actions
+ */
+
+static void fireOnce(TimerPtr_t t)
+{
+	SchedEntryPtr_t se = t->user;
+
+	unlinkEntry(se);
+	debug(DEBUG_ACTION, "Running scheduled action %u: %s", se->id, se->action);
+	if(runAction)
+		(*runAction)(se);
+	freeEntry(se);
+}
+
+/*
+ * Timer handler for daily actions
+ */
+
+static void fireDaily(TimerPtr_t t)
+{
+	SchedEntryPtr_t se = t->user;
+
+	debug(DEBUG_ACTION, "Running daily action %s: %s", se->name, se->action);
+	if(runAction)
+		(*runAction)(se);
+	se->due = scheduleNextTime(se->daily);
+	timerStartAt(&se->timer, se->due, fireDaily, se);
+}
+
+/*
+ * Add a one-shot action with a known id
+ */
+
+static SchedEntryPtr_t addEntry(unsigned id, time_t due, int house, const String source, const String reqId,
+const String command, const String action)
+{
+	SchedEntryPtr_t se;
+	unsigned bucket = id & (SCHEDULE_BUCKETS - 1);
+
+	if(!(se = calloc(1, sizeof(SchedEntry_t))))
+		fatal("Out of memory in addEntry()");
+	se->id = id;
+	se->due = due;
+	se->daily = -1;
+	se->house = house & 0x0F;
+	se->source = dupField(source);
+	se->reqId = dupField(reqId);
+	se->command = dupField(command);
+	se->action = dupField(action);
+	se->hashNext = idTable[bucket];
+	idTable[bucket] = se;
+	if((se->next = entryList))
+		se->next->prev = se;
+	entryList = se;
+	pendingCount++;
+	if(id >= nextId)
+		nextId = id + 1;
+	timerStartAt(&se->timer, due, fireOnce, se);
+	dirty = TRUE;
+	return se;
+}
+
+/*
+ * Write the pending one-shot actions to the schedule file
+ */
+
+static Bool writePending(FILE *file, void *arg)
+{
+	SchedEntryPtr_t se;
+
+	fprintf(file, "[pending]\n");
+	for(se = entryList; se; se = se->next)
+		fprintf(file, "%u = %ld,%c,%s,%s,%s,%s\n", se->id, (long) se->due, 'A' + se->house,
+		plainField(se->source) ? se->source : "-", plainField(se->reqId) ? se->reqId : "-",
+		plainField(se->command) ? se->command : "-", se->action);
+	return ferror(file) ? FALSE : TRUE;
+}
+
+/*
+ * Save the pending one-shot actions
+ */
+
+static void save(void)
+{
+	dirty = FALSE;
+	if((filePath[0]) && (!confreadReplaceFile(filePath, writePending, NULL)))
+		debug(DEBUG_UNEXPECTED, "Could not save schedule file %s", filePath);
+}
+
+/*
+ * Load the one-shot actions saved before a restart
+ */
+
+static void load(void)
+{
+	ConfigEntryPtr_t ce;
+	KeyEntryPtr_t ke;
+	char ws[1024];
+	String field[6];
+	String p;
+	int i;
+	unsigned id, count = 0;
+	long due;
+	time_t now = time(NULL);
+
+	if((!filePath[0]) || (access(filePath, R_OK)) || (!(ce = confreadScan(filePath, confreadDefErrorHandler))))
+		return;
+	for(ke = confreadGetFirstKeyBySection(ce, "pending"); ke; ke = confreadGetNextKey(ke)){
+		confreadStringCopy(ws, confreadGetValue(ke), sizeof(ws));
+		/* The action is the rest of the line, it can have commas in it */
+		for(i = 0, p = ws; (i < 5) && (p); i++){
+			field[i] = p;
+			if((p = strchr(p, ',')))
+				*p++ = 0;
+		}
+		field[5] = p;
+		id = (unsigned) atoi(confreadGetKey(ke));
+		due = atol(field[0]);
+		if((!p) || (!id) || (!due) || (!*field[5]) || (toupper(field[1][0]) < 'A') || (toupper(field[1][0]) > 'P')){
+			debug(DEBUG_UNEXPECTED, "Bad saved action on line %u of %s", confreadKeyLineNum(ke), filePath);
+			continue;
+		}
+		if(now - due > SCHEDULE_LATE_SECS){
+			debug(DEBUG_UNEXPECTED, "Dropping saved action %u, %ld seconds overdue", id, (long) (now - due));
+			continue;
+		}
+		for(i = 2; i < 5; i++){
+			if(!strcmp(field[i], "-"))
+				field[i] = NULL;
+		}
+		addEntry(id, (time_t) due, toupper(field[1][0]) - 'A', field[2], field[3], field[4], field[5]);
+		count++;
+	}
+	confreadFree(ce);
+	debug(DEBUG_STATUS, "%u scheduled actions restored from %s", count, filePath);
+	dirty = TRUE;
+}
+
+
+/*
+ * Set the schedule file, and restore the actions saved in it
+ *
+ * run is called to carry out each action when it is due.
+ */
+
+void scheduleInit(const String path, void (*run)(SchedEntryPtr_t se))
+{
+	runAction = run;
+	confreadStringCopy(filePath, path, sizeof(filePath));
+	load();
+}
+
+/*
+ * Load the daily actions in the [schedule] section of the config file
+ *
+ * Any previously loaded daily actions are discarded. Actions are
+ * checked by compiling them, so the devices and scenes must already be
+ * loaded. Returns the number of actions loaded.
+ */
+
+unsigned scheduleLoad(ConfigEntryPtr_t ce, int defaultHouse)
+{
+	KeyEntryPtr_t ke;
+	SchedEntryPtr_t se, next;
+	char ws[1024];
+	String action;
+	int secs;
+	unsigned count = 0;
+	X10PlanPtr_t plan;
+
+	for(se = dailyList; se; se = next){
+		next = se->next;
+		freeEntry(se);
+	}
+	dailyList = NULL;
+
+	for(ke = confreadGetFirstKeyBySection(ce, "schedule"); ke; ke = confreadGetNextKey(ke)){
+		confreadStringCopy(ws, confreadGetValue(ke), sizeof(ws));
+		if((action = strchr(ws, ',')))
+			*action++ = 0;
+		if((!action) || (!*action) || ((secs = scheduleParseTime(ws)) < 0)){
+			error("Schedule %s: expected HH:MM,action", confreadGetKey(ke));
+			continue;
+		}
+		if(strchr(action, ':')){
+			if(!(plan = sceneCompile(confreadGetKey(ke), action, defaultHouse)))
+				continue;
+			free(plan);
+		}
+		else if(!sceneFind(action)){
+			error("Schedule %s: unknown scene %s", confreadGetKey(ke), action);
+			continue;
+		}
+		if(!(se = calloc(1, sizeof(SchedEntry_t))))
+			fatal("Out of memory in scheduleLoad()");
+		se->name = dupField(confreadGetKey(ke));
+		se->command = dupField("schedule");
+		se->action = dupField(action);
+		se->house = defaultHouse & 0x0F;
+		se->daily = secs;
+		se->due = scheduleNextTime(secs);
+		timerStartAt(&se->timer, se->due, fireDaily, se);
+		se->next = dailyList;
+		dailyList = se;
+		debug(DEBUG_STATUS, "Daily action %s at %02d:%02d:%02d", se->name, secs / 3600, (secs / 60) % 60, secs % 60);
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Parse a time of day, HH:MM or HH:MM:SS
+ *
+ * Returns seconds after midnight, or -1 if the time is not valid.
+ */
+
+int scheduleParseTime(const String value)
+{
+	int h, m, s = 0;
+	char c;
+
+	if((!value) || ((sscanf(value, "%d:%d%c", &h, &m, &c) != 2) && (sscanf(value, "%d:%d:%d%c", &h, &m, &s, &c) != 3)))
+		return -1;
+	if((h < 0) || (h > 23) || (m < 0) || (m > 59) || (s < 0) || (s > 59))
+		return -1;
+	return h * 3600 + m * 60 + s;
+}
+
+/*
+ * Return the next time it will be a number of seconds after local midnight
+ *
+ * Worked out with mktime() so daylight saving changes are followed.
+ */
+
+time_t scheduleNextTime(int secs)
+{
+	time_t now = time(NULL);
+	time_t when;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	tm.tm_hour = secs / 3600;
+	tm.tm_min = (secs / 60) % 60;
+	tm.tm_sec = secs % 60;
+	tm.tm_isdst = -1;
+	if((when = mktime(&tm)) <= now){
+		tm.tm_mday++;
+		tm.tm_hour = secs / 3600;
+		tm.tm_min = (secs / 60) % 60;
+		tm.tm_sec = secs % 60;
+		tm.tm_isdst = -1;
+		when = mktime(&tm);
+	}
+	return when;
+}
+
+/*
+ * Add a one-shot action
+ *
+ * source and reqId may be NULL. Returns NULL if too many actions are pending.
+ */
+
+SchedEntryPtr_t scheduleAdd(time_t due, int house, const String source, const String reqId,
+const String command, const String action)
+{
+	if(pendingCount >= SCHEDULE_MAX_PENDING){
+		debug(DEBUG_UNEXPECTED, "Too many scheduled actions");
+		return NULL;
+	}
+	return addEntry(nextId, due, house, source, reqId, command, action);
+}
+
+/*
+ * Cancel a one-shot action by id. Returns FALSE if there is no such action.
+ */
+
+Bool scheduleCancel(unsigned id)
+{
+	SchedEntryPtr_t se;
+
+	for(se = idTable[id & (SCHEDULE_BUCKETS - 1)]; se; se = se->hashNext){
+		if(se->id == id){
+			unlinkEntry(se);
+			freeEntry(se);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Save the pending actions if they have changed. Called once a second
+ */
+
+void scheduleTick(void)
+{
+	if(dirty)
+		save();
+}
+
+/*
+ * Return the number of one-shot and daily actions, and when the next one is due
+ */
+
+void scheduleStats(unsigned *pending, unsigned *daily, time_t *next)
+{
+	SchedEntryPtr_t se;
+
+	*pending = pendingCount;
+	*daily = 0;
+	*next = 0;
+	for(se = entryList; se; se = se->next){
+		if((!*next) || (se->due < *next))
+			*next = se->due;
+	}
+	for(se = dailyList; se; se = se->next){
+		(*daily)++;
+		if((!*next) || (se->due < *next))
+			*next = se->due;
+	}
+}
@@ -0,0 +1,74 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Scheduled and delayed commands
+*
+*/
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <time.h>
+#include "types.h"
+#include "confread.h"
+#include "timer.h"
+
+/* Most one-shot actions pending at once */
+#define SCHEDULE_MAX_PENDING	10000
+
+/* Saved actions this many seconds overdue at startup are dropped */
+#define SCHEDULE_LATE_SECS	3600
+
+/* Typedefs */
+
+typedef struct schedent SchedEntry_t;
+typedef SchedEntry_t * SchedEntryPtr_t;
+
+/* A pending action */
+
+struct schedent{
+	unsigned id;			/* 0 for daily actions from the config file */
+	time_t due;
+	int daily;			/* Seconds after midnight for daily actions, else -1 */
+	uint8_t house;			/* Default house for the action */
+	String name;			/* Config key for daily actions */
+	String source;			/* xPL source which asked for it, NULL for local */
+	String reqId;			/* id n/v of the command, may be NULL */
+	String command;			/* command n/v of the command */
+	String action;			/* Scene name, or actions in [scenes] syntax */
+	Timer_t timer;
+	SchedEntryPtr_t hashNext;	/* Id hash chain */
+	SchedEntryPtr_t prev;
+	SchedEntryPtr_t next;
+};
+
+/*
+* Function prototypes
+*/
+
+void scheduleInit(const String path, void (*run)(SchedEntryPtr_t se));
+unsigned scheduleLoad(ConfigEntryPtr_t ce, int defaultHouse);
+int scheduleParseTime(const String value);
+time_t scheduleNextTime(int secs);
+SchedEntryPtr_t scheduleAdd(time_t due, int house, const String source, const String reqId,
+const String command, const String action);
+Bool scheduleCancel(unsigned id);
+void scheduleTick(void);
+void scheduleStats(unsigned *pending, unsigned *daily, time_t *next);
+
+#endif
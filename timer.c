@@ -0,0 +1,237 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Hierarchical timer wheel
+*
+*    Timers live in TIMER_LEVELS wheels of TIMER_SLOTS slots. Level 0
+*    has a slot per second, and each level above has slots 256 times as
+*    long. A timer goes in the lowest level that reaches its expiry time,
+*    in the slot picked by that level's bits of the time. Each slot is a
+*    doubly linked list, so starting, restarting and cancelling a timer
+*    are O(1) however many are pending.
+*
+*    When level 0 wraps, the next slot of level 1 is emptied and its
+*    timers are put back into level 0, and so on up the levels. Every
+*    timer moves down at most TIMER_LEVELS - 1 times in its life.
+*
+*    timerTick() is called from the xPL tick handler and catches up on
+*    any seconds it missed.
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "notify.h"
+#include "timer.h"
+
+#define SLOT_MASK	(TIMER_SLOTS - 1)
+
+static TimerPtr_t wheel[TIMER_LEVELS][TIMER_SLOTS];
+static time_t wheelTime = 0;	/* Second the wheel has been advanced to */
+static unsigned pending = 0;
+
+
+/*
+ * Put a timer in the slot for its expiry time
+ */
+
+static void linkTimer(TimerPtr_t t, Bool cascading)
+{
+	int level;
+	uint64_t delta = (t->expires > wheelTime) ? (uint64_t) (t->expires - wheelTime) : 0;
+
+	for(level = 0; (level < TIMER_LEVELS - 1) && (delta >= ((uint64_t) 1 << (TIMER_SLOT_BITS * (level + 1)))); level++);
+	/* Anything beyond the top level waits in its last slot and is put back when that comes round */
+	if(delta >= ((uint64_t) 1 << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+		t->slot = &wheel[level][((wheelTime >> (TIMER_SLOT_BITS * level)) - 1) & SLOT_MASK];
+	else if(!delta) /* Due now. Unless moving down from a higher level, that means the next tick */
+		t->slot = &wheel[0][(wheelTime + (cascading ? 0 : 1)) & SLOT_MASK];
+	else
+		t->slot = &wheel[level][(t->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK];
+	t->prev = NULL;
+	if((t->next = *t->slot))
+		t->next->prev = t;
+	*t->slot = t;
+	t->armed = TRUE;
+	pending++;
+}
+
+/*
+ * Unlink a timer from its slot
+ */
+
+static void unlinkTimer(TimerPtr_t t)
+{
+	if(t->prev)
+		t->prev->next = t->next;
+	else
+		*t->slot = t->next;
+	if(t->next)
+		t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	t->slot = NULL;
+	t->armed = FALSE;
+	pending--;
+}
+
+/*
+ * Move the timers in one slot of a level down to the levels below
+ */
+
+static void cascade(int level, unsigned index)
+{
+	TimerPtr_t t, next;
+
+	t = wheel[level][index];
+	wheel[level][index] = NULL;
+	for(; t; t = next){
+		next = t->next;
+		pending--;
+		linkTimer(t, TRUE);
+	}
+}
+
+/*
+ * Move the wheel to a new time without running the seconds in between
+ *
+ * Every timer is put back for the new time, so none are lost in slots
+ * which were skipped. Only used when the clock jumps.
+ */
+
+static void rebase(time_t now)
+{
+	int level;
+	unsigned index;
+	TimerPtr_t t, next, list = NULL;
+
+	for(level = 0; level < TIMER_LEVELS; level++){
+		for(index = 0; index < TIMER_SLOTS; index++){
+			for(t = wheel[level][index]; t; t = next){
+				next = t->next;
+				t->next = list;
+				list = t;
+			}
+			wheel[level][index] = NULL;
+		}
+	}
+	wheelTime = now;
+	pending = 0;
+	for(t = list; t; t = next){
+		next = t->next;
+		linkTimer(t, FALSE);
+	}
+}
+
+/*
+ * Advance the wheel by one second and fire the timers which are due
+ */
+
+static void advance(void)
+{
+	int level;
+	unsigned index;
+	TimerPtr_t t;
+
+	wheelTime++;
+	for(level = 1; level < TIMER_LEVELS; level++){
+		if((wheelTime >> (TIMER_SLOT_BITS * (level - 1))) & SLOT_MASK)
+			break;
+		index = (wheelTime >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+		cascade(level, index);
+	}
+	/* The handler may restart this timer, or start and cancel others */
+	while((t = wheel[0][wheelTime & SLOT_MASK])){
+		unlinkTimer(t);
+		if(t->expires > wheelTime){ /* Put back, not due yet */
+			linkTimer(t, FALSE);
+			continue;
+		}
+		(*t->fire)(t);
+	}
+}
+
+
+/*
+ * Start a timer, or restart it if it is already running
+ *
+ * fire is called with the timer after the number of seconds given.
+ */
+
+void timerStart(TimerPtr_t t, unsigned seconds, void (*fire)(TimerPtr_t t), void *user)
+{
+	if(!wheelTime)
+		wheelTime = time(NULL);
+	timerStartAt(t, wheelTime + (seconds ? seconds : 1), fire, user);
+}
+
+/*
+ * Start a timer which fires at an absolute time
+ *
+ * A time which has already passed fires on the next tick.
+ */
+
+void timerStartAt(TimerPtr_t t, time_t when, void (*fire)(TimerPtr_t t), void *user)
+{
+	if(!wheelTime)
+		wheelTime = time(NULL);
+	if(t->armed)
+		unlinkTimer(t);
+	t->expires = when;
+	t->fire = fire;
+	t->user = user;
+	linkTimer(t, FALSE);
+}
+
+/*
+ * Stop a timer. Does nothing if it isn't running
+ */
+
+void timerCancel(TimerPtr_t t)
+{
+	if((t) && (t->armed))
+		unlinkTimer(t);
+}
+
+/*
+ * Return the number of running timers
+ */
+
+unsigned timerPending(void)
+{
+	return pending;
+}
+
+/*
+ * Advance the wheel to the current time. Called once a second
+ */
+
+void timerTick(void)
+{
+	time_t now = time(NULL);
+
+	if(!wheelTime){
+		wheelTime = now;
+		return;
+	}
+	if(now - wheelTime > TIMER_MAX_CATCHUP){
+		debug(DEBUG_UNEXPECTED, "Clock jumped %ld seconds, overdue timers run now", (long) (now - wheelTime));
+		rebase(now - 1);
+	}
+	while(wheelTime < now)
+		advance();
+}
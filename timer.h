@@ -0,0 +1,66 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Timer wheel
+*
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <time.h>
+#include "types.h"
+
+/* Slots in each level of the wheel, and the number of levels.
+   Level 0 has one slot per second, each level above covers 256 times
+   the span of the one below, so four levels reach over 136 years */
+#define TIMER_SLOT_BITS		8
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS		4
+
+/* Most seconds of missed ticks caught up one by one. Beyond this the wheel is rebuilt */
+#define TIMER_MAX_CATCHUP	3600
+
+/* Typedefs */
+
+typedef struct timer Timer_t;
+typedef Timer_t * TimerPtr_t;
+
+/* A timer. Owned by the caller, usually embedded in another structure */
+
+struct timer{
+	time_t expires;
+	void (*fire)(TimerPtr_t t);
+	void *user;
+	Bool armed;
+	TimerPtr_t *slot;		/* Head of the slot list the timer is in */
+	TimerPtr_t next;
+	TimerPtr_t prev;
+};
+
+/*
+* Function prototypes
+*/
+
+void timerStart(TimerPtr_t t, unsigned seconds, void (*fire)(TimerPtr_t t), void *user);
+void timerStartAt(TimerPtr_t t, time_t when, void (*fire)(TimerPtr_t t), void *user);
+unsigned timerPending(void);
+void timerCancel(TimerPtr_t t);
+void timerTick(void);
+
+#endif
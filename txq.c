@@ -0,0 +1,670 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    X10 transmit queue
+*
+*    Commands are queued as jobs holding a copy of their planned frames.
+*    The main loop sends one frame per call to txqService() so xPL
+*    messages keep being processed while a long plan goes out. When the
+*    last frame of a job is acknowledged by the CM11A, or a frame finally
+*    fails, the job's done callback is called and the job is freed.
+*
+*    The estimated powerline time of everything still to be sent is kept
+*    as a running total so admission control can check it cheaply.
+*
+*    Each xPL source has its own queue. Jobs are picked from the sources
+*    by deficit round robin, using the estimated powerline time of a job
+*    as its cost, so a chatty sender can't starve the others. A job is
+*    always sent whole so its address and function frames stay together.
+*    Weights come from the [sources] section of the config file:
+*
+*    vendor = weight
+*    vendor-device = weight
+*    vendor-device.instance = weight
+*
+*    The most specific entry wins.
+*
+*    A job can have a deadline. If it hasn't started by then it is
+*    dropped unsent and completed with an expired result.
+*
+*    Cancelled jobs are dropped from the queues straight away. The job
+*    being sent is stopped once the last frame sent was a function, as
+*    modules stay selected after an address until a function arrives.
+*    Stopping between two addresses would let them pile up with the
+*    addresses of the next job.
+*
+*    Jobs their owners mark with journalAdd() are kept in the journal
+*    until they complete, so they can be sent after a restart.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "x10.h"
+#include "txq.h"
+#include "journal.h"
+
+#define SOURCE_BUCKETS	64
+
+static TxSourcePtr_t sourceTable[SOURCE_BUCKETS];
+static TxSourcePtr_t sourceList = NULL;
+static TxSourcePtr_t sourceListTail = NULL;
+static TxSourcePtr_t overflowSource = NULL;
+static unsigned sourceCount = 0;
+static TxSourcePtr_t ringCur = NULL;	/* Source being served */
+static TxJobPtr_t current = NULL;	/* Job being sent */
+static ConfigEntryPtr_t weightConfig = NULL;
+static uint32_t jobSeq = 0;
+static unsigned backlogMs = 0;
+static unsigned pendingJobs = 0;
+static unsigned expiredCount = 0;
+static unsigned long expiredMs = 0;
+
+static const String resultNames[] = {"pending", "ok", "failed", "expired", "cancelled"};
+
+
+/*
+ * Milliseconds between two times
+ */
+
+static unsigned elapsedMs(struct timeval *from, struct timeval *to)
+{
+	long ms = (to->tv_sec - from->tv_sec) * 1000L + (to->tv_usec - from->tv_usec) / 1000L;
+
+	return (ms < 0) ? 0 : (unsigned) ms;
+}
+
+/*
+ * Find the configured weight for a source name
+ *
+ * Tries vendor-device.instance, then vendor-device, then vendor.
+ */
+
+static unsigned sourceWeight(const String name)
+{
+	char ws[128];
+	String p, value;
+	int weight;
+
+	if(!weightConfig)
+		return TXQ_DEFAULT_WEIGHT;
+	confreadStringCopy(ws, name, sizeof(ws));
+	for(;;){
+		if((value = confreadValueBySectKey(weightConfig, "sources", ws))){
+			weight = atoi(value);
+			if(weight < 1)
+				weight = 1;
+			else if(weight > TXQ_MAX_WEIGHT)
+				weight = TXQ_MAX_WEIGHT;
+			return (unsigned) weight;
+		}
+		if((p = strrchr(ws, '.')) || (p = strrchr(ws, '-')))
+			*p = 0;
+		else
+			break;
+	}
+	return TXQ_DEFAULT_WEIGHT;
+}
+
+/*
+ * Find or create the source for a name
+ */
+
+static TxSourcePtr_t getSource(const String source)
+{
+	uint32_t hash;
+	String name = source;
+	TxSourcePtr_t src;
+
+	if(!name)
+		name = "local";
+	hash = confreadHash(name);
+	for(src = sourceTable[hash & (SOURCE_BUCKETS - 1)]; src; src = src->next){
+		if((src->hash == hash) && (!strcmp(src->name, name)))
+			return src;
+	}
+
+	if(sourceCount >= TXQ_MAX_SOURCES){
+		if(overflowSource)
+			return overflowSource;
+		name = "overflow";
+		hash = confreadHash(name);
+	}
+
+	if(!(src = calloc(1, sizeof(TxSource_t))))
+		fatal("Out of memory in getSource()");
+	if(!(src->name = strdup(name)))
+		fatal("Out of memory in getSource()");
+	src->hash = hash;
+	src->weight = sourceWeight(name);
+	src->next = sourceTable[hash & (SOURCE_BUCKETS - 1)];
+	sourceTable[hash & (SOURCE_BUCKETS - 1)] = src;
+	if(sourceListTail)
+		sourceListTail->next_source = src;
+	else
+		sourceList = src;
+	sourceListTail = src;
+	if(sourceCount++ >= TXQ_MAX_SOURCES)
+		overflowSource = src;
+	debug(DEBUG_ACTION, "New transmit source %s, weight %u", src->name, src->weight);
+	return src;
+}
+
+/*
+ * Add a source to the end of the active ring, just behind the one being served
+ */
+
+static void activateSource(TxSourcePtr_t src)
+{
+	if(!ringCur){
+		src->next_active = src->prev_active = src;
+		src->deficit = src->weight * TXQ_QUANTUM_MS;
+		ringCur = src;
+		return;
+	}
+	src->deficit = 0;
+	src->next_active = ringCur;
+	src->prev_active = ringCur->prev_active;
+	ringCur->prev_active->next_active = src;
+	ringCur->prev_active = src;
+}
+
+/*
+ * Move on to the next active source, and give it its quantum
+ */
+
+static void advanceRing(void)
+{
+	ringCur = ringCur->next_active;
+	ringCur->deficit += ringCur->weight * TXQ_QUANTUM_MS;
+}
+
+/*
+ * Remove a source from the active ring once its queue is empty
+ */
+
+static void deactivateSource(TxSourcePtr_t src)
+{
+	src->deficit = 0;
+	if(src->next_active == src){
+		ringCur = NULL;
+		return;
+	}
+	src->prev_active->next_active = src->next_active;
+	src->next_active->prev_active = src->prev_active;
+	if(ringCur == src){
+		ringCur = src->prev_active;
+		advanceRing();
+	}
+}
+
+/*
+ * Return TRUE if a job is past its deadline
+ */
+
+static Bool jobExpired(TxJobPtr_t job, struct timeval *now)
+{
+	if(!job->deadline.tv_sec)
+		return FALSE;
+	return ((now->tv_sec > job->deadline.tv_sec) ||
+	((now->tv_sec == job->deadline.tv_sec) && (now->tv_usec >= job->deadline.tv_usec))) ? TRUE : FALSE;
+}
+
+/*
+ * Pick the next job to send by deficit round robin
+ */
+
+static TxJobPtr_t nextJob(void)
+{
+	TxSourcePtr_t src;
+	TxJobPtr_t job;
+
+	while((src = ringCur)){
+		job = src->head;
+		if(src->deficit >= (long) job->cost){
+			src->deficit -= job->cost;
+			if(!(src->head = job->next_job))
+				src->tail = NULL;
+			src->depth--;
+			if(!src->head)
+				deactivateSource(src);
+			return job;
+		}
+		advanceRing();
+	}
+	return NULL;
+}
+
+/*
+ * Free a job
+ */
+
+static void freeJob(TxJobPtr_t job)
+{
+	unsigned i;
+
+	for(i = 0; i < job->nvCount; i++){
+		free(job->nv[i].name);
+		free(job->nv[i].value);
+	}
+	free(job->nv);
+	free(job->frames);
+	free(job);
+}
+
+/*
+ * Finish a job, tell its owner, and free it
+ */
+
+static void completeJob(TxJobPtr_t job, int result)
+{
+	pendingJobs--;
+	backlogMs -= job->remainingMs;
+	job->remainingMs = 0;
+	job->result = result;
+	journalDone(job);
+	gettimeofday(&job->finished, NULL);
+	if(!job->started.tv_sec)
+		job->started = job->finished;
+	if(result == TXQ_EXPIRED){
+		expiredCount++;
+		expiredMs += job->cost;
+	}
+	debug(DEBUG_ACTION, "Job %u from %s %s: %u frames, %u retries, queued %u ms, sent in %u ms", job->seq, job->source->name,
+	resultNames[result], job->next, job->retries, txqWaitMs(job), txqTxMs(job));
+	if(job->done)
+		(*job->done)(job);
+	freeJob(job);
+}
+
+
+/*
+ * Finish the job being sent
+ */
+
+static void completeCurrent(int result)
+{
+	TxJobPtr_t job = current;
+
+	current = NULL;
+	completeJob(job, result);
+}
+
+
+/*
+ * Load the source weights from the [sources] section of the config file
+ *
+ * Must be called again whenever the config is reloaded.
+ */
+
+void txqLoadWeights(ConfigEntryPtr_t ce)
+{
+	TxSourcePtr_t src;
+
+	weightConfig = ce;
+	for(src = sourceList; src; src = src->next_source)
+		src->weight = sourceWeight(src->name);
+}
+
+/*
+ * Queue a copy of a plan for transmission on behalf of a source
+ *
+ * The source is a name of the form vendor-device.instance, or NULL for
+ * commands the daemon makes itself. done is called once the job completes or fails, and may be NULL.
+ * Returns the job so the caller can attach name/values for its confirm.
+ */
+
+TxJobPtr_t txqSubmit(const String source, X10PlanPtr_t plan, void (*done)(TxJobPtr_t job))
+{
+	TxJobPtr_t job;
+	TxSourcePtr_t src = getSource(source);
+
+	if(!(job = calloc(1, sizeof(TxJob_t))))
+		fatal("Out of memory in txqSubmit()");
+	job->count = plan ? plan->count : 0;
+	if(job->count){
+		if(!(job->frames = malloc(job->count * sizeof(X10Frame_t))))
+			fatal("Out of memory in txqSubmit()");
+		memcpy(job->frames, plan->frame, job->count * sizeof(X10Frame_t));
+		job->cost = job->remainingMs = planTime(plan);
+		backlogMs += job->remainingMs;
+	}
+	job->seq = ++jobSeq;
+	job->done = done;
+	job->source = src;
+	gettimeofday(&job->queued, NULL);
+	pendingJobs++;
+
+	if(src->tail)
+		src->tail->next_job = job;
+	else{
+		src->head = job;
+		activateSource(src);
+	}
+	src->tail = job;
+	src->depth++;
+	debug(DEBUG_ACTION, "Job %u queued for %s: %u frames", job->seq, src->name, job->count);
+	return job;
+}
+
+/*
+ * Give a job a time to live in seconds from when it was queued. 0 for none
+ */
+
+void txqSetTTL(TxJobPtr_t job, unsigned seconds)
+{
+	if(!job)
+		return;
+	if(!seconds){
+		timerclear(&job->deadline);
+		return;
+	}
+	job->deadline = job->queued;
+	job->deadline.tv_sec += seconds;
+}
+
+/*
+ * Remove every queued job a match function returns TRUE for, and complete them with a result
+ *
+ * Returns the number of jobs removed. The job being sent is not looked at.
+ */
+
+static unsigned removeJobs(Bool (*match)(TxJobPtr_t job, void *arg), void *arg, int result)
+{
+	unsigned count = 0;
+	TxSourcePtr_t src;
+	TxJobPtr_t job, prev, next;
+
+	for(src = sourceList; src; src = src->next_source){
+		for(prev = NULL, job = src->head; job; job = next){
+			next = job->next_job;
+			if(!(*match)(job, arg)){
+				prev = job;
+				continue;
+			}
+			if(prev)
+				prev->next_job = next;
+			else
+				src->head = next;
+			if(src->tail == job)
+				src->tail = prev;
+			src->depth--;
+			if(!src->head)
+				deactivateSource(src);
+			debug(DEBUG_EXPECTED, "Job %u from %s %s before it was sent", job->seq, src->name, resultNames[result]);
+			completeJob(job, result);
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * Match function for jobs past their deadline
+ */
+
+static Bool matchExpired(TxJobPtr_t job, void *arg)
+{
+	return jobExpired(job, (struct timeval *) arg);
+}
+
+/*
+ * Drop every queued job which is past its deadline
+ */
+
+void txqExpire(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	removeJobs(matchExpired, &now, TXQ_EXPIRED);
+}
+
+/*
+ * Cancel every job a match function returns TRUE for
+ *
+ * Queued jobs are removed and completed with a cancelled result now. The
+ * job being sent is marked, and is stopped at the next safe boundary.
+ * Returns the number of jobs cancelled.
+ */
+
+unsigned txqCancel(Bool (*match)(TxJobPtr_t job, void *arg), void *arg)
+{
+	unsigned count = removeJobs(match, arg, TXQ_CANCELLED);
+
+	if((current) && (!current->cancelled) && (*match)(current, arg)){
+		debug(DEBUG_EXPECTED, "Job %u from %s will be cancelled at the next function boundary", current->seq, current->source->name);
+		current->cancelled = TRUE;
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Return the number of jobs expired and the powerline time they would have taken
+ */
+
+void txqExpiryStats(unsigned *count, unsigned long *savedMs)
+{
+	if(count)
+		*count = expiredCount;
+	if(savedMs)
+		*savedMs = expiredMs;
+}
+
+/*
+ * Attach a name/value pair to a job
+ */
+
+void txqAddNV(TxJobPtr_t job, const String name, const String value)
+{
+	TxNVPtr_t nv;
+
+	if((!job) || (!name) || (!value))
+		return;
+	if(!(nv = realloc(job->nv, (job->nvCount + 1) * sizeof(TxNV_t))))
+		fatal("Out of memory in txqAddNV()");
+	job->nv = nv;
+	nv = &job->nv[job->nvCount];
+	if((!(nv->name = strdup(name))) || (!(nv->value = strdup(value))))
+		fatal("Out of memory in txqAddNV()");
+	job->nvCount++;
+}
+
+/*
+ * Return the value of a name/value pair attached to a job, or NULL
+ */
+
+const String txqGetNV(TxJobPtr_t job, const String name)
+{
+	unsigned i;
+
+	for(i = 0; (job) && (i < job->nvCount); i++){
+		if(!strcmp(job->nv[i].name, name))
+			return job->nv[i].value;
+	}
+	return NULL;
+}
+
+/*
+ * Return TRUE if there is nothing to send
+ */
+
+Bool txqEmpty(void)
+{
+	return (current || ringCur) ? FALSE : TRUE;
+}
+
+/*
+ * Return the job being sent, or NULL if there is none
+ */
+
+TxJobPtr_t txqCurrent(void)
+{
+	return current;
+}
+
+/*
+ * Return TRUE if a job could be stopped now and later carried on from its next frame
+ *
+ * That needs the last frame sent to be a function, and the next frame
+ * to start afresh: an address, or a function for a whole house. The
+ * planner leaves out addresses which are still selected from the block
+ * before, so a function can follow a function, and sent on its own
+ * later it would act on whatever the powerline was addressed with then.
+ */
+
+Bool txqResumable(TxJobPtr_t job)
+{
+	X10FramePtr_t f;
+
+	if((!job) || (!job->next) || (job->next >= job->count))
+		return TRUE;
+	if(job->frames[job->next - 1].function == PLAN_FUNC_NONE)
+		return FALSE;
+	f = &job->frames[job->next];
+	return ((f->function == PLAN_FUNC_NONE) || (f->function == COMMAND_ALL_UNITS_OFF) ||
+	(f->function == COMMAND_ALL_LIGHTS_ON) || (f->function == COMMAND_ALL_LIGHTS_OFF)) ? TRUE : FALSE;
+}
+
+/*
+ * Return the number of jobs queued or being sent
+ */
+
+unsigned txqPending(void)
+{
+	return pendingJobs;
+}
+
+/*
+ * Send the next frame of the job being sent, picking a new job if there is none
+ *
+ * send is called with the frame and returns TRUE once the CM11A has
+ * signalled ready, along with the number of retries it took.
+ */
+
+void txqService(Bool (*send)(X10FramePtr_t f, unsigned *retries))
+{
+	TxJobPtr_t job;
+	unsigned retries = 0;
+	unsigned wait;
+	struct timeval now;
+
+	/* Nothing goes out before the jobs queued since last time are in the journal */
+	journalFlush();
+
+	if(!current){
+		if(!(current = nextJob()))
+			return;
+		gettimeofday(&now, NULL);
+		if(jobExpired(current, &now)){
+			debug(DEBUG_EXPECTED, "Job %u from %s expired before it was sent", current->seq, current->source->name);
+			completeCurrent(TXQ_EXPIRED);
+			return;
+		}
+		current->started = now;
+		wait = txqWaitMs(current);
+		current->source->jobs++;
+		current->source->waitTotalMs += wait;
+		if(wait > current->source->waitMaxMs)
+			current->source->waitMaxMs = wait;
+	}
+	job = current;
+
+	if(job->next >= job->count){
+		completeCurrent(TXQ_OK);
+		return;
+	}
+
+	if((job->cancelled) && ((!job->next) || (job->frames[job->next - 1].function != PLAN_FUNC_NONE))){
+		completeCurrent(TXQ_CANCELLED);
+		return;
+	}
+
+	if(!(*send)(&job->frames[job->next], &retries)){
+		job->retries += retries;
+		completeCurrent(TXQ_FAILED);
+		return;
+	}
+	job->retries += retries;
+	job->source->frames++;
+	job->remainingMs -= planFrameTime(&job->frames[job->next]);
+	backlogMs -= planFrameTime(&job->frames[job->next]);
+	if(++job->next >= job->count)
+		completeCurrent(TXQ_OK);
+	else if(txqResumable(job))
+		journalProgress(job);
+}
+
+/*
+ * Estimated powerline time of everything queued, in milliseconds
+ */
+
+unsigned txqBacklogMs(void)
+{
+	return backlogMs;
+}
+
+/*
+ * Iterate over every source seen
+ */
+
+TxSourcePtr_t txqFirstSource(void)
+{
+	return sourceList;
+}
+
+TxSourcePtr_t txqNextSource(TxSourcePtr_t src)
+{
+	return src ? src->next_source : NULL;
+}
+
+/*
+ * Time a job spent waiting in the queue, in milliseconds
+ */
+
+unsigned txqWaitMs(TxJobPtr_t job)
+{
+	if((!job) || (!job->started.tv_sec))
+		return 0;
+	return elapsedMs(&job->queued, &job->started);
+}
+
+/*
+ * Time a job spent on the powerline, in milliseconds
+ */
+
+unsigned txqTxMs(TxJobPtr_t job)
+{
+	if((!job) || (!job->finished.tv_sec))
+		return 0;
+	return elapsedMs(&job->started, &job->finished);
+}
+
+/*
+ * Return the name of a job result
+ */
+
+const String txqResultName(int result)
+{
+	if((result < TXQ_PENDING) || (result > TXQ_CANCELLED))
+		result = TXQ_FAILED;
+	return resultNames[result];
+}
@@ -0,0 +1,133 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    X10 transmit queue
+*
+*/
+
+#ifndef TXQ_H
+#define TXQ_H
+
+#include <sys/time.h>
+#include "types.h"
+#include "confread.h"
+#include "plan.h"
+
+/* Powerline time a source of weight 1 gets per round, in milliseconds */
+#define TXQ_QUANTUM_MS		1000
+
+/* Most sources tracked. Any more share the overflow source */
+#define TXQ_MAX_SOURCES		64
+
+#define TXQ_DEFAULT_WEIGHT	1
+#define TXQ_MAX_WEIGHT		100
+
+/* Job results */
+
+enum {TXQ_PENDING = 0, TXQ_OK, TXQ_FAILED, TXQ_EXPIRED, TXQ_CANCELLED};
+
+/* Typedefs */
+
+typedef struct txnv TxNV_t;
+typedef TxNV_t * TxNVPtr_t;
+typedef struct txjob TxJob_t;
+typedef TxJob_t * TxJobPtr_t;
+typedef struct txsource TxSource_t;
+typedef TxSource_t * TxSourcePtr_t;
+
+/* Name/value pair carried with a job for its confirm */
+
+struct txnv{
+	String name;
+	String value;
+};
+
+/* One queued command */
+
+struct txjob{
+	uint32_t seq;
+	int result;
+	unsigned next;			/* Next frame to send */
+	unsigned count;
+	unsigned retries;		/* Retries over all frames */
+	unsigned cost;			/* Estimated powerline time of the whole job */
+	unsigned remainingMs;		/* Estimated powerline time of the unsent frames */
+	Bool cancelled;			/* Stop at the next safe frame boundary */
+	struct timeval queued;
+	struct timeval started;
+	struct timeval finished;
+	struct timeval deadline;	/* Dropped if not started by then. Zero for none */
+	void (*done)(TxJobPtr_t job);	/* Called once the job completes or fails */
+	unsigned nvCount;
+	TxNVPtr_t nv;
+	X10FramePtr_t frames;
+	TxSourcePtr_t source;
+	void *user;			/* For the job's owner */
+	unsigned journal;		/* JOURNAL_ kind, or JOURNAL_NONE if not journaled */
+	unsigned resumeNext;		/* Last frame the job could safely be restarted from */
+	Bool journaled;			/* Add record written */
+	TxJobPtr_t next_job;
+	TxJobPtr_t next_journal;	/* List of live journaled jobs */
+	TxJobPtr_t prev_journal;
+};
+
+/* A sender with its own queue, served by deficit round robin */
+
+struct txsource{
+	uint32_t hash;
+	String name;			/* vendor-device.instance */
+	unsigned weight;
+	long deficit;			/* Powerline time it may still use this round */
+	unsigned depth;			/* Jobs queued */
+	unsigned jobs;			/* Jobs started */
+	unsigned frames;		/* Frames sent */
+	unsigned long waitTotalMs;
+	unsigned waitMaxMs;
+	TxJobPtr_t head;
+	TxJobPtr_t tail;
+	TxSourcePtr_t next;		/* Hash chain */
+	TxSourcePtr_t next_source;	/* List of all sources */
+	TxSourcePtr_t next_active;	/* Ring of sources with work queued */
+	TxSourcePtr_t prev_active;
+};
+
+/*
+* Function prototypes
+*/
+
+void txqLoadWeights(ConfigEntryPtr_t ce);
+TxJobPtr_t txqSubmit(const String source, X10PlanPtr_t plan, void (*done)(TxJobPtr_t job));
+void txqSetTTL(TxJobPtr_t job, unsigned seconds);
+void txqExpire(void);
+void txqExpiryStats(unsigned *count, unsigned long *savedMs);
+unsigned txqCancel(Bool (*match)(TxJobPtr_t job, void *arg), void *arg);
+void txqAddNV(TxJobPtr_t job, const String name, const String value);
+const String txqGetNV(TxJobPtr_t job, const String name);
+Bool txqEmpty(void);
+TxJobPtr_t txqCurrent(void);
+Bool txqResumable(TxJobPtr_t job);
+unsigned txqPending(void);
+void txqService(Bool (*send)(X10FramePtr_t f, unsigned *retries));
+unsigned txqBacklogMs(void);
+TxSourcePtr_t txqFirstSource(void);
+TxSourcePtr_t txqNextSource(TxSourcePtr_t src);
+unsigned txqWaitMs(TxJobPtr_t job);
+unsigned txqTxMs(TxJobPtr_t job);
+const String txqResultName(int result);
+
+#endif
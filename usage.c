@@ -0,0 +1,427 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Per device usage statistics
+*
+*    On time, level weighted on time and the number of times switched
+*    on are kept for each address over three rolling windows: the last
+*    hour in one minute buckets, the last day in one hour buckets and
+*    the last 30 days in one day buckets. Each window is a ring of
+*    buckets with running totals, so a window's totals are always at
+*    hand, and moving a window on only clears the buckets which have
+*    dropped out of it.
+*
+*    The device state table calls usageChange() on every change of
+*    state, whether from a command we sent or an event received. Time
+*    spent in a state is added to the buckets when the state changes,
+*    when the device is queried, and before a save.
+*
+*    Buckets are aligned to whole minutes, hours and days since the
+*    epoch, so a window covers between one bucket less than its length
+*    and its full length. The buckets with anything in them are saved
+*    to the usage file every USAGE_SAVE_SECS and at shutdown, and put
+*    back at start up. Time the daemon was not running is not counted.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "notify.h"
+#include "confread.h"
+#include "devreg.h"
+#include "usage.h"
+
+typedef struct usagebucket UsageBucket_t;
+typedef UsageBucket_t * UsageBucketPtr_t;
+typedef struct usagewin UsageWin_t;
+typedef UsageWin_t * UsageWinPtr_t;
+typedef struct usagedev UsageDev_t;
+typedef UsageDev_t * UsageDevPtr_t;
+
+/* Totals for one bucket, or a whole window */
+
+struct usagebucket{
+	uint32_t onSecs;
+	uint32_t levelSecs;		/* Level in percent times seconds */
+	uint32_t switches;
+};
+
+/* One rolling window */
+
+struct usagewin{
+	time_t headStart;		/* Start of the newest bucket */
+	unsigned head;
+	UsageBucket_t total;
+	UsageBucket_t bucket[USAGE_MAX_BUCKETS];
+};
+
+/* One address, created on its first change of state */
+
+struct usagedev{
+	Bool on;
+	uint8_t level;
+	time_t since;			/* Time counted up to */
+	time_t created;			/* When counting started */
+	UsageWin_t win[USAGE_WINDOWS];
+};
+
+/* Window layouts */
+
+static const struct{
+	const String name;
+	unsigned secs;			/* Bucket length */
+	unsigned buckets;
+} windowDef[USAGE_WINDOWS] = {
+	{"hour", 60, 60},
+	{"day", 3600, 24},
+	{"month", 86400, 30}
+};
+
+static UsageDevPtr_t usageTable[16][16];
+static char filePath[256] = "";
+static Bool dirty = FALSE;
+static time_t lastSave = 0;
+
+
+/*
+ * Move a window on so its newest bucket holds a time
+ */
+
+static void winAdvance(UsageWinPtr_t w, unsigned kind, time_t now)
+{
+	unsigned n = windowDef[kind].buckets;
+	time_t start = now - now % windowDef[kind].secs;
+	time_t steps;
+	UsageBucketPtr_t b;
+
+	if(start <= w->headStart)
+		return;
+	steps = (start - w->headStart) / windowDef[kind].secs;
+	if((!w->headStart) || (steps >= n)){
+		memset(w, 0, sizeof(UsageWin_t));
+		w->headStart = start;
+		return;
+	}
+	while(steps--){
+		w->head = (w->head + 1) % n;
+		b = &w->bucket[w->head];
+		w->total.onSecs -= b->onSecs;
+		w->total.levelSecs -= b->levelSecs;
+		w->total.switches -= b->switches;
+		memset(b, 0, sizeof(UsageBucket_t));
+	}
+	w->headStart = start;
+}
+
+/*
+ * Add to the bucket holding a time. Times outside the window are ignored
+ */
+
+static void winAdd(UsageWinPtr_t w, unsigned kind, time_t t, uint32_t onSecs, uint32_t levelSecs, uint32_t switches)
+{
+	unsigned n = windowDef[kind].buckets;
+	time_t age;
+	UsageBucketPtr_t b;
+
+	if(t > w->headStart + (time_t) windowDef[kind].secs - 1)
+		return;
+	age = (w->headStart - (t - t % windowDef[kind].secs)) / windowDef[kind].secs;
+	if((age < 0) || (age >= n))
+		return;
+	b = &w->bucket[(w->head + n - age) % n];
+	b->onSecs += onSecs;
+	b->levelSecs += levelSecs;
+	b->switches += switches;
+	w->total.onSecs += onSecs;
+	w->total.levelSecs += levelSecs;
+	w->total.switches += switches;
+}
+
+/*
+ * Count the time since the last change up to now
+ *
+ * An interval crossing bucket boundaries is split between the buckets.
+ * Only the part still inside a window is looked at, so this is bounded
+ * by the number of buckets however long the interval is.
+ */
+
+static void settle(UsageDevPtr_t ud, time_t now)
+{
+	unsigned kind;
+	time_t t, end, oldest;
+	UsageWinPtr_t w;
+
+	for(kind = 0; kind < USAGE_WINDOWS; kind++){
+		w = &ud->win[kind];
+		winAdvance(w, kind, now);
+		if((!ud->on) || (now <= ud->since))
+			continue;
+		oldest = w->headStart - (time_t) (windowDef[kind].buckets - 1) * windowDef[kind].secs;
+		for(t = (ud->since > oldest) ? ud->since : oldest; t < now; t = end){
+			end = t - t % windowDef[kind].secs + windowDef[kind].secs;
+			if(end > now)
+				end = now;
+			winAdd(w, kind, t, (uint32_t) (end - t), (uint32_t) ((end - t) * ud->level), 0);
+		}
+	}
+	/* Even if the clock has been set back */
+	ud->since = now;
+}
+
+/*
+ * Return the statistics for an address, creating them if asked to
+ */
+
+static UsageDevPtr_t getDev(int house, int unit, time_t now, Bool create)
+{
+	unsigned kind;
+	UsageDevPtr_t ud;
+
+	if((house < 0) || (house > 15) || (unit < 0) || (unit > 15))
+		return NULL;
+	if(((ud = usageTable[house][unit])) || (!create))
+		return ud;
+	if(!(ud = calloc(1, sizeof(UsageDev_t))))
+		fatal("Out of memory in getDev()");
+	ud->since = ud->created = now;
+	for(kind = 0; kind < USAGE_WINDOWS; kind++)
+		winAdvance(&ud->win[kind], kind, now);
+	usageTable[house][unit] = ud;
+	return ud;
+}
+
+/*
+ * Load the statistics saved before the last exit
+ *
+ * Lines are A1 = created, and A1-window-start = on,levelsecs,switches
+ * for each bucket with anything in it.
+ */
+
+static void load(void)
+{
+	ConfigEntryPtr_t ce;
+	KeyEntryPtr_t ke;
+	UsageDevPtr_t ud;
+	String key, p;
+	int house, unit;
+	unsigned kind, count = 0;
+	unsigned long onSecs, levelSecs, switches;
+	time_t now = time(NULL);
+
+	if((!filePath[0]) || (access(filePath, R_OK)) || (!(ce = confreadScan(filePath, confreadDefErrorHandler))))
+		return;
+	for(ke = confreadGetFirstKeyBySection(ce, "usage"); ke; ke = confreadGetNextKey(ke)){
+		key = confreadGetKey(ke);
+		house = toupper(key[0]) - 'A';
+		unit = (int) strtol(key + 1, &p, 10) - 1;
+		if((house < 0) || (house > 15) || (unit < 0) || (unit > 15) || (!(ud = getDev(house, unit, now, TRUE)))){
+			debug(DEBUG_UNEXPECTED, "Bad usage entry on line %u of %s", confreadKeyLineNum(ke), filePath);
+			continue;
+		}
+		if(!*p){
+			if(atol(confreadGetValue(ke)) > 0)
+				ud->created = (time_t) atol(confreadGetValue(ke));
+			continue;
+		}
+		for(kind = 0; kind < USAGE_WINDOWS; kind++){
+			if((*p == '-') && (!strncmp(p + 1, windowDef[kind].name, strlen(windowDef[kind].name))) &&
+			(p[strlen(windowDef[kind].name) + 1] == '-'))
+				break;
+		}
+		if((kind == USAGE_WINDOWS) ||
+		(sscanf(confreadGetValue(ke), "%lu,%lu,%lu", &onSecs, &levelSecs, &switches) != 3)){
+			debug(DEBUG_UNEXPECTED, "Bad usage entry on line %u of %s", confreadKeyLineNum(ke), filePath);
+			continue;
+		}
+		winAdd(&ud->win[kind], kind, (time_t) atol(p + strlen(windowDef[kind].name) + 2),
+		(uint32_t) onSecs, (uint32_t) levelSecs, (uint32_t) switches);
+		count++;
+	}
+	confreadFree(ce);
+	debug(DEBUG_STATUS, "%u usage buckets restored from %s", count, filePath);
+}
+
+/*
+ * Set the file the statistics are kept in, and load them
+ */
+
+void usageInit(const String path)
+{
+	if(path)
+		confreadStringCopy(filePath, path, sizeof(filePath));
+	lastSave = time(NULL);
+	load();
+}
+
+/*
+ * Note a change of state of a device
+ *
+ * Level is in percent. Switches count the changes from off or unknown to on.
+ */
+
+void usageChange(int house, int unit, Bool on, int level, time_t now)
+{
+	unsigned kind;
+	UsageDevPtr_t ud;
+
+	if(!(ud = getDev(house, unit, now, TRUE)))
+		return;
+	settle(ud, now);
+	if((on) && (!ud->on)){
+		for(kind = 0; kind < USAGE_WINDOWS; kind++)
+			winAdd(&ud->win[kind], kind, now, 0, 0, 1);
+	}
+	ud->on = on;
+	ud->level = (level < 0) ? 0 : (level > 100) ? 100 : level;
+	dirty = TRUE;
+}
+
+/*
+ * Pick up counting a device's state from before a restart
+ *
+ * Unlike usageChange(), this is not counted as a switch.
+ */
+
+void usageResume(int house, int unit, Bool on, int level, time_t now)
+{
+	UsageDevPtr_t ud;
+
+	if(!(ud = getDev(house, unit, now, on)))
+		return;
+	settle(ud, now);
+	ud->on = on;
+	ud->level = (level < 0) ? 0 : (level > 100) ? 100 : level;
+}
+
+/*
+ * Get the totals for an address over one window
+ *
+ * Returns FALSE if the address has never changed state.
+ */
+
+Bool usageGet(int house, int unit, unsigned window, UsageStatsPtr_t us)
+{
+	time_t now = time(NULL);
+	time_t span;
+	UsageDevPtr_t ud;
+	UsageWinPtr_t w;
+	DevEntryPtr_t de;
+
+	if((window >= USAGE_WINDOWS) || (!(ud = getDev(house, unit, now, FALSE))))
+		return FALSE;
+	settle(ud, now);
+	w = &ud->win[window];
+	span = now - w->headStart + (time_t) (windowDef[window].buckets - 1) * windowDef[window].secs;
+	if(now - ud->created < span)
+		span = now - ud->created;
+	us->spanSecs = (unsigned) span;
+	us->onSecs = w->total.onSecs;
+	us->switches = w->total.switches;
+	us->levelSecs = w->total.levelSecs / 100.0;
+	us->wattHours = ((de = devregByAddress(house, unit)) && (de->watts)) ? de->watts * us->levelSecs / 3600.0 : 0.0;
+	return TRUE;
+}
+
+/*
+ * Return the name of a window
+ */
+
+const String usageWindowName(unsigned window)
+{
+	return (window < USAGE_WINDOWS) ? windowDef[window].name : "unknown";
+}
+
+/*
+ * Write the statistics to the usage file, bringing every device up to date first. arg points to the time now
+ */
+
+static Bool writeUsage(FILE *file, void *arg)
+{
+	int house, unit;
+	unsigned kind, i, n;
+	time_t now = *(time_t *) arg;
+	UsageDevPtr_t ud;
+	UsageWinPtr_t w;
+	UsageBucketPtr_t b;
+
+	fprintf(file, "[usage]\n");
+	for(house = 0; house < 16; house++){
+		for(unit = 0; unit < 16; unit++){
+			if(!(ud = usageTable[house][unit]))
+				continue;
+			settle(ud, now);
+			fprintf(file, "%c%d = %ld\n", 'A' + house, unit + 1, (long) ud->created);
+			for(kind = 0; kind < USAGE_WINDOWS; kind++){
+				w = &ud->win[kind];
+				n = windowDef[kind].buckets;
+				for(i = 0; i < n; i++){
+					b = &w->bucket[(w->head + n - i) % n];
+					if(b->onSecs || b->switches)
+						fprintf(file, "%c%d-%s-%ld = %u,%u,%u\n", 'A' + house, unit + 1, windowDef[kind].name,
+						(long) (w->headStart - (time_t) i * windowDef[kind].secs), b->onSecs, b->levelSecs, b->switches);
+				}
+			}
+		}
+	}
+	return ferror(file) ? FALSE : TRUE;
+}
+
+/*
+ * Save the statistics
+ */
+
+void usageSave(void)
+{
+	time_t now = time(NULL);
+
+	dirty = FALSE;
+	lastSave = now;
+	if((filePath[0]) && (!confreadReplaceFile(filePath, writeUsage, &now)))
+		debug(DEBUG_UNEXPECTED, "Could not save usage file %s", filePath);
+}
+
+/*
+ * Save the statistics if they have changed and it is time to. Called once a second
+ *
+ * A device which is on changes its statistics without changing state, so
+ * once anything has changed saves carry on until everything is off.
+ */
+
+void usageTick(void)
+{
+	int house, unit;
+	time_t now = time(NULL);
+
+	if(now - lastSave < USAGE_SAVE_SECS)
+		return;
+	for(house = 0; (house < 16) && (!dirty); house++){
+		for(unit = 0; unit < 16; unit++){
+			if((usageTable[house][unit]) && (usageTable[house][unit]->on)){
+				dirty = TRUE;
+				break;
+			}
+		}
+	}
+	if(dirty)
+		usageSave();
+	else
+		lastSave = now;
+}
@@ -0,0 +1,68 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Per device usage statistics
+*
+*/
+
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <time.h>
+#include "types.h"
+
+/* Rolling windows */
+#define USAGE_HOUR		0
+#define USAGE_DAY		1
+#define USAGE_MONTH		2
+#define USAGE_WINDOWS		3
+
+/* Most buckets in a window */
+#define USAGE_MAX_BUCKETS	60
+
+/* Seconds between saves while anything has changed */
+#define USAGE_SAVE_SECS		300
+
+/* Typedefs */
+
+typedef struct usagestats UsageStats_t;
+typedef UsageStats_t * UsageStatsPtr_t;
+
+/* Totals for one device over one window */
+
+struct usagestats{
+	unsigned spanSecs;		/* Time covered, shorter than the window while it fills */
+	unsigned onSecs;		/* Time on */
+	unsigned switches;		/* Times switched on */
+	double levelSecs;		/* Time on weighted by level, 1.0 per second at 100% */
+	double wattHours;		/* From the device's watts= option, 0 if not set */
+};
+
+/*
+* Function prototypes
+*/
+
+void usageInit(const String path);
+void usageChange(int house, int unit, Bool on, int level, time_t now);
+void usageResume(int house, int unit, Bool on, int level, time_t now);
+Bool usageGet(int house, int unit, unsigned window, UsageStatsPtr_t us);
+const String usageWindowName(unsigned window);
+void usageTick(void);
+void usageSave(void);
+
+#endif
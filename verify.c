@@ -0,0 +1,376 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Delivery verification for two-way modules
+*
+*    After a command has been sent, each registered two-way device it
+*    switched is sent a status request, one device at a time. The reply
+*    is matched against the state we expect. On a mismatch the command
+*    is resent with another status request, and if there is no reply the
+*    request is repeated, up to VERIFY_MAX_ATTEMPTS in all. The command's
+*    confirm is held until every device has been verified or given up on.
+*
+*    Status replies carry a house code but usually no unit, so only one
+*    request per house is outstanding at a time.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "x10.h"
+#include "devreg.h"
+#include "devstate.h"
+#include "verify.h"
+
+static VerifyPtr_t verifyList = NULL;
+static Bool abandoning = FALSE;
+
+static void requestSent(TxJobPtr_t job);
+
+
+/*
+ * Return TRUE if a status request is outstanding for a house
+ */
+
+static Bool houseBusy(int house)
+{
+	VerifyPtr_t v;
+
+	for(v = verifyList; v; v = v->next){
+		if((v->cur < v->count) && (v->target[v->cur].house == house) && ((v->requestQueued) || (v->deadline)))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Queue a status request for the target being checked, resending the command first if asked
+ */
+
+static void sendRequest(VerifyPtr_t v, Bool resend)
+{
+	X10Addrs_t addrs;
+	TxJobPtr_t job;
+	VerifyTargetPtr_t t = &v->target[v->cur];
+	static X10Plan_t plan;
+
+	memset(&addrs, 0, sizeof(addrs));
+	addrs.houses = 1 << t->house;
+	addrs.units[t->house] = 1 << t->unit;
+	planInit(&plan);
+	if(resend)
+		planAddFunction(&plan, &addrs, t->on ? COMMAND_ON : COMMAND_OFF, 0, 0, 0, t->house);
+	planAddFunction(&plan, &addrs, COMMAND_STATUS_REQUEST, 0, 0, 0, t->house);
+	job = txqSubmit(NULL, &plan, requestSent);
+	job->user = v;
+	v->requestQueued = TRUE;
+	t->attempts++;
+	debug(DEBUG_ACTION, "Verify %c%u: %s status request, attempt %u", 'A' + t->house, t->unit + 1,
+	resend ? "resend and" : "sending", t->attempts);
+}
+
+/*
+ * Record the outcome for the target being checked and move on to the next
+ */
+
+static void resolveTarget(VerifyPtr_t v, int state)
+{
+	VerifyTargetPtr_t t = &v->target[v->cur];
+	DevEntryPtr_t de = devregByAddress(t->house, t->unit);
+
+	t->state = state;
+	if(de){
+		if(state == VT_VERIFIED)
+			de->verified++;
+		else
+			de->unverified++;
+	}
+	debug(DEBUG_ACTION, "Verify %c%u: %s", 'A' + t->house, t->unit + 1, (state == VT_VERIFIED) ? "verified" : "unverified");
+	v->cur++;
+}
+
+/*
+ * Try again after no reply or a failed request, or give up
+ */
+
+static void retryTarget(VerifyPtr_t v)
+{
+	if(v->target[v->cur].attempts < VERIFY_MAX_ATTEMPTS)
+		sendRequest(v, FALSE);
+	else
+		resolveTarget(v, VT_UNVERIFIED);
+}
+
+/*
+ * Finish a verification: unlink it, hand it to its owner, and free it
+ */
+
+static void finish(VerifyPtr_t v)
+{
+	unsigned i;
+	VerifyPtr_t *pv;
+
+	for(pv = &verifyList; *pv; pv = &(*pv)->next){
+		if(*pv == v){
+			*pv = v->next;
+			break;
+		}
+	}
+	if(v->done)
+		(*v->done)(v);
+	for(i = 0; i < v->nvCount; i++){
+		free(v->nv[i].name);
+		free(v->nv[i].value);
+	}
+	free(v->nv);
+	free(v);
+}
+
+/*
+ * Start the next request of every verification which isn't waiting, and finish those which are done
+ */
+
+static void kick(void)
+{
+	VerifyPtr_t v, next;
+
+	for(v = verifyList; v; v = next){
+		next = v->next;
+		if((v->requestQueued) || (v->deadline))
+			continue;
+		if(v->cur >= v->count)
+			finish(v);
+		else if(!houseBusy(v->target[v->cur].house))
+			sendRequest(v, FALSE);
+	}
+}
+
+/*
+ * Called by the transmit queue when a status request has been sent
+ */
+
+static void requestSent(TxJobPtr_t job)
+{
+	VerifyPtr_t v = job->user;
+
+	if((abandoning) || (!v))
+		return;
+	v->requestQueued = FALSE;
+	if(job->result == TXQ_OK)
+		v->deadline = time(NULL) + VERIFY_REPLY_SECS;
+	else
+		retryTarget(v);
+	kick();
+}
+
+
+/*
+ * Start verifying the two-way devices switched by a completed job
+ *
+ * The device state table must already reflect the job. Returns FALSE if
+ * there is nothing to verify. Otherwise the job's name/values are taken
+ * over, and done is called with the verification once it is complete.
+ */
+
+Bool verifyStart(TxJobPtr_t job, void (*done)(VerifyPtr_t v))
+{
+	unsigned i, j, units;
+	int unit;
+	X10FramePtr_t f;
+	DevEntryPtr_t de;
+	VerifyPtr_t v;
+	VerifyTarget_t target[VERIFY_MAX_TARGETS];
+	unsigned count = 0;
+
+	for(i = 0; i < job->count; i++){
+		f = &job->frames[i];
+		switch(f->function){
+			case COMMAND_ALL_UNITS_OFF:
+			case COMMAND_ALL_LIGHTS_OFF:
+			case COMMAND_ALL_LIGHTS_ON:
+				units = 0xFFFF;
+				break;
+
+			case COMMAND_ON:
+			case COMMAND_OFF:
+			case COMMAND_DIM:
+			case COMMAND_BRIGHT:
+				units = f->unitmask;
+				break;
+
+			default:
+				continue;
+		}
+		for(unit = 0; unit < 16; unit++){
+			if((!(units & (1 << unit))) || (!(de = devregByAddress(f->house, unit))) || (!(de->caps & DEV_CAP_TWOWAY)))
+				continue;
+			for(j = 0; j < count; j++){
+				if((target[j].house == f->house) && (target[j].unit == unit))
+					break;
+			}
+			if(j == count){
+				if(count == VERIFY_MAX_TARGETS){
+					debug(DEBUG_UNEXPECTED, "Too many two-way devices to verify");
+					continue;
+				}
+				count++;
+			}
+			memset(&target[j], 0, sizeof(VerifyTarget_t));
+			target[j].house = f->house;
+			target[j].unit = unit;
+		}
+	}
+	if(!count)
+		return FALSE;
+
+	if(!(v = calloc(1, sizeof(Verify_t))))
+		fatal("Out of memory in verifyStart()");
+	for(i = 0; i < count; i++){
+		v->target[i] = target[i];
+		v->target[i].on = (devstateGet(target[i].house, target[i].unit)->flags & DS_ON) ? 1 : 0;
+	}
+	v->count = count;
+	v->result = job->result;
+	v->retries = job->retries;
+	v->waitMs = txqWaitMs(job);
+	v->txMs = txqTxMs(job);
+	v->nv = job->nv;
+	v->nvCount = job->nvCount;
+	job->nv = NULL;
+	job->nvCount = 0;
+	v->done = done;
+	v->next = verifyList;
+	verifyList = v;
+	kick();
+	return TRUE;
+}
+
+/*
+ * Match a status reply from the powerline against the request outstanding for its house
+ *
+ * unitmask is 0 if the reply carried no address.
+ * Returns TRUE if the reply was for a verification.
+ */
+
+Bool verifyStatusReply(int house, unsigned unitmask, Bool on)
+{
+	VerifyPtr_t v;
+	VerifyTargetPtr_t t;
+	Bool matched = FALSE;
+
+	for(v = verifyList; v; v = v->next){
+		if((!v->deadline) || (v->cur >= v->count))
+			continue;
+		t = &v->target[v->cur];
+		if((t->house != house) || ((unitmask) && (!(unitmask & (1 << t->unit)))))
+			continue;
+		v->deadline = 0;
+		devstateApply(house, 1 << t->unit, on ? COMMAND_STATUS_ON : COMMAND_STATUS_OFF, 0);
+		if((on ? 1 : 0) == t->on)
+			resolveTarget(v, VT_VERIFIED);
+		else if(t->attempts < VERIFY_MAX_ATTEMPTS){
+			debug(DEBUG_EXPECTED, "Verify %c%u: reported %s, resending", 'A' + house, t->unit + 1, on ? "on" : "off");
+			if(devregByAddress(house, t->unit))
+				devregByAddress(house, t->unit)->resends++;
+			sendRequest(v, TRUE);
+		}
+		else
+			resolveTarget(v, VT_UNVERIFIED);
+		matched = TRUE;
+		break;
+	}
+	kick();
+	return matched;
+}
+
+/*
+ * Time out replies which haven't arrived. Called once a second
+ */
+
+void verifyTick(void)
+{
+	time_t now = time(NULL);
+	VerifyPtr_t v;
+
+	for(v = verifyList; v; v = v->next){
+		if((v->deadline) && (now >= v->deadline)){
+			debug(DEBUG_EXPECTED, "Verify %c%u: no reply", 'A' + v->target[v->cur].house, v->target[v->cur].unit + 1);
+			v->deadline = 0;
+			retryTarget(v);
+		}
+	}
+	kick();
+}
+
+/*
+ * Match our status request jobs
+ */
+
+static Bool isRequest(TxJobPtr_t job, void *arg)
+{
+	return (job->done == requestSent) ? TRUE : FALSE;
+}
+
+/*
+ * Give up on every verification in progress, sending their confirms with
+ * the devices not yet checked as unverified. Their status requests are
+ * cancelled. Used before an upgrade, which can't carry them over.
+ */
+
+void verifyAbandon(void)
+{
+	VerifyPtr_t v;
+	TxJobPtr_t job = txqCurrent();
+
+	abandoning = TRUE;
+	if((job) && (job->done == requestSent))
+		job->user = NULL;
+	txqCancel(isRequest, NULL);
+	while((v = verifyList)){
+		while(v->cur < v->count)
+			resolveTarget(v, VT_UNVERIFIED);
+		finish(v);
+	}
+	abandoning = FALSE;
+}
+
+/*
+ * Return TRUE if there are no verifications in progress
+ */
+
+Bool verifyIdle(void)
+{
+	return verifyList ? FALSE : TRUE;
+}
+
+/*
+ * Return TRUE if every device in a verification was verified
+ */
+
+Bool verifyAllVerified(VerifyPtr_t v)
+{
+	unsigned i;
+
+	for(i = 0; i < v->count; i++){
+		if(v->target[i].state != VT_VERIFIED)
+			return FALSE;
+	}
+	return TRUE;
+}
@@ -0,0 +1,89 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Delivery verification for two-way modules
+*
+*/
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <time.h>
+#include "types.h"
+#include "txq.h"
+
+/* Most two-way devices checked for one command */
+#define VERIFY_MAX_TARGETS	32
+
+/* Seconds to hold the confirm waiting for a device's status reply before retrying or calling it unverified */
+#define VERIFY_REPLY_SECS	3
+
+/* Status requests per device before giving up, including resends after a mismatch */
+#define VERIFY_MAX_ATTEMPTS	3
+
+/* Target states */
+
+enum {VT_PENDING = 0, VT_VERIFIED, VT_UNVERIFIED};
+
+/* Typedefs */
+
+typedef struct vtarget VerifyTarget_t;
+typedef VerifyTarget_t * VerifyTargetPtr_t;
+typedef struct verify Verify_t;
+typedef Verify_t * VerifyPtr_t;
+
+/* One device to check */
+
+struct vtarget{
+	uint8_t house;
+	uint8_t unit;
+	uint8_t on;			/* State we expect */
+	uint8_t state;
+	uint8_t attempts;
+};
+
+/* A command whose confirm is held until its devices have been checked */
+
+struct verify{
+	int result;			/* From the command's job */
+	unsigned retries;
+	unsigned waitMs;
+	unsigned txMs;
+	unsigned nvCount;		/* Confirm name/values taken over from the job */
+	TxNVPtr_t nv;
+	unsigned count;
+	unsigned cur;			/* Target being checked */
+	Bool requestQueued;
+	time_t deadline;		/* For the reply to the request sent. 0 while not waiting */
+	void (*done)(VerifyPtr_t v);
+	VerifyTarget_t target[VERIFY_MAX_TARGETS];
+	VerifyPtr_t next;
+};
+
+/*
+* Function prototypes
+*/
+
+Bool verifyStart(TxJobPtr_t job, void (*done)(VerifyPtr_t v));
+Bool verifyStatusReply(int house, unsigned unitmask, Bool on);
+Bool verifyIdle(void);
+void verifyAbandon(void);
+void verifyTick(void);
+Bool verifyAllVerified(VerifyPtr_t v);
+
+#endif
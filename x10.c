@@ -329,6 +329,7 @@ static void x10_poll(X10 *x10) {
 	unsigned char buffer_size;
 	unsigned char function_byte;
 	int i,j,pos;
+	unsigned unitmask;
 	
 	/* Acknowledge the x10's poll. */
 	command=0xc3;
@@ -395,17 +396,19 @@ static void x10_poll(X10 *x10) {
 				//debug(DEBUG_ACTION,"Address count: %i\n", x10->address_buffer_count);
 				/* Generate the address string */
 				x10->address_string[0] = 0;		
-				for(j = 0, pos = 0 ; j < x10->address_buffer_count; j++){
+				for(j = 0, pos = 0, unitmask = 0 ; j < x10->address_buffer_count; j++){
 					if(j)
 						x10->address_string[pos++] = ',';
 				    //debug(DEBUG_ACTION,"Address code: %02X\n", x10->address_buffer[j]);
 					pos += snprintf(x10->address_string + pos, 3, "%u", addresscode2int[x10->address_buffer[j] & 0x0F]);
+					/* Bit 0 is unit 1 */
+					unitmask |= 1 << (addresscode2int[x10->address_buffer[j] & 0x0F] - 1);
 				}
 				//debug(DEBUG_ACTION,"Address string: %s\n", x10->address_string);
 				//debug(DEBUG_ACTION,"House code: %02X\n", x10->address_buffer_housecode);	 
 				/* Call the user event handler */
 				(*x10->event_callback)(x10->address_string,
-				housecode2letter[x10->address_buffer_housecode], x10_buffer[i] & 0x0F);
+				housecode2letter[x10->address_buffer_housecode], unitmask, x10_buffer[i] & 0x0F);
 			}
 			
 			/* Flush the address buffer. */
@@ -494,6 +497,7 @@ int x10_write_message(X10 *x10, void *buf, size_t count) {
 	
 	/* Try writing the message 5 times, then just fail. */
 	for(try_count=1; try_count <= 5; try_count++) {
+		x10->try_count = try_count;
 		
 		/* Send the data. */
 		if(x10_write(x10, buf, count) != count) {
@@ -574,7 +578,7 @@ int x10_write_message(X10 *x10, void *buf, size_t count) {
  * 
  */
  
-X10 *x10_open(const char *x10_tty_name, void (*event_callback)(const char *, const char, const unsigned)) {
+X10 *x10_open(const char *x10_tty_name, void (*event_callback)(const char *, const char, const unsigned, const unsigned)) {
 	X10 *x10;
 	struct termios termios;
 	
@@ -693,6 +697,72 @@ void x10_read_event(X10 *x10) {
 	return;
 }
 
+/*
+ * Take over a tty already opened and set up by x10_open(), for instance
+ * in a process we were exec()ed from. The port is left as it is, so
+ * the CM11A sees nothing happen.
+ *
+ * Returns NULL if the fd isn't open.
+ */
+
+X10 *x10_adopt(int fd, void (*event_callback)(const char *, const char, const unsigned, const unsigned)) {
+	X10 *x10;
+
+	if(fcntl(fd, F_GETFL) == -1)
+		return NULL;
+	x10 = calloc(1, sizeof(X10));
+	if(!x10) fatal("Out of memory.");
+	x10->fd = fd;
+	x10->event_callback = event_callback;
+	x10->magic = X10_MAGIC;
+	return(x10);
+}
+
+/*
+ * Describe the receive state carried between polls, which is any
+ * addresses received without their function yet, as a string for
+ * x10_set_phase(). Returns 0 on success.
+ */
+
+int x10_get_phase(X10 *x10, char *buf, size_t size)
+{
+	int i, pos;
+
+	if(!x10 || x10->magic != X10_MAGIC || size < 24)
+		return 1;
+	pos = snprintf(buf, size, "%X:%d:", x10->address_buffer_housecode & 0x0F, x10->address_buffer_count);
+	for(i = 0; i < x10->address_buffer_count; i++)
+		buf[pos++] = "0123456789ABCDEF"[x10->address_buffer[i] & 0x0F];
+	buf[pos] = 0;
+	return 0;
+}
+
+/*
+ * Restore the receive state saved by x10_get_phase(). Returns 0 on success.
+ */
+
+int x10_set_phase(X10 *x10, const char *phase)
+{
+	unsigned housecode;
+	int count, i, n;
+	char digit[2] = {0, 0};
+
+	if(!x10 || x10->magic != X10_MAGIC || !phase)
+		return 1;
+	if(sscanf(phase, "%X:%d:%n", &housecode, &count, &n) != 2 || housecode > 15 ||
+	count < 0 || count > 16 || (int) strlen(phase + n) != count)
+		return 1;
+	for(i = 0; i < count; i++){
+		digit[0] = phase[n + i];
+		if(!isxdigit((unsigned char) digit[0]))
+			return 1;
+		x10->address_buffer[i] = strtol(digit, NULL, 16);
+	}
+	x10->address_buffer_housecode = housecode;
+	x10->address_buffer_count = count;
+	return 0;
+}
+
 /*
  * Translate letter housecode to binary house code
  */
@@ -735,6 +805,18 @@ int x10_fd(X10 *x10)
 		return -1;
 }
 
+/*
+ * Return the number of tries the last x10_write_message() took
+ */
+
+int x10_try_count(X10 *x10)
+{
+	if((x10) && (x10->magic == X10_MAGIC))
+		return x10->try_count;
+	else
+		return 0;
+}
+
 /*
  * Close the X10 communications port
  */
@@ -118,7 +118,8 @@ struct x10 {
 	int fd;
 	int housecode;
 	int address_buffer_count;
-	void (*event_callback)(const char *address_list, const char houseletter, const unsigned commandcode);
+	int try_count;		/* Tries the last x10_write_message() took */
+	void (*event_callback)(const char *address_list, const char houseletter, const unsigned unitmask, const unsigned commandcode);
 	unsigned char address_buffer_housecode;
 	char address_buffer[16];
 	char address_string[64];
@@ -126,12 +127,16 @@ struct x10 {
 
 /* Prototypes. */
 
-X10 *x10_open(const char *x10_tty_name, void (*event_callback)(const char *, const char, const unsigned));
+X10 *x10_open(const char *x10_tty_name, void (*event_callback)(const char *, const char, const unsigned, const unsigned));
+X10 *x10_adopt(int fd, void (*event_callback)(const char *, const char, const unsigned, const unsigned));
+int x10_get_phase(X10 *x10, char *buf, size_t size);
+int x10_set_phase(X10 *x10, const char *phase);
 int x10_write_message(X10 *x10, void *buf, size_t count);
 void x10_read_event(X10 *x10);
 int x10_letter_to_housecode(char houseletter, unsigned char *housecode);
 int x10_number_to_devicecode(int devicenum, unsigned char *devicecode);
 int x10_fd(X10 *x10);
+int x10_try_count(X10 *x10);
 int x10_close(X10 *x10);
 
 #endif
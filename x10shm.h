@@ -0,0 +1,155 @@
+/*
+*
+*    Copyright (C) 2013  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Shared memory device state table
+*
+*    xplx10 publishes the state of all 256 X10 addresses in a POSIX
+*    shared memory object named by shm-name in the config file. This
+*    header is all a reader needs. It has no other dependencies.
+*
+*    The table is guarded by a sequence lock. The writer makes seq odd
+*    while it updates the table and even again when it is done, so a
+*    reader which sees the same even seq before and after copying has a
+*    consistent snapshot. Readers never block the daemon.
+*
+*        X10ShmTablePtr_t t = x10shmOpen("/xplx10");
+*        X10ShmEntry_t e;
+*
+*        if(t && x10shmRead(t, 0, 4, &e) && (e.flags & X10SHM_KNOWN))
+*            printf("A5 is %s\n", (e.flags & X10SHM_ON) ? "on" : "off");
+*
+*    Link with -lrt on older C libraries.
+*
+*/
+
+#ifndef X10SHM_H
+#define X10SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define X10SHM_MAGIC		0x58313053	/* "X10S" */
+#define X10SHM_VERSION		1
+
+/* Flag bits */
+#define X10SHM_KNOWN		0x01	/* State has been seen at least once */
+#define X10SHM_ON		0x02	/* Device is on */
+#define X10SHM_RESTORED		0x04	/* State is from before the last restart, and not yet seen since */
+
+/* Typedefs */
+
+typedef struct x10shmentry X10ShmEntry_t;
+typedef X10ShmEntry_t * X10ShmEntryPtr_t;
+typedef struct x10shmtable X10ShmTable_t;
+typedef X10ShmTable_t * X10ShmTablePtr_t;
+
+/* One X10 address */
+
+struct x10shmentry{
+	uint8_t flags;
+	uint8_t level;			/* 0-100 percent */
+	uint16_t reserved;
+	uint32_t seq;			/* Bumped on every change of this device */
+	int64_t changed;		/* Time of last change, seconds since the epoch */
+	int64_t updated;		/* Time the state was last set or confirmed */
+};
+
+/* The whole segment */
+
+struct x10shmtable{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entrySize;		/* sizeof(X10ShmEntry_t) */
+	volatile uint32_t seq;		/* Odd while the writer is updating */
+	int32_t pid;			/* Writer, 0 once it has exited */
+	X10ShmEntry_t entry[16][16];	/* [house][unit], 0-15 for A-P and 1-16 */
+};
+
+/*
+ * Map the table read only. Returns NULL if it is not there or not a version we know
+ */
+
+static inline X10ShmTablePtr_t x10shmOpen(const char *name)
+{
+	int fd;
+	void *p;
+	X10ShmTablePtr_t t;
+
+	if((fd = shm_open(name, O_RDONLY, 0)) < 0)
+		return NULL;
+	p = mmap(NULL, sizeof(X10ShmTable_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return NULL;
+	t = p;
+	if((t->magic != X10SHM_MAGIC) || (t->version != X10SHM_VERSION) || (t->entrySize != sizeof(X10ShmEntry_t))){
+		munmap(p, sizeof(X10ShmTable_t));
+		return NULL;
+	}
+	return t;
+}
+
+/*
+ * Unmap the table
+ */
+
+static inline void x10shmClose(X10ShmTablePtr_t t)
+{
+	if(t)
+		munmap((void *) t, sizeof(X10ShmTable_t));
+}
+
+/*
+ * Copy a consistent snapshot of the whole table, or of one entry
+ *
+ * Spins while the writer is mid update, which lasts a few microseconds.
+ * Returns 0 if the house or unit is out of range.
+ */
+
+static inline int x10shmSnapshot(X10ShmTablePtr_t t, X10ShmEntry_t copy[16][16])
+{
+	uint32_t seq;
+
+	do{
+		while((seq = t->seq) & 1);
+		__sync_synchronize();
+		memcpy(copy, (const void *) t->entry, sizeof(t->entry));
+		__sync_synchronize();
+	} while(t->seq != seq);
+	return 1;
+}
+
+static inline int x10shmRead(X10ShmTablePtr_t t, int house, int unit, X10ShmEntryPtr_t e)
+{
+	uint32_t seq;
+
+	if((house < 0) || (house > 15) || (unit < 0) || (unit > 15))
+		return 0;
+	do{
+		while((seq = t->seq) & 1);
+		__sync_synchronize();
+		memcpy(e, (const void *) &t->entry[house][unit], sizeof(X10ShmEntry_t));
+		__sync_synchronize();
+	} while(t->seq != seq);
+	return 1;
+}
+
+#endif
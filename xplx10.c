@@ -39,6 +39,10 @@
 #include <getopt.h>
 #include <limits.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <xPL.h>
@@ -46,19 +50,48 @@
 #include "notify.h"
 #include "confread.h"
 #include "x10.h"
-
-#define MALLOC_ERROR	malloc_error(__FILE__,__LINE__)
+#include "devstate.h"
+#include "devreg.h"
+#include "plan.h"
+#include "scene.h"
+#include "txq.h"
+#include "verify.h"
+#include "refresh.h"
+#include "discover.h"
+#include "timer.h"
+#include "occupancy.h"
+#include "schedule.h"
+#include "rules.h"
+#include "localapi.h"
+#include "history.h"
+#include "histscan.h"
+#include "usage.h"
+#include "journal.h"
 
 #define SHORT_OPTIONS "c:d:f:hi:l:no:p:s:vy"
 
 #define WS_SIZE 256
 
+#ifndef STATEDIR
+#define STATEDIR		"/var/lib/xplx10"
+#endif
+
 #ifndef DEBUG
 #define DEF_PID_FILE		"/var/run/xplx10.pid"
 #define DEF_CONFIG_FILE		"/etc/xplx10.conf"
+#define DEF_DISCOVERY_FILE	STATEDIR "/discovery.conf"
+#define DEF_SCHEDULE_FILE	STATEDIR "/schedule.conf"
+#define DEF_USAGE_FILE		STATEDIR "/usage.conf"
+#define DEF_STATE_FILE		STATEDIR "/state.snapshot"
+#define DEF_JOURNAL_FILE	STATEDIR "/txq.journal"
 #else
 #define DEF_CONFIG_FILE		"./xplx10.conf"
 #define DEF_PID_FILE		"./xplx10.pid"
+#define DEF_DISCOVERY_FILE	"./xplx10.discovery"
+#define DEF_SCHEDULE_FILE	"./xplx10.schedule"
+#define DEF_USAGE_FILE		"./xplx10.usage"
+#define DEF_STATE_FILE		"./xplx10.state"
+#define DEF_JOURNAL_FILE	"./xplx10.journal"
 #endif
 
 #define	DEF_TTY				"/dev/ttyS0"
@@ -68,6 +101,28 @@
 
 #define DEF_HOUSE_LETTER	'A'
 
+#define SCHEMA_SLOTS		16
+
+#define COMMAND_INVALID		0x100
+
+#define X10_MAX_BLOCKS		32
+
+/* How long the main loop waits for xPL messages when there is nothing to send */
+#define TX_IDLE_POLL_MS		50
+
+/* Default queued powerline time above which new commands are refused, in seconds */
+#define DEF_QUEUE_BUDGET	30
+
+/* Default time allowed to send what is queued when asked to stop, in seconds */
+#define DEF_DRAIN_TIMEOUT	10
+
+/* Environment variable naming the handoff file, set for the new binary on an upgrade */
+#define HANDOFF_ENV		"XPLX10_HANDOFF"
+
+/* Most events returned for an x10.request request=history, one status message each */
+#define HISTORY_MAX_REPLY	50
+#define HISTORY_DEF_COUNT	10
+
  
 typedef struct cloverrides {
 	unsigned pid_file : 1;
@@ -78,31 +133,35 @@ typedef struct cloverrides {
 	unsigned tty : 1;
 } clOverride_t;
 
+typedef struct schemaent SchemaEntry_t;
+typedef SchemaEntry_t * SchemaEntryPtr_t;
+typedef struct cancelmatch CancelMatch_t;
+typedef CancelMatch_t * CancelMatchPtr_t;
 
-char *progName;
-int debugLvl = 0; 
+/* Entry for a supported xPL schema */
+
+struct schemaent {
+	const String class;
+	const String type;
+	void (*handler)(xPL_MessagePtr theMessage);
+	uint32_t hash;
+	unsigned count;
+	unsigned ttl;			/* Default command time to live in seconds, 0 for none */
+};
+
+/* What an x10.cancel command matches. Fields not set match anything */
 
-enum {CMD_SEL = 0, CMD_AUO, CMD_ALO, CMD_ALF, CMD_ON, CMD_OFF, CMD_DIM, CMD_BRI, CMD_EXT, CMD_HRQ, CMD_PD1, CMD_PD2, CMD_STS};
-
-static const char *X10_commands[14] =
-{
-	"select",
-	"all_units_off",
-	"all_lights_on",
-	"all_lights_off",
-	"on",
-	"off",
-	"dim",
-	"bright",
-	"extended",
-	"hail_req",
-	"predim1",
-	"predim2",
-	"status",
-	NULL
+struct cancelmatch {
+	String id;
+	String source;
+	Bool useAddrs;
+	X10Addrs_t addrs;
 };
 
 
+char *progName;
+int debugLvl = 0; 
+
 static Bool noBackground = FALSE;
 static Bool dryRun = FALSE;
 
@@ -111,6 +170,7 @@ static clOverride_t clOverride = {0,0,0,0};
 static xPL_ServicePtr xplx10Service = NULL;
 static xPL_MessagePtr xplx10TriggerMessage = NULL;
 static xPL_MessagePtr xplx10ConfirmMessage = NULL;
+static xPL_MessagePtr xplx10StatusMessage = NULL;
 static ConfigEntryPtr_t	configEntry = NULL;
 
 static char configFile[WS_SIZE] = DEF_CONFIG_FILE;
@@ -119,8 +179,58 @@ static char logPath[WS_SIZE] = "";
 static char tty[WS_SIZE] = DEF_TTY;
 static char instanceID[WS_SIZE] = DEF_INSTANCE_ID;
 static char pidFile[WS_SIZE] = DEF_PID_FILE;
+static char discoveryFile[WS_SIZE] = DEF_DISCOVERY_FILE;
+static char scheduleFile[WS_SIZE] = DEF_SCHEDULE_FILE;
+static char usageFile[WS_SIZE] = DEF_USAGE_FILE;
+static char stateFile[WS_SIZE] = DEF_STATE_FILE;
+static char journalFile[WS_SIZE] = DEF_JOURNAL_FILE; /* Transmit queue journal, empty for none */
+static char localSocket[WS_SIZE] = ""; /* Local command socket path, empty for none */
+static char shmName[WS_SIZE] = ""; /* Shared memory device state table, empty for none */
+static char historyDir[WS_SIZE] = ""; /* Event history directory, empty for none */
 static char defaultHouseLetter = DEF_HOUSE_LETTER;
 static X10 *myX10 = NULL;
+static int lastHouse = -1; /* House the powerline is left addressed with once the queue drains */
+static volatile sig_atomic_t reloadPending = 0;
+static volatile sig_atomic_t shutdownPending = 0; /* Count of SIGTERM and SIGINT signals */
+static volatile sig_atomic_t upgradePending = 0;
+static time_t upgradeDeadline = 0;
+static char exePath[PATH_MAX] = ""; /* Binary exec()ed on an upgrade */
+static char startDir[PATH_MAX] = ""; /* Where we were started, relative config paths are from here */
+static char **savedArgv = NULL;
+static ConfigEntryPtr_t handoffEntry = NULL; /* State passed on by the process we replaced, if any */
+static Bool upgraded = FALSE; /* We were exec()ed by an upgrade, so are already a daemon */
+static unsigned drainTimeout = DEF_DRAIN_TIMEOUT;
+static time_t drainDeadline = 0;
+static unsigned queueBudgetMs = DEF_QUEUE_BUDGET * 1000;
+static Bool queueBusy = FALSE; /* Backlog was over budget at the last tick */
+static Bool verifyDefault = FALSE; /* Verify commands to two-way devices unless told otherwise */
+static unsigned busyCount = 0;
+
+static void processX10BasicCommand(xPL_MessagePtr theMessage);
+static void processX10RequestCommand(xPL_MessagePtr theMessage);
+static void processX10CancelCommand(xPL_MessagePtr theMessage);
+static void processControlBasicCommand(xPL_MessagePtr theMessage);
+static void processSensorRequestCommand(xPL_MessagePtr theMessage);
+static void confDefErrorHandler(int etype, int linenum, String info);
+static SchemaEntryPtr_t schemaLookup(const String class, const String type);
+
+/*
+ * Schema dispatch table
+ *
+ * Entries are indexed by a hash of class.type which is computed once at start up.
+ */
+
+static SchemaEntry_t schemaTable[] = {
+	{"x10", "basic", processX10BasicCommand, 0, 0, 0},
+	{"x10", "request", processX10RequestCommand, 0, 0, 0},
+	{"x10", "cancel", processX10CancelCommand, 0, 0, 0},
+	{"control", "basic", processControlBasicCommand, 0, 0, 0},
+	{"sensor", "request", processSensorRequestCommand, 0, 0, 0},
+	{NULL, NULL, NULL, 0, 0, 0}
+};
+
+static SchemaEntryPtr_t schemaSlots[SCHEMA_SLOTS];
+static unsigned unsupportedSchemaCount = 0;
 
 
 /* Commandline options. */
@@ -142,56 +252,6 @@ static struct option longOptions[] = {
 };
 
 
-/*
- * Malloc error handler
- */
- 
-static void malloc_error(String file, int line)
-{
-	fatal("Out of memory in file %s, at line %d");
-}
-
-
-
-/*
-* Duplicate or split a string. 
-*
-* The string is copied, and the sep characters are replaced with nul's and a list pointers
-* is built. 
-* 
-* If no sep characters are found, the string is just duped and returned.
-*
-* This function returns the number of arguments found.
-*
-* When the caller is finished with the list and the return value is non-zero he should free() the first entry.
-* 
-*
-*/
-
-static int dupOrSplitString(const String src, String *list, char sep, int limit)
-{
-		String p, q, srcCopy;
-		int i;
-		
-
-		if((!src) || (!list) || (!limit))
-			return 0;
-
-		if(!(srcCopy = strdup(src)))
-			MALLOC_ERROR;
-
-		for(i = 0, q = srcCopy; (i < limit) && (p = strchr(q, sep)); i++, q = p + 1){
-			*p = 0;
-			list[i] = q;
-		
-		}
-
-		list[i] = q;
-		i++;
-
-		return i;
-}
-
 /* 
  * Get the pid from a pidfile.  Returns the pid or -1 if it couldn't get the
  * pid (either not there, stale, or not accesible).
@@ -258,12 +318,35 @@ static int pid_write(char *filename, pid_t pid) {
 
 
 /*
-* When the user hits ^C, logically shutdown
+* Logically shutdown
 * (including telling the network the service is ending)
+*
+* Commands still queued are left in the journal to be sent at the next
+* start. Without a journal they are cancelled, so their senders get a confirm.
 */
 
-static void shutdownHandler(int onSignal)
+static Bool matchAll(TxJobPtr_t job, void *arg)
 {
+	return TRUE;
+}
+
+static void finishShutdown(void)
+{
+	unsigned left = txqPending();
+
+	if((left) && (journalEnabled()))
+		debug(DEBUG_STATUS, "%u queued commands left in the journal for the next start", journalLive());
+	else if(left)
+		debug(DEBUG_UNEXPECTED, "%u queued commands cancelled", txqCancel(matchAll, NULL));
+
+	/* Save any scheduled actions added since the last tick, the usage statistics and the device state */
+	scheduleTick();
+	usageSave();
+	devstateSave();
+	journalClose();
+	localapiShutdown();
+	devstateUnpublish();
+	historyClose();
 	xPL_setServiceEnabled(xplx10Service, FALSE);
 	xPL_releaseService(xplx10Service);
 	xPL_shutdown();
@@ -274,208 +357,2042 @@ static void shutdownHandler(int onSignal)
 }
 
 
+/*
+* When the user hits ^C or we get a SIGTERM, note that we need to stop.
+* The queue is drained from the main loop. A second signal stops at once.
+*/
+
+static void shutdownHandler(int onSignal)
+{
+	shutdownPending++;
+}
+
+
+/*
+ * Carry on sending after a shutdown signal until the queue drains or the drain timeout runs out
+ *
+ * Commands which arrive meanwhile are queued and journaled as usual.
+ */
+
+static void checkShutdown(void)
+{
+	time_t now = time(NULL);
+
+	if(!drainDeadline){
+		drainDeadline = now + drainTimeout;
+		if((drainTimeout) && (!txqEmpty()))
+			debug(DEBUG_STATUS, "Stopping once %u queued commands are sent, at most %u seconds", txqPending(), drainTimeout);
+	}
+	if((drainTimeout) && (shutdownPending == 1) && (!txqEmpty()) && (now < drainDeadline))
+		return;
+	finishShutdown();
+}
+
+
+/*
+* On SIGHUP, note that the config file needs to be reloaded.
+* The reload is done from the tick handler.
+*/
+
+static void reloadHandler(int onSignal)
+{
+	reloadPending = 1;
+}
+
+
+/*
+* On SIGUSR2, note that we should upgrade to the binary we were started from.
+* The upgrade is done from the main loop.
+*/
+
+static void upgradeHandler(int onSignal)
+{
+	upgradePending = 1;
+}
+
+
+/*
+ * Save what the new binary needs to carry on, and exec it
+ *
+ * The queue goes across in the journal, the device state in the
+ * snapshot and the pending scheduled actions in the schedule file, as
+ * for a restart. The handoff file adds the tty fd, which is left open
+ * across the exec so the CM11A is not disturbed, the addresses it has
+ * sent without a function yet, and the running occupancy timers. The
+ * xPL service is not ended, the new process just takes it over.
+ * Everything else we have open is closed by the exec.
+ */
+
+static void execUpgrade(void)
+{
+	char path[WS_SIZE + 16];
+	char phase[64];
+	struct timeval now;
+	FILE *file;
+	int fd, maxFd, ttyFd = x10_fd(myX10);
+	Bool written;
+	DIR *dir;
+	struct dirent *de;
+
+	if((strchr(exePath, '/')) && (access(exePath, X_OK))){
+		error("Upgrade not possible, can't execute %s", exePath);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s.handoff", pidFile);
+	if(!(file = fopen(path, "w"))){
+		error("Upgrade not possible, can't write %s", path);
+		return;
+	}
+	gettimeofday(&now, NULL);
+	fprintf(file, "[handoff]\n");
+	fprintf(file, "saved = %ld.%06ld\n", (long) now.tv_sec, (long) now.tv_usec);
+	fprintf(file, "tty-fd = %d\n", ttyFd);
+	if(!x10_get_phase(myX10, phase, sizeof(phase)))
+		fprintf(file, "x10-phase = %s\n", phase);
+	fprintf(file, "last-house = %d\n", lastHouse);
+	occupancySaveTimers(file, "occupancy-timers");
+	written = ferror(file) ? FALSE : TRUE;
+	if((fclose(file)) || (!written)){
+		error("Upgrade not possible, can't write %s", path);
+		unlink(path);
+		return;
+	}
+
+	debug(DEBUG_STATUS, "Upgrading to %s", exePath);
+
+	/* Verifications aren't carried over, so send their confirms as they stand */
+	verifyAbandon();
+
+	/* Without a journal what is left can't go across, so tell the senders */
+	if((!journalEnabled()) && (txqPending()))
+		debug(DEBUG_UNEXPECTED, "%u queued commands cancelled for the upgrade", txqCancel(matchAll, NULL));
+	scheduleTick();
+	usageSave();
+	devstateSave();
+	journalClose();
+	localapiShutdown();
+	historyClose();
+
+	/* Only visit the fds which are open. The fd limit can be huge */
+	if((dir = opendir("/proc/self/fd"))){
+		while((de = readdir(dir))){
+			if((isdigit((unsigned char) de->d_name[0])) && ((fd = atoi(de->d_name)) > 2) && (fd != dirfd(dir)))
+				(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		closedir(dir);
+	}
+	else{
+		maxFd = (int) sysconf(_SC_OPEN_MAX);
+		for(fd = 3; fd < maxFd; fd++)
+			(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	if(ttyFd >= 0)
+		(void) fcntl(ttyFd, F_SETFD, 0);
+	setenv(HANDOFF_ENV, path, 1);
+
+	/* The new binary reads the config file afresh, so give it the same start for relative paths */
+	if((startDir[0]) && (chdir(startDir)))
+		debug(DEBUG_UNEXPECTED, "Could not change to %s for the upgrade", startDir);
+	execvp(exePath, savedArgv);
+
+	/* Too late to carry on. What we saved is picked up by a normal start */
+	unlink(path);
+	(void) unlink(pidFile);
+	fatal_with_reason(errno, "exec of %s for upgrade", exePath);
+}
+
+
+/*
+ * Upgrade once it is safe to
+ *
+ * The journal only records how far a job has got where it can be
+ * carried on from, so we wait for one of those rather than leave the
+ * new process to resend a function to the wrong addresses. Without a
+ * journal the queue would be lost, so we wait for it to drain, for up
+ * to the drain timeout. Held confirms are waited for the same way.
+ */
+
+static void checkUpgrade(void)
+{
+	time_t now = time(NULL);
+
+	if(!upgradeDeadline)
+		upgradeDeadline = now + drainTimeout;
+	if(!txqResumable(txqCurrent()))
+		return;
+	if((!verifyIdle()) && (now < upgradeDeadline))
+		return;
+	if((!journalEnabled()) && (!txqEmpty()) && (now < upgradeDeadline))
+		return;
+	upgradePending = 0;
+	upgradeDeadline = 0;
+	execUpgrade();
+}
+
+/*
+ * Make a relative path absolute, in place
+ *
+ * Anything we open after going into the background is opened from /, so
+ * paths are fixed up against the directory we were started in. An empty
+ * path, a feature turned off, is left alone. Returns FALSE if the path
+ * was not changed.
+ */
+
+static Bool absolutePath(String path, size_t size)
+{
+	char abs[PATH_MAX + WS_SIZE];
+
+	if((!path[0]) || (path[0] == '/') || (!getcwd(abs, PATH_MAX)) || (strlen(abs) + strlen(path) + 2 > size))
+		return FALSE;
+	strcat(abs, "/");
+	strcat(abs, path);
+	confreadStringCopy(path, abs, size);
+	return TRUE;
+}
+
+/*
+ * Make a path given on the command line absolute
+ *
+ * The argument in argv is rewritten too, so an upgrade passes the new
+ * binary the same paths although we have changed to / by then. slot is
+ * the argv entry the option value came from, value where in it the path
+ * starts, so -cfile and --config-file=file keep their form.
+ */
+
+static void absolutePathArg(char **slot, const char *value, String path, size_t size)
+{
+	size_t prefix = value - *slot;
+	char *arg;
+
+	if(!absolutePath(path, size))
+		return;
+	if((value < *slot) || (value > *slot + strlen(*slot)))
+		return;
+	if(!(arg = malloc(prefix + strlen(path) + 1)))
+		fatal("Out of memory in absolutePathArg()");
+	memcpy(arg, *slot, prefix);
+	strcpy(arg + prefix, path);
+	*slot = arg;
+}
+
+/*
+ * Pick up the handoff file left by the process which exec()ed us for an upgrade
+ *
+ * Returns NULL if we were started normally.
+ */
+
+static ConfigEntryPtr_t readHandoff(void)
+{
+	char path[WS_SIZE + 16];
+	ConfigEntryPtr_t ce;
+
+	if(!getenv(HANDOFF_ENV))
+		return NULL;
+	upgraded = TRUE;
+	confreadStringCopy(path, getenv(HANDOFF_ENV), sizeof(path));
+	unsetenv(HANDOFF_ENV);
+	ce = confreadScan(path, confDefErrorHandler);
+	unlink(path);
+	if(!ce)
+		debug(DEBUG_UNEXPECTED, "Handoff file %s missing, starting afresh", path);
+	return ce;
+}
+
+/*
+ * Load the device registry, compile the scenes, rules, occupancy rules and daily schedule, and load the queue settings from the config file
+ */
+
+static void loadConfigTables(void)
+{
+	int i;
+	char key[WS_SIZE];
+	String p;
+
+	if(!configEntry)
+		return;
+	debug(DEBUG_STATUS, "%u devices registered", devregLoad(configEntry));
+	debug(DEBUG_STATUS, "%u scenes compiled", sceneLoad(configEntry, toupper(defaultHouseLetter) - 'A'));
+	debug(DEBUG_STATUS, "%u rules compiled", rulesLoad(configEntry, toupper(defaultHouseLetter) - 'A'));
+	debug(DEBUG_STATUS, "%u occupancy rules loaded", occupancyLoad(configEntry, toupper(defaultHouseLetter) - 'A'));
+	debug(DEBUG_STATUS, "%u daily actions scheduled", scheduleLoad(configEntry, toupper(defaultHouseLetter) - 'A'));
+	txqLoadWeights(configEntry);
+
+	/* Per-schema default time to live, keyed by class.type */
+	for(i = 0; schemaTable[i].class; i++){
+		snprintf(key, sizeof(key), "%s.%s", schemaTable[i].class, schemaTable[i].type);
+		p = confreadValueBySectKey(configEntry, "ttl", key);
+		schemaTable[i].ttl = (p && (atoi(p) > 0)) ? (unsigned) atoi(p) : 0;
+	}
+}
+
+
 /*
  * Send X10 command
  */
  
 
-static void sendX10Command(void *buf, size_t count)
+static Bool sendX10Command(void *buf, size_t count)
 {
 	debug_hexdump(DEBUG_EXPECTED, buf, count, "X10 transmit packet: ");
 	if(!dryRun){
-		if(!x10_write_message(myX10, buf, count))
+		if(!x10_write_message(myX10, buf, count)){
 			debug(DEBUG_UNEXPECTED, "X10 transmission error");
+			return FALSE;
+		}
+	}
+	else
+		debug(DEBUG_EXPECTED, "X10 transmission disabled (dry-run)");		
+	return TRUE;
+}
+
+/*
+ * Send one frame for the transmit queue
+ *
+ * Returns the number of retries the CM11A needed.
+ */
+
+static Bool sendQueuedFrame(X10FramePtr_t f, unsigned *retries)
+{
+	Bool res = sendX10Command(f->pkt, f->len);
+	TxJobPtr_t job = txqCurrent();
+
+	if((!dryRun) && (x10_try_count(myX10) > 1))
+		*retries = x10_try_count(myX10) - 1;
+	if(!res)
+		return FALSE;
+	/* Track what we told the devices to do */
+	if(f->function != PLAN_FUNC_NONE){
+		devstateApply(f->house, f->unitmask, f->function, f->level);
+		historyAppend(TRUE, f->house, f->unitmask, f->function, f->level, job ? job->source->name : NULL);
+	}
+	return TRUE;
+}
+
+/*
+ * Get the source name of a message as vendor-device.instance
+ */
+
+static void messageSource(xPL_MessagePtr theMessage, String source, size_t size)
+{
+	snprintf(source, size, "%s-%s.%s", xPL_getSourceVendor(theMessage),
+	xPL_getSourceDeviceID(theMessage), xPL_getSourceInstanceID(theMessage));
+}
+
+/*
+ * Work out the time to live for a plan
+ *
+ * A ttl n/v in the message wins, then the shortest default of the
+ * registered devices in the plan, then the default for the schema.
+ * Returns seconds, or 0 for none.
+ */
+
+static unsigned planTTL(xPL_MessagePtr theMessage, X10PlanPtr_t plan)
+{
+	unsigned i, ttl;
+	int unit;
+	uint16_t units[16];
+	String value;
+	DevEntryPtr_t de;
+	SchemaEntryPtr_t se;
+
+	if(!theMessage)
+		return 0;
+	if((value = xPL_getMessageNamedValue(theMessage, "ttl")))
+		return (atoi(value) > 0) ? (unsigned) atoi(value) : 0;
+
+	memset(units, 0, sizeof(units));
+	for(i = 0; i < plan->count; i++)
+		units[plan->frame[i].house] |= plan->frame[i].unitmask;
+	for(i = ttl = 0; i < 16; i++){
+		for(unit = 0; (units[i]) && (unit < 16); unit++){
+			if((units[i] & (1 << unit)) && (de = devregByAddress(i, unit)) && (de->ttl) && ((!ttl) || (de->ttl < ttl)))
+				ttl = de->ttl;
+		}
+	}
+	if(ttl)
+		return ttl;
+
+	if((se = schemaLookup(xPL_getSchemaClass(theMessage), xPL_getSchemaType(theMessage))))
+		return se->ttl;
+	return 0;
+}
+
+/*
+ * Queue every frame in a plan on behalf of the sender of a message
+ *
+ * theMessage is NULL for commands the daemon makes itself.
+ * done is called with the job when the last frame has been sent, and may be NULL.
+ * Jobs which have not started before their time to live runs out are dropped.
+ */
+
+static TxJobPtr_t queueX10Plan(xPL_MessagePtr theMessage, X10PlanPtr_t plan, void (*done)(TxJobPtr_t job))
+{
+	char source[WS_SIZE];
+	TxJobPtr_t job;
+
+	lastHouse = planLastHouse(plan, lastHouse);
+	if(!theMessage)
+		return txqSubmit(NULL, plan, done);
+	messageSource(theMessage, source, sizeof(source));
+	job = txqSubmit(source, plan, done);
+	txqSetTTL(job, planTTL(theMessage, plan));
+	journalAdd(job, done ? JOURNAL_XPL : JOURNAL_INTERNAL);
+	if(done)
+		txqAddNV(job, "verify", xPL_getMessageNamedValue(theMessage, "verify"));
+	return job;
+}
+
+/*
+ * Send the confirm for a completed command
+ *
+ * The name/values attached when the command was queued are echoed along
+ * with the result, the retries the CM11A needed, the time spent waiting
+ * in the queue and the time spent on the powerline. If the two-way
+ * devices were checked, v has the outcome, otherwise it is NULL.
+ */
+
+static void sendConfirm(TxNVPtr_t nv, unsigned nvCount, int result, unsigned retries, unsigned waitMs, unsigned txMs, VerifyPtr_t v)
+{
+	unsigned i;
+	int pos;
+	char ws[WS_SIZE];
+
+	xPL_clearMessageNamedValues(xplx10ConfirmMessage);
+	for(i = 0; i < nvCount; i++)
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, nv[i].name, nv[i].value);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "result", txqResultName(result));
+	snprintf(ws, sizeof(ws), "%u", retries);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "retries", ws);
+	snprintf(ws, sizeof(ws), "%u", waitMs);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "queue-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", txMs);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "tx-ms", ws);
+	if(v){
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "verified", verifyAllVerified(v) ? "yes" : "no");
+		for(i = 0, pos = 0, ws[0] = 0; (i < v->count) && (pos < WS_SIZE - 8); i++){
+			if(v->target[i].state != VT_VERIFIED)
+				pos += snprintf(ws + pos, WS_SIZE - pos, "%s%c%u", pos ? "," : "", 'A' + v->target[i].house, v->target[i].unit + 1);
+		}
+		if(pos)
+			xPL_setMessageNamedValue(xplx10ConfirmMessage, "unverified", ws);
+	}
+	if(!xPL_sendMessage(xplx10ConfirmMessage))
+		debug(DEBUG_UNEXPECTED, "Command complete confirm message transmission failed");		
+}
+
+/*
+ * Send the confirm for a command once its two-way devices have been checked
+ */
+
+static void sendVerifiedConfirm(VerifyPtr_t v)
+{
+	sendConfirm(v->nv, v->nvCount, v->result, v->retries, v->waitMs, v->txMs, v);
+}
+
+/*
+ * Send the confirm for a completed job
+ *
+ * If verification is on for the command and it switched any two-way
+ * devices, the confirm is held until they have been checked.
+ */
+
+static void sendJobConfirm(TxJobPtr_t job)
+{
+	Bool verify = verifyDefault;
+	const String value = txqGetNV(job, "verify");
+
+	if(value)
+		verify = strcmp(value, "no") ? TRUE : FALSE;
+	if((verify) && (job->result == TXQ_OK) && (verifyStart(job, sendVerifiedConfirm)))
+		return;
+	sendConfirm(job->nv, job->nvCount, job->result, job->retries, txqWaitMs(job), txqTxMs(job), NULL);
+}
+
+/*
+ * Send a confirm for a command which was rejected before being queued
+ */
+
+static void sendRejectConfirm(xPL_MessagePtr theMessage, const String command, const String reason)
+{
+	const String id = xPL_getMessageNamedValue(theMessage, "id");
+
+	xPL_clearMessageNamedValues(xplx10ConfirmMessage);
+	if(id)
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "id", id);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "command", command ? command : "none");
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "result", txqResultName(TXQ_FAILED));
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "error", reason);
+	if(!xPL_sendMessage(xplx10ConfirmMessage))
+		debug(DEBUG_UNEXPECTED, "Reject confirm message transmission failed");		
+}
+
+/*
+ * Admission control
+ *
+ * Returns TRUE if a plan fits in the queued powerline time budget. An
+ * empty queue always accepts, so one plan bigger than the budget can
+ * still be sent. If the plan is refused and there is a message to
+ * answer, a busy confirm is sent with the expected wait before the plan
+ * would fit.
+ */
+
+static Bool admitPlan(xPL_MessagePtr theMessage, const String command, X10PlanPtr_t plan)
+{
+	char ws[WS_SIZE];
+	String id;
+	unsigned backlog = txqBacklogMs();
+	unsigned cost = planTime(plan);
+
+	if((!queueBudgetMs) || (!backlog) || (backlog + cost <= queueBudgetMs))
+		return TRUE;
+
+	busyCount++;
+	debug(DEBUG_EXPECTED, "Queue busy: backlog %u ms, command needs %u ms", backlog, cost);
+	if(!theMessage)
+		return FALSE;
+
+	xPL_clearMessageNamedValues(xplx10ConfirmMessage);
+	if((id = xPL_getMessageNamedValue(theMessage, "id")))
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "id", id);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "command", command);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "result", "busy");
+	snprintf(ws, sizeof(ws), "%u", backlog + cost - queueBudgetMs);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "wait-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", backlog);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "backlog-ms", ws);
+	if(!xPL_sendMessage(xplx10ConfirmMessage))
+		debug(DEBUG_UNEXPECTED, "Busy confirm message transmission failed");		
+	return FALSE;
+}
+
+/*
+ * Send the transmit queue backlog as an x10.status message
+ */
+
+static void sendBacklogStatus(void)
+{
+	char ws[WS_SIZE];
+	unsigned expired;
+	unsigned long expiredMs;
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "backlog");
+	xPL_setMessageNamedValue(xplx10StatusMessage, "state", queueBusy ? "busy" : "ready");
+	snprintf(ws, sizeof(ws), "%u", txqBacklogMs());
+	xPL_setMessageNamedValue(xplx10StatusMessage, "backlog-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", queueBudgetMs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "budget-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", busyCount);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "refused", ws);
+	txqExpiryStats(&expired, &expiredMs);
+	snprintf(ws, sizeof(ws), "%u", expired);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "expired", ws);
+	snprintf(ws, sizeof(ws), "%lu", expiredMs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "expired-ms", ws);
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Backlog status message transmission failed");
+}
+
+/*
+ * Append addressing the units in a unit mask in one house, then a function to them, to a plan
+ *
+ * Level is in percent. Bit 0 of the unit mask is unit 1.
+ */
+
+static void addX10Function(X10PlanPtr_t plan, int house, unsigned unitMask, unsigned function, int level)
+{
+	X10Addrs_t addrs;
+
+	memset(&addrs, 0, sizeof(addrs));
+	addrs.houses = 1 << house;
+	addrs.units[house] = unitMask;
+	planAddFunction(plan, &addrs, function, level, 0, 0, (lastHouse < 0) ? house : lastHouse);
+}
+
+/*
+ * Queue a plan built with addX10Function() if it fits in the budget
+ */
+
+static void sendX10Plan(xPL_MessagePtr theMessage, X10PlanPtr_t plan)
+{
+	if(admitPlan(NULL, NULL, plan))
+		queueX10Plan(theMessage, plan, NULL);
+	else
+		debug(DEBUG_UNEXPECTED, "%s.%s command refused, queue busy", xPL_getSchemaClass(theMessage),
+		xPL_getSchemaType(theMessage));
+}
+
+/*
+ * Address the units in a unit mask in one house, then queue a function to them
+ *
+ * Level is in percent. Bit 0 of the unit mask is unit 1.
+ */
+
+static void sendX10Function(xPL_MessagePtr theMessage, int house, unsigned unitMask, unsigned function, int level)
+{
+	static X10Plan_t plan;
+
+	planInit(&plan);
+	addX10Function(&plan, house, unitMask, function, level);
+	sendX10Plan(theMessage, &plan);
+}
+
+/*
+ * Parse an X10 address of the form A1 through P16, or the name of a registered device
+ *
+ * Returns TRUE with the house index (0-15) and unit index (0-15) if it is valid
+ */
+
+static Bool parseX10Address(const String addr, int *house, int *unit)
+{
+	String end;
+	long u;
+	unsigned char hc;
+	DevEntryPtr_t de;
+
+	if((!addr) || (!house) || (!unit))
+		return FALSE;
+	if(!x10_letter_to_housecode(addr[0], &hc)){
+		u = strtol(addr + 1, &end, 10);
+		if((end != addr + 1) && (!*end) && (u >= 1) && (u <= 16)){
+			*house = toupper(addr[0]) - 'A';
+			*unit = (int) u - 1;
+			return TRUE;
+		}
+	}
+	if(!(de = devregFind(addr, strlen(addr))))
+		return FALSE;
+	*house = de->house;
+	*unit = de->unit;
+	return TRUE;
+}
+
+/*
+ * Get the default house for a message from its house n/v, or the configured default house
+ *
+ * Returns the house index or -1 if the house n/v is bad
+ */
+
+static int messageHouse(xPL_MessagePtr theMessage)
+{
+	unsigned char hc;
+	const String houseList = xPL_getMessageNamedValue(theMessage, "house");
+
+	if(houseList){ /* If house letter overridden */
+		if(strlen(houseList) != 1 || x10_letter_to_housecode(houseList[0], &hc)){
+			debug(DEBUG_UNEXPECTED, "Bad house code %s", houseList);
+			return -1;
+		}
+		return toupper(houseList[0]) - 'A';
+	}
+	debug(DEBUG_EXPECTED,"Using default house letter: %c", defaultHouseLetter);
+	return toupper(defaultHouseLetter) - 'A';
+}
+
+
+/*
+* Our Listener 
+*/
+
+/*
+ * Parse one command block of an x10.basic message
+ *
+ * The suffix is appended to the n/v names: "" for a single command, or
+ * "1", "2" and so on for the blocks of a batch. Each block may have its
+ * own house n/v, otherwise the message default house is used.
+ *
+ * An unknown command is returned as COMMAND_INVALID.
+ * Returns FALSE if the block is missing something or out of bounds.
+ */
+
+static Bool parseCommandBlock(xPL_MessagePtr theMessage, const String suffix, int defaultHouse,
+X10AddrsPtr_t addrs, unsigned *function, int *lvl, int *d1, int *d2)
+{
+	char name[WS_SIZE];
+	unsigned char hc;
+	int house = defaultHouse;
+	String command, deviceList, houseList, level, data1, data2;
+
+	snprintf(name, sizeof(name), "command%s", suffix);
+	command = xPL_getMessageNamedValue(theMessage, name);
+	snprintf(name, sizeof(name), "device%s", suffix);
+	deviceList = xPL_getMessageNamedValue(theMessage, name);
+	snprintf(name, sizeof(name), "house%s", suffix);
+	houseList = *suffix ? xPL_getMessageNamedValue(theMessage, name) : NULL;
+	snprintf(name, sizeof(name), "level%s", suffix);
+	level = xPL_getMessageNamedValue(theMessage, name);
+	snprintf(name, sizeof(name), "data1%s", suffix);
+	data1 = xPL_getMessageNamedValue(theMessage, name);
+	snprintf(name, sizeof(name), "data2%s", suffix);
+	data2 = xPL_getMessageNamedValue(theMessage, name);
+
+	if(!command){
+		debug(DEBUG_UNEXPECTED, "No command%s passed in", suffix);
+		return FALSE;
+	}
+
+	if(houseList){
+		if(strlen(houseList) != 1 || x10_letter_to_housecode(houseList[0], &hc)){
+			debug(DEBUG_UNEXPECTED, "Bad house code %s", houseList);
+			return FALSE;
+		}
+		house = toupper(houseList[0]) - 'A';
+	}
+
+	if(!deviceList){
+		debug(DEBUG_UNEXPECTED, "Device list%s not present", suffix);
+		return FALSE;
+	}
+	/* Parse the address list */
+	if(!planParseDevices(deviceList, house, addrs)){
+		debug(DEBUG_UNEXPECTED, "Bad device list: %s. Command aborted.", deviceList);
+		return FALSE;
+	}
+
+	debug(DEBUG_ACTION, "Received command: %s", command);
+	
+	/* Decode command */
+	if(!planCommandFunction(command, function))
+		*function = COMMAND_INVALID;
+    
+	/* Check the arguments the command needs */
+	*lvl = *d1 = *d2 = 0;
+	switch(*function){
+		case COMMAND_DIM: /* Dim */
+		case COMMAND_BRIGHT: /* Bright */
+			if(!level){
+				debug(DEBUG_UNEXPECTED, "No level n/v");
+				return FALSE;
+			}
+			*lvl = atoi(level);
+			if((*lvl < 0) || (*lvl > 100)){
+				debug(DEBUG_UNEXPECTED, "Dim/Bright level out of bounds");
+				return FALSE;
+			}
+			break;
+				
+		case COMMAND_EXTENDED_CODE: /* Extended */
+			if(!data1 || !data2){
+				debug(DEBUG_UNEXPECTED, "data1 or data2 n/v missing");
+				return FALSE;
+			}
+			*d1 = atoi(data1);
+			*d2 = atoi(data2);
+			if((*d1 < 0) || (*d1 > 255)){
+				debug(DEBUG_UNEXPECTED, "data1 out of bounds");
+				return FALSE;
+			}
+			if((*d2 < 0) || (*d2 > 255)){
+				debug(DEBUG_UNEXPECTED, "data2 out of bounds");
+				return FALSE;
+			}
+			break;
+
+		default:
+			break;
+	}
+	return TRUE;
+}
+
+/*
+ * Return TRUE if a message has more command blocks than a batch can hold
+ */
+
+static Bool tooManyBlocks(xPL_MessagePtr theMessage)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "command%d", X10_MAX_BLOCKS + 1);
+	if(!xPL_getMessageNamedValue(theMessage, name))
+		return FALSE;
+	debug(DEBUG_UNEXPECTED, "More than %d blocks in batch", X10_MAX_BLOCKS);
+	return TRUE;
+}
+
+/*
+ * Process a batch of command blocks in an x10.basic message
+ *
+ * The blocks (command1, device1, command2, device2...) are planned
+ * together as one transmission and answered with one confirm.
+ */
+
+static void processX10Batch(xPL_MessagePtr theMessage, int house)
+{
+	int i, blocks, lvl, d1, d2;
+	unsigned function;
+	char suffix[8];
+	char name[WS_SIZE];
+	X10Addrs_t addrs;
+	TxJobPtr_t job;
+	static X10Builder_t builder;
+	static X10Plan_t plan;
+
+	if(tooManyBlocks(theMessage)){
+		sendRejectConfirm(theMessage, "batch", "too many blocks");
+		return;
+	}
+	planBuilderInit(&builder);
+	for(blocks = 0; blocks < X10_MAX_BLOCKS; blocks++){
+		snprintf(suffix, sizeof(suffix), "%d", blocks + 1);
+		snprintf(name, sizeof(name), "command%s", suffix);
+		if(!xPL_getMessageNamedValue(theMessage, name))
+			break;
+		if(!parseCommandBlock(theMessage, suffix, house, &addrs, &function, &lvl, &d1, &d2)){
+			sendRejectConfirm(theMessage, "batch", "bad block");
+			return;
+		}
+		if(function == COMMAND_INVALID){
+			debug(DEBUG_UNEXPECTED, "Bad command in block %d. Batch aborted.", blocks + 1);
+			sendRejectConfirm(theMessage, "batch", "bad command");
+			return;
+		}
+		if(!planBuilderAdd(&builder, &addrs, function, lvl, d1, d2)){
+			debug(DEBUG_UNEXPECTED, "Too many functions in batch");
+			sendRejectConfirm(theMessage, "batch", "too many functions");
+			return;
+		}
+	}
+	debug(DEBUG_ACTION, "Batch of %d blocks merged into %u groups", blocks, builder.count);
+
+	planInit(&plan);
+	if(!planBuilderCompile(&builder, &plan, (lastHouse < 0) ? house : lastHouse)){
+		debug(DEBUG_UNEXPECTED, "Command plan overflow");
+		sendRejectConfirm(theMessage, "batch", "plan overflow");
+		return;
+	}
+
+	if(!admitPlan(theMessage, "batch", &plan))
+		return;
+
+	/* One confirm for the whole batch once it has been sent */
+	job = queueX10Plan(theMessage, &plan, sendJobConfirm);
+	txqAddNV(job, "id", xPL_getMessageNamedValue(theMessage, "id"));
+	txqAddNV(job, "command", "batch");
+	snprintf(suffix, sizeof(suffix), "%d", blocks);
+	txqAddNV(job, "blocks", suffix);
+	for(i = 1; i <= blocks; i++){
+		snprintf(name, sizeof(name), "command%d", i);
+		txqAddNV(job, name, xPL_getMessageNamedValue(theMessage, name));
+		snprintf(name, sizeof(name), "device%d", i);
+		txqAddNV(job, name, xPL_getMessageNamedValue(theMessage, name));
+	}
+}
+
+/*
+ * Carry out a scheduled action, called from the timer wheel
+ *
+ * One-shot actions get a confirm like the command they came from, with
+ * the schedule id added. Daily actions are sent as local jobs.
+ */
+
+static void runScheduled(SchedEntryPtr_t se)
+{
+	char ws[WS_SIZE];
+	TxNV_t nv[3];
+	unsigned nvCount = 0;
+	X10PlanPtr_t plan = NULL, compiled = NULL;
+	SceneEntryPtr_t sc;
+	TxJobPtr_t job;
+
+	snprintf(ws, sizeof(ws), "%u", se->id);
+	if(!strchr(se->action, ':')){
+		if((sc = sceneFind(se->action)))
+			plan = sc->plan;
+	}
+	else
+		plan = compiled = sceneCompile(se->name ? se->name : ws, se->action, se->house);
+
+	if(plan){
+		lastHouse = planLastHouse(plan, lastHouse);
+		job = txqSubmit(se->source, plan, se->id ? sendJobConfirm : NULL);
+		journalAdd(job, se->id ? JOURNAL_XPL : JOURNAL_INTERNAL);
+		free(compiled);
+		if(se->id){
+			txqAddNV(job, "id", se->reqId);
+			txqAddNV(job, "command", se->command);
+			txqAddNV(job, "schedule", ws);
+		}
+		return;
+	}
+
+	/* The scene or a device has gone since the action was scheduled */
+	debug(DEBUG_UNEXPECTED, "Scheduled action %s no longer valid: %s", se->name ? se->name : ws, se->action);
+	if(!se->id)
+		return;
+	if(se->reqId){
+		nv[nvCount].name = "id";
+		nv[nvCount++].value = se->reqId;
+	}
+	nv[nvCount].name = "command";
+	nv[nvCount++].value = se->command;
+	nv[nvCount].name = "schedule";
+	nv[nvCount++].value = ws;
+	sendConfirm(nv, nvCount, TXQ_FAILED, 0, 0, 0, NULL);
+}
+
+/*
+ * Queue a command again which was left in the journal at the last exit
+ *
+ * xPL commands get their confirm as usual once sent, or an expired
+ * confirm now if their time to live ran out while we were stopped.
+ * Local clients have gone, so their commands are sent without one.
+ * Commands without a time to live are dropped once they are older
+ * than JOURNAL_MAX_AGE.
+ */
+
+static void replayJournal(unsigned kind, const String source, X10PlanPtr_t plan, time_t queued, time_t deadline, TxNVPtr_t nv, unsigned nvCount)
+{
+	time_t now = time(NULL);
+	TxJobPtr_t job;
+	unsigned i;
+
+	if(((deadline) && (now >= deadline)) || ((!deadline) && (now - queued > JOURNAL_MAX_AGE))){
+		debug(DEBUG_EXPECTED, "Journaled command from %s expired while stopped", source);
+		if(kind == JOURNAL_XPL)
+			sendConfirm(nv, nvCount, TXQ_EXPIRED, 0, 0, 0, NULL);
+		return;
+	}
+	debug(DEBUG_ACTION, "Replaying journaled command from %s, %u frames", source, plan->count);
+	lastHouse = planLastHouse(plan, lastHouse);
+	job = txqSubmit(source, plan, (kind == JOURNAL_XPL) ? sendJobConfirm : NULL);
+	if(deadline)
+		txqSetTTL(job, deadline - now);
+	for(i = 0; i < nvCount; i++)
+		txqAddNV(job, nv[i].name, nv[i].value);
+	journalAdd(job, kind);
+}
+
+/*
+ * Add one command block to a scheduled action in [scenes] syntax
+ *
+ * The device list is written out in full so it means the same whatever
+ * the default house is when the action runs. Returns FALSE if it does not fit.
+ */
+
+static Bool formatAction(String buf, size_t size, X10AddrsPtr_t addrs, const String command,
+unsigned function, int lvl, int d1, int d2)
+{
+	size_t pos = strlen(buf);
+	int n;
+
+	if(pos && (pos + 1 < size))
+		buf[pos++] = '/';
+	if((pos >= size) || (!planFormatDevices(addrs, buf + pos, size - pos)))
+		return FALSE;
+	pos += strlen(buf + pos);
+	if((function == COMMAND_DIM) || (function == COMMAND_BRIGHT))
+		n = snprintf(buf + pos, size - pos, ":%s:%d", command, lvl);
+	else if(function == COMMAND_EXTENDED_CODE)
+		n = snprintf(buf + pos, size - pos, ":%s:%d:%d", command, d1, d2);
+	else
+		n = snprintf(buf + pos, size - pos, ":%s", command);
+	return ((n > 0) && ((size_t) n < size - pos)) ? TRUE : FALSE;
+}
+
+/*
+ * Process an x10.basic command with a delay= or at= n/v
+ *
+ * delay is in seconds, at is HH:MM or HH:MM:SS local time, the next
+ * time it comes round. The command is checked now and saved as an
+ * action, and the sender gets a confirm with result=scheduled and the
+ * schedule id, which x10.cancel accepts. The usual confirm follows when
+ * the command is sent.
+ */
+
+static void processX10Scheduled(xPL_MessagePtr theMessage, int house)
+{
+	int i, lvl, d1, d2, secs;
+	unsigned function;
+	time_t due;
+	char suffix[8];
+	char name[WS_SIZE];
+	char source[WS_SIZE];
+	char action[768];
+	X10Addrs_t addrs;
+	X10PlanPtr_t plan;
+	SchedEntryPtr_t se;
+	String command = xPL_getMessageNamedValue(theMessage, "command");
+	const String delay = xPL_getMessageNamedValue(theMessage, "delay");
+	const String at = xPL_getMessageNamedValue(theMessage, "at");
+	const String scene = xPL_getMessageNamedValue(theMessage, "scene");
+	const String id = xPL_getMessageNamedValue(theMessage, "id");
+
+	if((delay) && (at)){
+		sendRejectConfirm(theMessage, command, "both delay and at");
+		return;
+	}
+	if(delay){
+		if(atoi(delay) <= 0){
+			sendRejectConfirm(theMessage, command, "bad delay");
+			return;
+		}
+		due = time(NULL) + atoi(delay);
+	}
+	else{
+		if((secs = scheduleParseTime(at)) < 0){
+			sendRejectConfirm(theMessage, command, "bad time");
+			return;
+		}
+		due = scheduleNextTime(secs);
+	}
+
+	action[0] = 0;
+	if((command) && (!strcmp(command, "scene"))){
+		if(!sceneFind(scene)){
+			sendRejectConfirm(theMessage, command, "unknown scene");
+			return;
+		}
+		confreadStringCopy(action, scene, sizeof(action));
+	}
+	else if(command){
+		if(!parseCommandBlock(theMessage, "", house, &addrs, &function, &lvl, &d1, &d2)){
+			sendRejectConfirm(theMessage, command, "bad arguments");
+			return;
+		}
+		if(function == COMMAND_INVALID){
+			sendRejectConfirm(theMessage, command, "bad command");
+			return;
+		}
+		if(!formatAction(action, sizeof(action), &addrs, command, function, lvl, d1, d2)){
+			sendRejectConfirm(theMessage, command, "too long");
+			return;
+		}
+	}
+	else{
+		command = "batch";
+		if(tooManyBlocks(theMessage)){
+			sendRejectConfirm(theMessage, command, "too many blocks");
+			return;
+		}
+		for(i = 1; i <= X10_MAX_BLOCKS; i++){
+			snprintf(suffix, sizeof(suffix), "%d", i);
+			snprintf(name, sizeof(name), "command%s", suffix);
+			if(!xPL_getMessageNamedValue(theMessage, name))
+				break;
+			if((!parseCommandBlock(theMessage, suffix, house, &addrs, &function, &lvl, &d1, &d2)) ||
+			(function == COMMAND_INVALID)){
+				sendRejectConfirm(theMessage, command, "bad block");
+				return;
+			}
+			if(!formatAction(action, sizeof(action), &addrs, xPL_getMessageNamedValue(theMessage, name), function, lvl, d1, d2)){
+				sendRejectConfirm(theMessage, command, "too long");
+				return;
+			}
+		}
+		if(!action[0]){
+			sendRejectConfirm(theMessage, NULL, "no command");
+			return;
+		}
+	}
+
+	/* Make sure it will compile when the time comes */
+	if(strchr(action, ':')){
+		if(!(plan = sceneCompile(command, action, house))){
+			sendRejectConfirm(theMessage, command, "plan overflow");
+			return;
+		}
+		free(plan);
+	}
+
+	messageSource(theMessage, source, sizeof(source));
+	if(!(se = scheduleAdd(due, house, source, id, command, action))){
+		sendRejectConfirm(theMessage, command, "schedule full");
+		return;
+	}
+	debug(DEBUG_ACTION, "Scheduled action %u in %ld seconds: %s", se->id, (long) (due - time(NULL)), action);
+
+	xPL_clearMessageNamedValues(xplx10ConfirmMessage);
+	if(id)
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "id", id);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "command", command);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "result", "scheduled");
+	snprintf(name, sizeof(name), "%u", se->id);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "schedule", name);
+	snprintf(name, sizeof(name), "%ld", (long) due);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "due", name);
+	if(!xPL_sendMessage(xplx10ConfirmMessage))
+		debug(DEBUG_UNEXPECTED, "Scheduled confirm message transmission failed");
+}
+
+/*
+ * Process an xPL x10.basic command
+ *
+ * The device list may span houses, see planParseDevices() for the syntax.
+ * command=scene with scene=name sends a precompiled scene instead, and
+ * command1, device1, command2... sends a batch.
+ *
+ * Commands are queued, and the x10.confirm is sent when the last frame
+ * has gone out or the CM11A has finally given up. An id n/v in the
+ * command is echoed in the confirm so senders can match them up.
+ * A delay= or at= n/v schedules the command for later instead.
+ */
+
+static void processX10BasicCommand(xPL_MessagePtr theMessage)
+{
+	int house;
+	int lvl, d1, d2;
+	unsigned function;
+	char houseLetter[2];
+	X10Addrs_t addrs;
+	SceneEntryPtr_t se;
+	TxJobPtr_t job;
+	static X10Plan_t plan;
+	const String command =  xPL_getMessageNamedValue(theMessage, "command");
+	const String deviceList = xPL_getMessageNamedValue(theMessage, "device");
+	const String scene = xPL_getMessageNamedValue(theMessage, "scene");
+	
+	if(!theMessage){
+		debug(DEBUG_UNEXPECTED, "No message passed in");
+		return;
+	}
+
+	if((house = messageHouse(theMessage)) < 0){
+		sendRejectConfirm(theMessage, command, "bad house");
+		return;
+	}
+	houseLetter[0] = 'A' + house;
+	houseLetter[1] = 0;
+
+	if((xPL_getMessageNamedValue(theMessage, "delay")) || (xPL_getMessageNamedValue(theMessage, "at"))){
+		processX10Scheduled(theMessage, house);
+		return;
+	}
+	
+	if(!command){
+		if(xPL_getMessageNamedValue(theMessage, "command1"))
+			processX10Batch(theMessage, house);
+		else{
+			debug(DEBUG_UNEXPECTED, "No command passed in");
+			sendRejectConfirm(theMessage, command, "no command");
+		}
+		return;
+	}
+
+	if(!strcmp(command, "scene")){
+		if(!(se = sceneFind(scene))){
+			debug(DEBUG_UNEXPECTED, "Unknown scene: %s", scene ? scene : "(none)");
+			sendRejectConfirm(theMessage, command, "unknown scene");
+			return;
+		}
+		if(!admitPlan(theMessage, command, se->plan))
+			return;
+		debug(DEBUG_ACTION, "Activating scene %s", se->name);
+		job = queueX10Plan(theMessage, se->plan, sendJobConfirm);
+		txqAddNV(job, "id", xPL_getMessageNamedValue(theMessage, "id"));
+		txqAddNV(job, "command", command);
+		txqAddNV(job, "scene", se->name);
+		return;
+	}
+
+	if(!parseCommandBlock(theMessage, "", house, &addrs, &function, &lvl, &d1, &d2)){
+		sendRejectConfirm(theMessage, command, "bad arguments");
+		return;
+	}
+
+	if(function == COMMAND_INVALID){
+		debug(DEBUG_UNEXPECTED,"Bad command");
+		sendRejectConfirm(theMessage, command, "bad command");
+		return;
+	}
+
+	/* Plan the transmission starting with the house last addressed */
+	planInit(&plan);
+	if(!planAddFunction(&plan, &addrs, function, lvl, d1, d2, (lastHouse < 0) ? house : lastHouse)){
+		debug(DEBUG_UNEXPECTED, "Command plan overflow");
+		sendRejectConfirm(theMessage, command, "plan overflow");
+		return;
+	}
+
+	if(!admitPlan(theMessage, command, &plan))
+		return;
+
+	/* The confirm is sent once the command has been through the queue */
+	job = queueX10Plan(theMessage, &plan, sendJobConfirm);
+	txqAddNV(job, "id", xPL_getMessageNamedValue(theMessage, "id"));
+	txqAddNV(job, "command", command);
+	txqAddNV(job, "house", houseLetter);
+	txqAddNV(job, "device", deviceList);
+}
+
+/*
+ * Return TRUE if a queued job matches an x10.cancel command
+ */
+
+static Bool matchCancel(TxJobPtr_t job, void *arg)
+{
+	unsigned i;
+	String id;
+	CancelMatchPtr_t cm = arg;
+
+	if((cm->id) && ((!(id = txqGetNV(job, "id"))) || (strcmp(id, cm->id))))
+		return FALSE;
+	if((cm->source) && (strcmp(job->source->name, cm->source)))
+		return FALSE;
+	if(!cm->useAddrs)
+		return TRUE;
+	for(i = 0; i < job->count; i++){
+		if(job->frames[i].unitmask & cm->addrs.units[job->frames[i].house])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Process an xPL x10.cancel command
+ *
+ * Cancels queued commands by id (the id n/v they were sent with), by
+ * source (vendor-device.instance, or self for the sender of the cancel),
+ * and/or by house and device list. When more than one is given a command
+ * has to match all of them. The cancelled commands get a confirm with
+ * result=cancelled, and this command gets one with the number cancelled.
+ * schedule=n cancels a scheduled command by the id it was given instead.
+ */
+
+static void processX10CancelCommand(xPL_MessagePtr theMessage)
+{
+	int house;
+	char ws[WS_SIZE];
+	char source[WS_SIZE];
+	CancelMatch_t cm;
+	const String id = xPL_getMessageNamedValue(theMessage, "id");
+	const String src = xPL_getMessageNamedValue(theMessage, "source");
+	const String deviceList = xPL_getMessageNamedValue(theMessage, "device");
+	const String schedule = xPL_getMessageNamedValue(theMessage, "schedule");
+
+	if(schedule){
+		debug(DEBUG_ACTION, "Cancelling scheduled action %s", schedule);
+		xPL_clearMessageNamedValues(xplx10ConfirmMessage);
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "command", "cancel");
+		if(id)
+			xPL_setMessageNamedValue(xplx10ConfirmMessage, "id", id);
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "schedule", schedule);
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "result", txqResultName(TXQ_OK));
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "cancelled",
+		((atoi(schedule) > 0) && (scheduleCancel((unsigned) atoi(schedule)))) ? "1" : "0");
+		if(!xPL_sendMessage(xplx10ConfirmMessage))
+			debug(DEBUG_UNEXPECTED, "Cancel confirm message transmission failed");
+		return;
+	}
+
+	memset(&cm, 0, sizeof(cm));
+	if((!id) && (!src) && (!deviceList)){
+		debug(DEBUG_UNEXPECTED, "x10.cancel needs an id, source or device");
+		sendRejectConfirm(theMessage, "cancel", "nothing to match");
+		return;
+	}
+	cm.id = id;
+	if(src){
+		if(!strcmp(src, "self")){
+			messageSource(theMessage, source, sizeof(source));
+			cm.source = source;
+		}
+		else
+			cm.source = src;
+	}
+	if(deviceList){
+		if(((house = messageHouse(theMessage)) < 0) || (!planParseDevices(deviceList, house, &cm.addrs))){
+			debug(DEBUG_UNEXPECTED, "Bad device list: %s", deviceList);
+			sendRejectConfirm(theMessage, "cancel", "bad device list");
+			return;
+		}
+		cm.useAddrs = TRUE;
+	}
+
+	snprintf(ws, sizeof(ws), "%u", txqCancel(matchCancel, &cm));
+	debug(DEBUG_ACTION, "Cancelled %s commands", ws);
+
+	xPL_clearMessageNamedValues(xplx10ConfirmMessage);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "command", "cancel");
+	if(id)
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "id", id);
+	if(cm.source)
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "source", cm.source);
+	if(deviceList)
+		xPL_setMessageNamedValue(xplx10ConfirmMessage, "device", deviceList);
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "result", txqResultName(TXQ_OK));
+	xPL_setMessageNamedValue(xplx10ConfirmMessage, "cancelled", ws);
+	if(!xPL_sendMessage(xplx10ConfirmMessage))
+		debug(DEBUG_UNEXPECTED, "Cancel confirm message transmission failed");
+}
+
+/*
+ * Return the x10.basic trigger name of an X10 function, or NULL if it is not valid
+ */
+
+static const char *eventCommandName(unsigned function)
+{
+	switch(function){
+		case COMMAND_ALL_UNITS_OFF:
+			return "all_units_off";
+
+		case COMMAND_ALL_LIGHTS_OFF:
+			return "all_lights_off";
+
+		case COMMAND_ALL_LIGHTS_ON:
+			return "all_lights_on";
+
+		case COMMAND_BRIGHT:
+			return "bright";
+
+		case COMMAND_DIM:
+			return "dim";
+
+		case COMMAND_EXTENDED_CODE:
+			return "extended_code";
+
+		case COMMAND_EXTENDED_DATA_TRANSFER:
+			return "extended";
+
+		case COMMAND_HAIL_ACKNOWLEDGE:
+			return "hail_ack";
+
+		case COMMAND_HAIL_REQUEST:
+			return "hail_request";
+
+		case COMMAND_OFF:
+			return "off";
+
+		case COMMAND_ON:
+			return "on";
+
+		case COMMAND_PRESET_DIM1:
+			return "predim1";
+
+		case COMMAND_PRESET_DIM2:
+			return "predim2";
+
+		case COMMAND_STATUS_OFF:
+			return "status_off";
+
+		case COMMAND_STATUS_ON:
+			return "status_on";
+
+		case COMMAND_STATUS_REQUEST:
+			return "status";
+
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Look up an X10 function by its trigger name
+ */
+
+static Bool eventCommandFunction(const String name, unsigned *function)
+{
+	unsigned f;
+	const char *n;
+
+	for(f = 0; f < 16; f++){
+		if((n = eventCommandName(f)) && (!strcmp(n, name))){
+			*function = f;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Send the state of one device as an x10.status message
+ */
+
+static void sendDeviceStatus(int house, int unit)
+{
+	char ws[WS_SIZE];
+	DevStatePtr_t ds = devstateGet(house, unit);
+	DevEntryPtr_t de;
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	snprintf(ws, sizeof(ws), "%c", 'A' + house);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "house", ws);
+	snprintf(ws, sizeof(ws), "%d", unit + 1);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "device", ws);
+	if((de = devregByAddress(house, unit))){
+		xPL_setMessageNamedValue(xplx10StatusMessage, "name", de->name);
+		xPL_setMessageNamedValue(xplx10StatusMessage, "type", devregTypeName(de->type));
+		if(de->caps & DEV_CAP_TWOWAY){
+			snprintf(ws, sizeof(ws), "%u", de->verified);
+			xPL_setMessageNamedValue(xplx10StatusMessage, "verified", ws);
+			snprintf(ws, sizeof(ws), "%u", de->unverified);
+			xPL_setMessageNamedValue(xplx10StatusMessage, "unverified", ws);
+			snprintf(ws, sizeof(ws), "%u", de->resends);
+			xPL_setMessageNamedValue(xplx10StatusMessage, "resends", ws);
+			snprintf(ws, sizeof(ws), "%u", refreshMisses(house, unit));
+			xPL_setMessageNamedValue(xplx10StatusMessage, "refresh-misses", ws);
+			if(de->verified + de->unverified){
+				snprintf(ws, sizeof(ws), "%u", (de->verified * 100) / (de->verified + de->unverified));
+				xPL_setMessageNamedValue(xplx10StatusMessage, "success", ws);
+			}
+		}
+	}
+	xPL_setMessageNamedValue(xplx10StatusMessage, "state", devstateName(ds));
+	if(ds->flags & DS_KNOWN){
+		snprintf(ws, sizeof(ws), "%u", ds->level);
+		xPL_setMessageNamedValue(xplx10StatusMessage, "level", ws);
+		snprintf(ws, sizeof(ws), "%ld", (long) (time(NULL) - ds->changed));
+		xPL_setMessageNamedValue(xplx10StatusMessage, "age", ws);
+		/* Staleness: when the state was last set or confirmed, and whether only from before a restart */
+		snprintf(ws, sizeof(ws), "%ld", (long) (time(NULL) - ds->updated));
+		xPL_setMessageNamedValue(xplx10StatusMessage, "updated", ws);
+		if(ds->flags & DS_RESTORED)
+			xPL_setMessageNamedValue(xplx10StatusMessage, "restored", "yes");
+	}
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Device status message transmission failed");
+}
+
+/*
+ * Send the per-schema message counters as an x10.status message
+ */
+
+static void sendSchemaCounters(void)
+{
+	int i;
+	unsigned requests, replies, timeouts, triggers, offs, active, clients, commands, refused, dropped;
+	char key[WS_SIZE];
+	char ws[WS_SIZE];
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "counters");
+	for(i = 0; schemaTable[i].class; i++){
+		snprintf(key, sizeof(key), "%s-%s", schemaTable[i].class, schemaTable[i].type);
+		snprintf(ws, sizeof(ws), "%u", schemaTable[i].count);
+		xPL_setMessageNamedValue(xplx10StatusMessage, key, ws);
+	}
+	snprintf(ws, sizeof(ws), "%u", unsupportedSchemaCount);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "unsupported", ws);
+	refreshStats(&requests, &replies, &timeouts);
+	snprintf(ws, sizeof(ws), "%u", requests);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "refresh-requests", ws);
+	snprintf(ws, sizeof(ws), "%u", replies);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "refresh-replies", ws);
+	snprintf(ws, sizeof(ws), "%u", timeouts);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "refresh-timeouts", ws);
+	occupancyStats(&triggers, &offs, &active);
+	snprintf(ws, sizeof(ws), "%u", triggers);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "occupancy-triggers", ws);
+	snprintf(ws, sizeof(ws), "%u", offs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "occupancy-offs", ws);
+	snprintf(ws, sizeof(ws), "%u", active);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "occupancy-active", ws);
+	localapiStats(&clients, &commands, &refused, &dropped);
+	snprintf(ws, sizeof(ws), "%u", clients);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "local-clients", ws);
+	snprintf(ws, sizeof(ws), "%u", commands);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "local-commands", ws);
+	snprintf(ws, sizeof(ws), "%u", refused);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "local-refused", ws);
+	snprintf(ws, sizeof(ws), "%u", dropped);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "local-dropped", ws);
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Counters message transmission failed");
+}
+
+/*
+ * Send the transmit queue statistics of one xPL source as an x10.status message
+ */
+
+static void sendSourceStatus(TxSourcePtr_t src)
+{
+	char ws[WS_SIZE];
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "sources");
+	xPL_setMessageNamedValue(xplx10StatusMessage, "source", src->name);
+	snprintf(ws, sizeof(ws), "%u", src->weight);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "weight", ws);
+	snprintf(ws, sizeof(ws), "%u", src->depth);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "depth", ws);
+	snprintf(ws, sizeof(ws), "%u", src->jobs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "jobs", ws);
+	snprintf(ws, sizeof(ws), "%u", src->frames);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "frames", ws);
+	snprintf(ws, sizeof(ws), "%lu", src->jobs ? src->waitTotalMs / src->jobs : 0);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "avg-wait-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", src->waitMaxMs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "max-wait-ms", ws);
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Source status message transmission failed");
+}
+
+/*
+ * Send the discovery sweep progress and results as an x10.status message
+ */
+
+static void sendDiscoveryStatus(void)
+{
+	int house, unit, pos;
+	uint16_t hail;
+	uint16_t units[16];
+	char ws[WS_SIZE * 4];
+
+	discoverResults(&hail, units);
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "discovery");
+	xPL_setMessageNamedValue(xplx10StatusMessage, "state", discoverRunning() ? "running" : "stopped");
+	snprintf(ws, sizeof(ws), "%u/%u", discoverProgress(), DISCOVER_STEPS);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "progress", ws);
+	for(house = pos = 0, ws[0] = 0; house < 16; house++){
+		if(hail & (1 << house))
+			pos += snprintf(ws + pos, sizeof(ws) - pos, "%s%c", pos ? "," : "", 'A' + house);
+	}
+	xPL_setMessageNamedValue(xplx10StatusMessage, "hail", ws);
+	for(house = pos = 0, ws[0] = 0; house < 16; house++){
+		for(unit = 0; unit < 16; unit++){
+			if(units[house] & (1 << unit))
+				pos += snprintf(ws + pos, sizeof(ws) - pos, "%s%c%d", pos ? "," : "", 'A' + house, unit + 1);
+		}
+	}
+	xPL_setMessageNamedValue(xplx10StatusMessage, "device", ws);
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Discovery status message transmission failed");
+}
+
+/*
+ * Send the hit counts and reaction times of one rule as an x10.status message
+ *
+ * Reaction time runs from the event arriving to the action being sent,
+ * so it includes any wait in the transmit queue.
+ */
+
+static void sendRuleStatus(RulePtr_t r)
+{
+	char ws[WS_SIZE];
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "rules");
+	xPL_setMessageNamedValue(xplx10StatusMessage, "rule", r->name);
+	snprintf(ws, sizeof(ws), "%u", r->hits);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "hits", ws);
+	snprintf(ws, sizeof(ws), "%u", r->blocked);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "blocked", ws);
+	snprintf(ws, sizeof(ws), "%u", r->lastMs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "last-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", r->completed ? (unsigned) (r->totalMs / r->completed) : 0);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "avg-ms", ws);
+	snprintf(ws, sizeof(ws), "%u", r->maxMs);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "max-ms", ws);
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Rule status message transmission failed");
+}
+
+/*
+ * Send the number of scheduled actions and when the next is due as an x10.status message
+ */
+
+static void sendScheduleStatus(void)
+{
+	unsigned pending, daily;
+	time_t next;
+	char ws[WS_SIZE];
+
+	scheduleStats(&pending, &daily, &next);
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "schedule");
+	snprintf(ws, sizeof(ws), "%u", pending);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "pending", ws);
+	snprintf(ws, sizeof(ws), "%u", daily);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "daily", ws);
+	snprintf(ws, sizeof(ws), "%ld", (long) next);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "next", ws);
+	snprintf(ws, sizeof(ws), "%u", timerPending());
+	xPL_setMessageNamedValue(xplx10StatusMessage, "timers", ws);
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Schedule status message transmission failed");
+}
+
+/*
+ * Send one event from the history as an x10.status message
+ */
+
+static void sendHistoryStatus(HistEventPtr_t e, unsigned seq, unsigned total)
+{
+	char ws[WS_SIZE];
+	X10Addrs_t addrs;
+	const char *command = eventCommandName(e->function);
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "history");
+	snprintf(ws, sizeof(ws), "%u/%u", seq, total);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "event", ws);
+	snprintf(ws, sizeof(ws), "%ld.%03u", (long) e->time, e->msec);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "time", ws);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "direction", e->tx ? "tx" : "rx");
+	xPL_setMessageNamedValue(xplx10StatusMessage, "source", e->source);
+	snprintf(ws, sizeof(ws), "%c", 'A' + e->house);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "house", ws);
+	if(e->unitmask){
+		memset(&addrs, 0, sizeof(addrs));
+		addrs.houses = 1 << e->house;
+		addrs.units[e->house] = e->unitmask;
+		if(planFormatDevices(&addrs, ws, sizeof(ws)))
+			xPL_setMessageNamedValue(xplx10StatusMessage, "device", ws);
+	}
+	if(command)
+		xPL_setMessageNamedValue(xplx10StatusMessage, "command", (String) command);
+	else{
+		snprintf(ws, sizeof(ws), "%u", e->function);
+		xPL_setMessageNamedValue(xplx10StatusMessage, "command", ws);
+	}
+	if((e->function == COMMAND_DIM) || (e->function == COMMAND_BRIGHT)){
+		snprintf(ws, sizeof(ws), "%d", e->level);
+		xPL_setMessageNamedValue(xplx10StatusMessage, "level", ws);
+	}
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "History status message transmission failed");
+}
+
+/*
+ * Answer a request for event history
+ *
+ * device=address or name with count=n returns the last n events for one address.
+ * since=seconds returns the events in the last that many seconds.
+ * At most HISTORY_MAX_REPLY events are sent, the most recent.
+ */
+
+static void processX10HistoryRequest(xPL_MessagePtr theMessage)
+{
+	int house, unit;
+	unsigned i, n, total, count = HISTORY_DEF_COUNT;
+	HistEvent_t events[HISTORY_MAX_REPLY];
+	const String deviceList = xPL_getMessageNamedValue(theMessage, "device");
+	const String since = xPL_getMessageNamedValue(theMessage, "since");
+	const String countStr = xPL_getMessageNamedValue(theMessage, "count");
+
+	if(!historyEnabled()){
+		debug(DEBUG_EXPECTED, "History request but no history is kept");
+		return;
+	}
+	if(countStr && (atoi(countStr) > 0))
+		count = (unsigned) atoi(countStr);
+	if(count > HISTORY_MAX_REPLY)
+		count = HISTORY_MAX_REPLY;
+
+	if(since){
+		if(atoi(since) <= 0){
+			debug(DEBUG_UNEXPECTED, "Bad history since: %s", since);
+			return;
+		}
+		n = historySince(time(NULL) - atoi(since), HISTORY_MAX_REPLY, events, &total);
+	}
+	else{
+		if((!deviceList) || (!parseX10Address(deviceList, &house, &unit))){
+			debug(DEBUG_UNEXPECTED, "History request needs one device or since");
+			return;
+		}
+		n = total = historyByAddress(house, unit, count, events);
+	}
+	for(i = 0; i < n; i++)
+		sendHistoryStatus(&events[i], total - n + i + 1, total);
+}
+
+/*
+ * Send the usage statistics of one device as an x10.status message
+ *
+ * For each window: on time in seconds, times switched on, duty cycle
+ * and level weighted duty cycle in percent, and watt hours if the
+ * device has a watts= option.
+ */
+
+static void sendUsageStatus(int house, int unit)
+{
+	unsigned window;
+	char key[WS_SIZE];
+	char ws[WS_SIZE];
+	UsageStats_t us;
+	DevEntryPtr_t de;
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "usage");
+	snprintf(ws, sizeof(ws), "%c%d", 'A' + house, unit + 1);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "device", ws);
+	if((de = devregByAddress(house, unit)))
+		xPL_setMessageNamedValue(xplx10StatusMessage, "name", de->name);
+	for(window = 0; window < USAGE_WINDOWS; window++){
+		if(!usageGet(house, unit, window, &us))
+			memset(&us, 0, sizeof(us));
+		snprintf(key, sizeof(key), "%s-on", usageWindowName(window));
+		snprintf(ws, sizeof(ws), "%u", us.onSecs);
+		xPL_setMessageNamedValue(xplx10StatusMessage, key, ws);
+		snprintf(key, sizeof(key), "%s-switches", usageWindowName(window));
+		snprintf(ws, sizeof(ws), "%u", us.switches);
+		xPL_setMessageNamedValue(xplx10StatusMessage, key, ws);
+		snprintf(key, sizeof(key), "%s-duty", usageWindowName(window));
+		snprintf(ws, sizeof(ws), "%.1f", us.spanSecs ? (us.onSecs * 100.0) / us.spanSecs : 0.0);
+		xPL_setMessageNamedValue(xplx10StatusMessage, key, ws);
+		snprintf(key, sizeof(key), "%s-dim-duty", usageWindowName(window));
+		snprintf(ws, sizeof(ws), "%.1f", us.spanSecs ? (us.levelSecs * 100.0) / us.spanSecs : 0.0);
+		xPL_setMessageNamedValue(xplx10StatusMessage, key, ws);
+		if((de) && (de->watts)){
+			snprintf(key, sizeof(key), "%s-wh", usageWindowName(window));
+			snprintf(ws, sizeof(ws), "%.1f", us.wattHours);
+			xPL_setMessageNamedValue(xplx10StatusMessage, key, ws);
+		}
+	}
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Usage status message transmission failed");
+}
+
+/*
+ * Count history events matching a query, and send the count as an x10.status message
+ *
+ * house=letters and device=list limit the houses and units, command=list
+ * the functions, direction=rx or tx the direction. since=seconds, or
+ * from= and to= in seconds since the epoch, give the time range, and
+ * hours=HH:MM-HH:MM a time of day window. Anything not given matches
+ * everything. kernel=scalar uses the scalar scan for comparison.
+ */
+
+static void processX10ScanRequest(xPL_MessagePtr theMessage)
+{
+	int house;
+	unsigned function;
+	char ws[WS_SIZE];
+	String p, tok, save;
+	X10Addrs_t addrs;
+	HScanQuery_t q;
+	HScanResult_t r;
+	const String houseList = xPL_getMessageNamedValue(theMessage, "house");
+	const String deviceList = xPL_getMessageNamedValue(theMessage, "device");
+	const String commandList = xPL_getMessageNamedValue(theMessage, "command");
+	const String direction = xPL_getMessageNamedValue(theMessage, "direction");
+	const String since = xPL_getMessageNamedValue(theMessage, "since");
+	const String from = xPL_getMessageNamedValue(theMessage, "from");
+	const String to = xPL_getMessageNamedValue(theMessage, "to");
+	const String hours = xPL_getMessageNamedValue(theMessage, "hours");
+	const String kernel = xPL_getMessageNamedValue(theMessage, "kernel");
+
+	if(!historyEnabled()){
+		debug(DEBUG_EXPECTED, "Scan request but no history is kept");
+		return;
+	}
+	memset(&q, 0, sizeof(q));
+	q.houseMask = q.functionMask = q.unitMask = 0xFFFF;
+	q.direction = HSCAN_RX | HSCAN_TX;
+
+	if(houseList){
+		for(p = houseList, q.houseMask = 0; *p; p++){
+			if(((house = toupper(*p) - 'A') < 0) || (house > 15)){
+				debug(DEBUG_UNEXPECTED, "Bad scan house list: %s", houseList);
+				return;
+			}
+			q.houseMask |= 1 << house;
+		}
+	}
+	if(deviceList){
+		if(!planParseDevices(deviceList, toupper(defaultHouseLetter) - 'A', &addrs)){
+			debug(DEBUG_UNEXPECTED, "Bad device list: %s", deviceList);
+			return;
+		}
+		q.houseMask = houseList ? (q.houseMask & addrs.houses) : addrs.houses;
+		for(house = 0, q.unitMask = 0; house < 16; house++)
+			q.unitMask |= addrs.units[house];
+	}
+	if(commandList){
+		confreadStringCopy(ws, commandList, sizeof(ws));
+		for(q.functionMask = 0, tok = strtok_r(ws, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+			if(!eventCommandFunction(tok, &function)){
+				debug(DEBUG_UNEXPECTED, "Bad scan command: %s", tok);
+				return;
+			}
+			q.functionMask |= 1 << function;
+		}
+	}
+	if(direction)
+		q.direction = !strcmp(direction, "tx") ? HSCAN_TX : !strcmp(direction, "rx") ? HSCAN_RX : q.direction;
+	if(since)
+		q.from = time(NULL) - atol(since);
+	if(from)
+		q.from = (time_t) atol(from);
+	if(to)
+		q.to = (time_t) atol(to);
+	if(hours){
+		confreadStringCopy(ws, hours, sizeof(ws));
+		if((p = strchr(ws, '-')))
+			*p++ = 0;
+		if((!p) || ((q.todFrom = scheduleParseTime(ws)) < 0) || ((q.todTo = scheduleParseTime(p)) < 0)){
+			debug(DEBUG_UNEXPECTED, "Bad scan hours: %s", hours);
+			return;
+		}
+	}
+	q.scalar = (kernel && !strcmp(kernel, "scalar")) ? TRUE : FALSE;
+
+	histscanCount(&q, &r);
+	debug(DEBUG_ACTION, "History scan: %u of %u events matched in %u us", r.matched, r.scanned, r.usec);
+
+	xPL_setSchema(xplx10StatusMessage, "x10", "status");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "request", "scan");
+	snprintf(ws, sizeof(ws), "%u", r.matched);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "matched", ws);
+	snprintf(ws, sizeof(ws), "%u", r.scanned);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "scanned", ws);
+	snprintf(ws, sizeof(ws), "%u", r.usec);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "us", ws);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "kernel", q.scalar ? "scalar" : histscanKernel());
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Scan status message transmission failed");
+}
+
+/*
+ * Process an xPL x10.request command
+ *
+ * request=status (the default) returns the state of each device in the house/device list.
+ * request=counters returns the per-schema message counters.
+ * request=backlog returns the queued powerline time and the budget.
+ * request=sources returns the queue depth and latency of each xPL source.
+ * request=schedule returns the number of scheduled actions and when the next is due.
+ * request=rules returns the hit counts and reaction times of each rule.
+ * request=history returns recent events for a device, or since a time.
+ * request=scan counts the events in the history matching a query.
+ * request=usage returns the on time, switch count and duty cycle of each device in the list.
+ * request=discovery returns the discovery sweep progress and results, and
+ * with action=start, restart or stop controls the sweep.
+ */
+
+static void processX10RequestCommand(xPL_MessagePtr theMessage)
+{
+	int unit, house;
+	X10Addrs_t addrs;
+	TxSourcePtr_t src;
+	RulePtr_t r;
+	String action;
+	const String request = xPL_getMessageNamedValue(theMessage, "request");
+	const String deviceList = xPL_getMessageNamedValue(theMessage, "device");
+
+	if(request && !strcmp(request, "counters")){
+		sendSchemaCounters();
+		return;
+	}
+
+	if(request && !strcmp(request, "backlog")){
+		sendBacklogStatus();
+		return;
+	}
+
+	if(request && !strcmp(request, "discovery")){
+		if((action = xPL_getMessageNamedValue(theMessage, "action"))){
+			if(!strcmp(action, "start"))
+				discoverStart(FALSE);
+			else if(!strcmp(action, "restart"))
+				discoverStart(TRUE);
+			else if(!strcmp(action, "stop"))
+				discoverStop();
+			else
+				debug(DEBUG_UNEXPECTED, "Unsupported discovery action: %s", action);
+		}
+		sendDiscoveryStatus();
+		return;
+	}
+
+	if(request && !strcmp(request, "rules")){
+		for(r = rulesFirst(); r; r = rulesNext(r))
+			sendRuleStatus(r);
+		return;
+	}
+
+	if(request && !strcmp(request, "history")){
+		processX10HistoryRequest(theMessage);
+		return;
+	}
+
+	if(request && !strcmp(request, "scan")){
+		processX10ScanRequest(theMessage);
+		return;
+	}
+
+	if(request && !strcmp(request, "schedule")){
+		sendScheduleStatus();
+		return;
+	}
+
+	if(request && !strcmp(request, "sources")){
+		for(src = txqFirstSource(); src; src = txqNextSource(src))
+			sendSourceStatus(src);
+		return;
+	}
+
+	if(request && strcmp(request, "status") && strcmp(request, "usage")){
+		debug(DEBUG_UNEXPECTED, "Unsupported request: %s", request);
+		return;
+	}
+
+	if((house = messageHouse(theMessage)) < 0)
+		return;
+
+	if(!deviceList){
+		debug(DEBUG_UNEXPECTED, "Device list not present");
+		return;
 	}
-	else
-		debug(DEBUG_EXPECTED, "X10 transmission disabled (dry-run)");		
-}
 
+	if(!planParseDevices(deviceList, house, &addrs)){
+		debug(DEBUG_UNEXPECTED, "Bad device list: %s", deviceList);
+		return;
+	}
 
-/*
-* Our Listener 
-*/
+	for(house = 0; house < 16; house++){
+		for(unit = 0; unit < 16; unit++){
+			if(!(addrs.units[house] & (1 << unit)))
+				continue;
+			if(request && !strcmp(request, "usage"))
+				sendUsageStatus(house, unit);
+			else
+				sendDeviceStatus(house, unit);
+		}
+	}
+}
 
 /*
- * Process an xPL x10.basic command
+ * Process an xPL control.basic command
  *
+ * type=output accepts current=enable/disable/high/low/on/off/toggle
+ * type=slider accepts current=0-100 (percent)
  */
 
-static void processX10BasicCommand(xPL_MessagePtr theMessage)
+static void processControlBasicCommand(xPL_MessagePtr theMessage)
 {
-	int cmd,i,j,cnt,pktx;
-	char houseLetter[2];
-	unsigned char hc;
-	unsigned char x10_pkt[6];
-	String addrList[16];
-	const String command =  xPL_getMessageNamedValue(theMessage, "command");
-	const String deviceList = xPL_getMessageNamedValue(theMessage, "device");
-	const String houseList = xPL_getMessageNamedValue(theMessage, "house");
-	const String level =  xPL_getMessageNamedValue(theMessage, "level");
-	const String data1 = xPL_getMessageNamedValue(theMessage, "data1");
-	const String data2 = xPL_getMessageNamedValue(theMessage, "data2");
-	
-	if(!theMessage){
-		debug(DEBUG_UNEXPECTED, "No message passed in");
+	int house, unit, target, delta;
+	DevStatePtr_t ds;
+	static X10Plan_t plan;
+	const String device = xPL_getMessageNamedValue(theMessage, "device");
+	const String type = xPL_getMessageNamedValue(theMessage, "type");
+	const String current = xPL_getMessageNamedValue(theMessage, "current");
+
+	if(!device || !type || !current){
+		debug(DEBUG_UNEXPECTED, "control.basic requires device, type and current");
 		return;
 	}
-		
-	
-	if(!command){
-		debug(DEBUG_UNEXPECTED, "No command passed in");
+
+	if(!parseX10Address(device, &house, &unit)){
+		debug(DEBUG_UNEXPECTED, "Bad device address: %s", device);
 		return;
 	}
-	
-	houseLetter[1] = 0;
-	if(houseList){ /* If house letter overridden */
-		if(strlen(houseList) != 1 || x10_letter_to_housecode((houseLetter[0] = houseList[0]), &hc)){
-			debug(DEBUG_UNEXPECTED, "Bad house code %s", houseList);
+
+	ds = devstateGet(house, unit);
+
+	if(!strcmp(type, "output")){
+		if(!strcmp(current, "enable") || !strcmp(current, "high") || !strcmp(current, "on"))
+			sendX10Function(theMessage, house, 1 << unit, COMMAND_ON, 0);
+		else if(!strcmp(current, "disable") || !strcmp(current, "low") || !strcmp(current, "off"))
+			sendX10Function(theMessage, house, 1 << unit, COMMAND_OFF, 0);
+		else if(!strcmp(current, "toggle"))
+			sendX10Function(theMessage, house, 1 << unit, (ds->flags & DS_ON) ? COMMAND_OFF : COMMAND_ON, 0);
+		else
+			debug(DEBUG_UNEXPECTED, "Bad output value: %s", current);
+	}
+	else if(!strcmp(type, "slider")){
+		target = atoi(current);
+		if((target < 0) || (target > 100)){
+			debug(DEBUG_UNEXPECTED, "Slider value out of bounds: %s", current);
 			return;
 		}
-	}
-	else{ /* Use default house letter */
-		debug(DEBUG_EXPECTED,"Using default house letter: %c", (houseLetter[0] = defaultHouseLetter));
-		if(x10_letter_to_housecode(defaultHouseLetter, &hc)){
-			debug(DEBUG_UNEXPECTED, "Bad default house letter");
+		if(!target){
+			sendX10Function(theMessage, house, 1 << unit, COMMAND_OFF, 0);
 			return;
 		}
-	}		
-	if(!deviceList){
-		debug(DEBUG_UNEXPECTED, "Device list not present");
-		return;
+		/* If the level is not known, start from full brightness. Both steps go as one command */
+		planInit(&plan);
+		if(!(ds->flags & DS_ON)){
+			addX10Function(&plan, house, 1 << unit, COMMAND_BRIGHT, 100);
+			delta = target - 100;
+		}
+		else
+			delta = target - ds->level;
+		if(delta < 0)
+			addX10Function(&plan, house, 1 << unit, COMMAND_DIM, -delta);
+		else if(delta > 0)
+			addX10Function(&plan, house, 1 << unit, COMMAND_BRIGHT, delta);
+		if(plan.count)
+			sendX10Plan(theMessage, &plan);
 	}
-	/* Split the address list */
-	cnt = dupOrSplitString(deviceList, addrList, ',', 16);
-	debug(DEBUG_ACTION, "Number of devices: %d", cnt);
-			
-	/* Must have at least 1 address */
-	if(!cnt){
-		debug(DEBUG_UNEXPECTED, "No devices specified");
-		free(addrList[0]);
+	else
+		debug(DEBUG_UNEXPECTED, "Unsupported control type: %s", type);
+}
+
+/*
+ * Process an xPL sensor.request command
+ *
+ * Replies with a sensor.basic status message for the device.
+ */
+
+static void processSensorRequestCommand(xPL_MessagePtr theMessage)
+{
+	int house, unit;
+	const String request = xPL_getMessageNamedValue(theMessage, "request");
+	const String device = xPL_getMessageNamedValue(theMessage, "device");
+
+	if(!request || strcmp(request, "current")){
+		debug(DEBUG_UNEXPECTED, "Unsupported sensor request");
 		return;
 	}
-		
-	/* Send an X10 transmission for each address */	
-	for(i = 0; pktx < 6 && i < cnt; i++){
-		/* Build the address packet */
-		pktx = 0;
-		x10_pkt[pktx++] = HEADER_DEFAULT;
-		if(x10_number_to_devicecode(atoi(addrList[i]),x10_pkt + pktx)){
-			debug(DEBUG_UNEXPECTED,"Bad device code: %s. Command aborted.",addrList[i]);
-			free(addrList[0]); /* Done with address list */	
-			return;
-		}
-		/* Or in the house code bits */
-		x10_pkt[pktx++] |= (hc << 4);	
-		sendX10Command(x10_pkt, pktx);	
+
+	if(!parseX10Address(device, &house, &unit)){
+		debug(DEBUG_UNEXPECTED, "Bad device address: %s", device);
+		return;
 	}
-	free(addrList[0]); /* Done with address list */			
 
-	debug(DEBUG_ACTION, "Received command: %s", command);
-	
-	/* Decode command */
-	for(cmd = 0; X10_commands[cmd]; cmd++){
-		if(!strcmp(command, X10_commands[cmd]))
-			break;
+	xPL_setSchema(xplx10StatusMessage, "sensor", "basic");
+	xPL_clearMessageNamedValues(xplx10StatusMessage);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "device", device);
+	xPL_setMessageNamedValue(xplx10StatusMessage, "type", "output");
+	xPL_setMessageNamedValue(xplx10StatusMessage, "current", devstateName(devstateGet(house, unit)));
+	if(!xPL_sendMessage(xplx10StatusMessage))
+		debug(DEBUG_UNEXPECTED, "Sensor status message transmission failed");
+}
+
+
+/*
+ * Hash a schema class and type as class.type
+ */
+
+static uint32_t schemaHash(const String class, const String type)
+{
+	char schema[WS_SIZE];
+
+	snprintf(schema, sizeof(schema), "%s.%s", class, type);
+	return confreadHash(schema);
+}
+
+/*
+ * Build the hashed index into the schema table
+ */
+
+static void schemaTableInit(void)
+{
+	int i, slot;
+
+	for(i = 0; schemaTable[i].class; i++){
+		schemaTable[i].hash = schemaHash(schemaTable[i].class, schemaTable[i].type);
+		for(slot = schemaTable[i].hash & (SCHEMA_SLOTS - 1); schemaSlots[slot]; slot = (slot + 1) & (SCHEMA_SLOTS - 1));
+		schemaSlots[slot] = &schemaTable[i];
 	}
-    debug(DEBUG_ACTION, "Command index : %d", cmd);
-    
-   /* Build header byte */
-	pktx = 0;
-	x10_pkt[pktx++] = HEADER_DEFAULT | HEADER_FUNCTION;
-	x10_pkt[pktx] = (hc << 4);
-
-    /* Dispatch to command */
-	switch(cmd){
-		case CMD_SEL: /* Select */			
-			break;
-				
-		case CMD_AUO: /* All units off */
-			x10_pkt[pktx++] = COMMAND_ALL_UNITS_OFF;
-			sendX10Command(x10_pkt, pktx);	
-			break;
-				
-		case CMD_ALO: /* All lights on */
-		case CMD_ALF: /* All lights off */
-			x10_pkt[pktx++] |= (cmd == CMD_ALO) ? COMMAND_ALL_LIGHTS_ON : COMMAND_ALL_LIGHTS_OFF;			
-			sendX10Command(x10_pkt, pktx);
-			break;
-				
-		case CMD_ON: /* On */
-		case CMD_OFF: /* Off */
-			x10_pkt[pktx++] |= (cmd == CMD_ON) ? COMMAND_ON : COMMAND_OFF;			
-			sendX10Command(x10_pkt, pktx);
-			break;
-				
-		case CMD_DIM: /* Dim */
-		case CMD_BRI: /* Bright */
-			if(!level){
-				debug(DEBUG_UNEXPECTED, "No level n/v");
-				return;
-			}
-			i = atoi(level);
-			if((i < 0) || (i > 100)){
-				debug(DEBUG_UNEXPECTED, "Dim/Bright level out of bounds");
-				return;
-			}
-			x10_pkt[0] |= (i << 3);
-			x10_pkt[pktx++] |= (cmd == CMD_DIM) ? COMMAND_DIM : COMMAND_BRIGHT;			
-			sendX10Command(x10_pkt, pktx);
-			break;
-				
-		case CMD_EXT: /* Extended */
-			if(!data1 || !data2){
-				debug(DEBUG_UNEXPECTED, "data1 or data2 n/v missing");
-				return;
-			}
-			i = atoi(data1);
-			j = atoi(data2);
-			if((i < 0) || (i > 255)){
-				debug(DEBUG_UNEXPECTED, "data1 out of bounds");
-				return;
-			}
-			if((j < 0) || (j > 255)){
-				debug(DEBUG_UNEXPECTED, "data2 out of bounds");
-				return;
-			}
-			x10_pkt[0] |= HEADER_EXTENDED;
-			x10_pkt[pktx++] |= COMMAND_EXTENDED_CODE;
-			x10_pkt[pktx++] = (unsigned char) i; /* Data 1 */
-			x10_pkt[pktx++] = (unsigned char) j; /* Data 2 */
-			sendX10Command(x10_pkt, pktx);
-			break;
-				
-		case CMD_HRQ: /* Hail Request */
-			x10_pkt[pktx++] = COMMAND_HAIL_REQUEST;
-			sendX10Command(x10_pkt, pktx);	
-			break;
-				
-		case CMD_PD1: /* Pre dim 1 */
-			x10_pkt[pktx++] = COMMAND_PRESET_DIM1;
-			sendX10Command(x10_pkt, pktx);	
-			break;
-				
-		case CMD_PD2: /* Pre dim 2 */
-			x10_pkt[pktx++] = COMMAND_PRESET_DIM2;
-			sendX10Command(x10_pkt, pktx);	
-			break;
-				
-		case CMD_STS: /* Status */
-			x10_pkt[pktx++] = COMMAND_STATUS_REQUEST;
-			sendX10Command(x10_pkt, pktx);	
-			break;
-			
-		default:
-			debug(DEBUG_UNEXPECTED,"Bad command");
-			break;	
+}
+
+/*
+ * Find the schema table entry for a class and type. Returns NULL if it isn't supported
+ */
+
+static SchemaEntryPtr_t schemaLookup(const String class, const String type)
+{
+	int slot;
+	uint32_t hash = schemaHash(class, type);
+	SchemaEntryPtr_t se;
+
+	for(slot = hash & (SCHEMA_SLOTS - 1); (se = schemaSlots[slot]); slot = (slot + 1) & (SCHEMA_SLOTS - 1)){
+		if((se->hash == hash) && (!strcmp(se->class, class)) && (!strcmp(se->type, type)))
+			return se;
 	}
-	/* Always send  a confirm message */
-	xPL_clearMessageNamedValues(xplx10ConfirmMessage);
-	xPL_setMessageNamedValue(xplx10ConfirmMessage, "command", command);
-	xPL_setMessageNamedValue(xplx10ConfirmMessage, "house", houseLetter);
-	if(deviceList)
-		xPL_setMessageNamedValue(xplx10ConfirmMessage, "device", deviceList); 
-	if(!xPL_sendMessage(xplx10ConfirmMessage))
-		debug(DEBUG_UNEXPECTED, "Command complete confirm message transmission failed");		
+	return NULL;
 }
 
 
@@ -486,25 +2403,23 @@ static void processX10BasicCommand(xPL_MessagePtr theMessage)
 
 static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
 {
-	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
-		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
-			const String iID = xPL_getTargetInstanceID(theMessage);
-			const String type = xPL_getSchemaType(theMessage);
-			const String class = xPL_getSchemaClass(theMessage);
-						
-			if(!strcmp(instanceID, iID)){
-				if(!strcmp(class,"x10")){
-					if(!strcmp(type, "basic")){ /* Basic command schema */
-						processX10BasicCommand(theMessage);			
-					}
-					else
-						debug(DEBUG_UNEXPECTED, "Unsupported type: %s", type);
-				}
-				else
-					debug(DEBUG_EXPECTED, "Unsupported class: %s", class);
-			}
-		}
+	SchemaEntryPtr_t se;
+
+	/* Reject anything not targeted at our instance before looking at the message body */
+	if(xPL_isBroadcastMessage(theMessage) || strcmp(instanceID, xPL_getTargetInstanceID(theMessage)))
+		return;
+
+	if(xPL_MESSAGE_COMMAND != xPL_getMessageType(theMessage)) /* If the message is not a command */
+		return;
+
+	if(!(se = schemaLookup(xPL_getSchemaClass(theMessage), xPL_getSchemaType(theMessage)))){
+		unsupportedSchemaCount++;
+		debug(DEBUG_EXPECTED, "Unsupported schema: %s.%s", xPL_getSchemaClass(theMessage), xPL_getSchemaType(theMessage));
+		return;
 	}
+
+	se->count++;
+	(*se->handler)(theMessage);
 }
 
 
@@ -516,7 +2431,48 @@ static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
 
 static void tickHandler(int userVal, xPL_ObjectPtr obj)
 {
+	ConfigEntryPtr_t ce;
+	Bool busy;
+
+	/* Drop queued commands which have outlived their time to live */
+	txqExpire();
+
+	/* Time out status replies for delivery verification */
+	verifyTick();
+
+	/* Refresh stale two-way devices while the powerline is idle */
+	refreshTick();
+
+	/* Carry on with a discovery sweep while the powerline is idle */
+	discoverTick();
+
+	/* Advance the timer wheel. This runs scheduled actions and turns off lights in vacant rooms */
+	timerTick();
+	scheduleTick();
 
+	/* Save the usage statistics and a device state snapshot now and then */
+	usageTick();
+	devstateTick();
+
+	/* Advertise the backlog when it crosses the budget, so controllers can throttle */
+	busy = (queueBudgetMs && (txqBacklogMs() > queueBudgetMs)) ? TRUE : FALSE;
+	if(busy != queueBusy){
+		queueBusy = busy;
+		sendBacklogStatus();
+	}
+
+	/* Reload the devices and scenes if we got a SIGHUP */
+	if(reloadPending){
+		reloadPending = 0;
+		debug(DEBUG_STATUS, "Reloading config file: %s", configFile);
+		if((ce = confreadScan(configFile, confDefErrorHandler))){
+			confreadFree(configEntry);
+			configEntry = ce;
+			loadConfigTables();
+		}
+		else
+			debug(DEBUG_UNEXPECTED, "Config reload failed, keeping the current configuration");
+	}
 }
 
 /*
@@ -530,13 +2486,36 @@ static void x10Handler(int fd, int revents, int userValue)
 	return;
 }
 
+/*
+ * Local command socket I/O handler (Callback from xPL)
+ */
+
+static void localHandler(int fd, int revents, int userValue)
+{
+	localapiIO(fd, revents);
+}
+
+/*
+ * Ask xPL to poll a local socket, or to stop
+ */
+
+static Bool localWatch(int fd, Bool write)
+{
+	return xPL_addIODevice(localHandler, 0, fd, TRUE, write, TRUE);
+}
+
+static void localUnwatch(int fd)
+{
+	xPL_removeIODevice(fd);
+}
+
 /*
  * Our X10 event handler
  */
  
-static void myX10EventHandler(const char *address_string, const char housecode, const unsigned commandindex)
+static void myX10EventHandler(const char *address_string, const char housecode, const unsigned unitmask, const unsigned commandindex)
 {
-	char *command;
+	const char *command;
 	char houseletter[2];
 	
 	
@@ -545,78 +2524,34 @@ static void myX10EventHandler(const char *address_string, const char housecode,
 	houseletter[0] = housecode;
 	houseletter[1] = 0;
 	
-	xPL_clearMessageNamedValues(xplx10TriggerMessage);
+	devstateApply(housecode - 'A', unitmask, commandindex, 0);
+
+	/* Motion restarts occupancy timers */
+	occupancyEvent(housecode - 'A', unitmask, commandindex);
+
+	/* Local reflexes go straight to the transmit queue. The event is still published below */
+	rulesEvent(housecode - 'A', unitmask, commandindex);
+
+	/* Local subscribers get the decoded event without going through xPL */
+	localapiEvent(housecode - 'A', unitmask, commandindex);
+
+	/* Status replies may be the answer to a verification or refresh request */
+	if(((commandindex == COMMAND_STATUS_ON) || (commandindex == COMMAND_STATUS_OFF)) &&
+	(!verifyStatusReply(housecode - 'A', unitmask, (commandindex == COMMAND_STATUS_ON) ? TRUE : FALSE)) &&
+	(!refreshStatusReply(housecode - 'A', unitmask, (commandindex == COMMAND_STATUS_ON) ? TRUE : FALSE)))
+		discoverStatusReply(housecode - 'A', unitmask, (commandindex == COMMAND_STATUS_ON) ? TRUE : FALSE);
+	else if(commandindex == COMMAND_HAIL_ACKNOWLEDGE)
+		discoverHailAck(housecode - 'A');
 	
-	switch(commandindex){
-		case COMMAND_ALL_UNITS_OFF:
-			command = "all_units_off";
-			break;
-			
-		case COMMAND_ALL_LIGHTS_OFF:
-			command = "all_lights_off";
-			break;
-			
-		case COMMAND_ALL_LIGHTS_ON:
-			command = "all_lights_on";
-			break;
-			
-		case COMMAND_BRIGHT:
-			command = "bright";
-			break;
-			
-		case COMMAND_DIM:
-			command = "dim";
-			break;
-			
-		case COMMAND_EXTENDED_CODE:
-			command = "extended_code";
-			break;
-			
-		case COMMAND_EXTENDED_DATA_TRANSFER:
-			command = "extended";
-			break;
-			
-		case COMMAND_HAIL_ACKNOWLEDGE:
-			command = "hail_ack"; 
-			break;
-			
-		case COMMAND_HAIL_REQUEST:
-			command = "hail_request";
-			break;
-			
-		case COMMAND_OFF:
-			command = "off";
-			break;
-			
-		case COMMAND_ON:
-			command = "on";
-			break;
-			
-		case COMMAND_PRESET_DIM1:
-			command = "predim1";
-			break;
-			
-		case COMMAND_PRESET_DIM2:
-			command = "predim2";
-			break;
-			
-		case COMMAND_STATUS_OFF:
-			command = "status_off";
-			break;
-			
-		case COMMAND_STATUS_ON:
-			command = "status_on";
-			break;
-			
-		case COMMAND_STATUS_REQUEST:
-			command = "status";
-			break;
-			
-		default:
-				debug(DEBUG_UNEXPECTED, "Invalid command code received: %02X", commandindex);
-				return;
+	/* Keep it in the event history */
+	historyAppend(FALSE, housecode - 'A', unitmask, commandindex, 0, NULL);
+
+	if(!(command = eventCommandName(commandindex))){
+		debug(DEBUG_UNEXPECTED, "Invalid command code received: %02X", commandindex);
+		return;
 	}
-	xPL_setMessageNamedValue(xplx10TriggerMessage, "command", command);
+	xPL_clearMessageNamedValues(xplx10TriggerMessage);
+	xPL_setMessageNamedValue(xplx10TriggerMessage, "command", (String) command);
 	xPL_setMessageNamedValue(xplx10TriggerMessage, "house", houseletter);
 	if(address_string && strlen(address_string))
 		xPL_setMessageNamedValue(xplx10TriggerMessage, "device", (const String) address_string); 
@@ -701,6 +2636,7 @@ int main(int argc, char *argv[])
 {
 	int longindex;
 	int optchar;
+	int fd;
 	unsigned char hc;
 	String p;
 	
@@ -709,6 +2645,18 @@ int main(int argc, char *argv[])
 	/* Set the program name */
 	progName=argv[0];
 
+	/* Remember how we were started for an upgrade. A relative path won't work once we are in the background */
+	savedArgv = argv;
+	if(!getcwd(startDir, sizeof(startDir)))
+		startDir[0] = '\0';
+	if((argv[0][0] != '/') && (strchr(argv[0], '/')) && (getcwd(exePath, sizeof(exePath))) &&
+	(strlen(exePath) + strlen(argv[0]) + 2 <= sizeof(exePath))){
+		strcat(exePath, "/");
+		strcat(exePath, argv[0]);
+	}
+	else
+		confreadStringCopy(exePath, argv[0], sizeof(exePath));
+
 	/* Parse the arguments. */
 	while((optchar=getopt_long(argc, argv, SHORT_OPTIONS, longOptions, &longindex)) != EOF) {
 		
@@ -728,6 +2676,7 @@ int main(int argc, char *argv[])
 				/* Was it a config file switch? */
 			case 'c':
 				confreadStringCopy(configFile, optarg, WS_SIZE - 1);
+				absolutePathArg(&argv[optind - 1], optarg, configFile, WS_SIZE - 1);
 				debug(DEBUG_ACTION,"New config file path is: %s", configFile);
 				break;
 				
@@ -745,6 +2694,7 @@ int main(int argc, char *argv[])
 			/* Was it a pid file switch? */
 			case 'f':
 				confreadStringCopy(pidFile, optarg, WS_SIZE - 1);
+				absolutePathArg(&argv[optind - 1], optarg, pidFile, WS_SIZE - 1);
 				clOverride.pid_file = 1;
 				debug(DEBUG_ACTION,"New pid file path is: %s", pidFile);
 				break;
@@ -763,6 +2713,7 @@ int main(int argc, char *argv[])
 			case 'l':
 				/* Override log path*/
 				confreadStringCopy(logPath, optarg, WS_SIZE - 1);
+				absolutePathArg(&argv[optind - 1], optarg, logPath, WS_SIZE - 1);
 				clOverride.log_path = 1;
 				debug(DEBUG_ACTION,"New log path is: %s",
 				logPath);
@@ -778,6 +2729,7 @@ int main(int argc, char *argv[])
 			
 			case 'p': /* TTY ? */
 				confreadStringCopy(tty, optarg, sizeof(tty));
+				absolutePathArg(&argv[optind - 1], optarg, tty, sizeof(tty));
 				clOverride.tty = 1;
 				break;	
 			
@@ -850,16 +2802,110 @@ int main(int argc, char *argv[])
 					fatal("Bad house code in config file");
 			defaultHouseLetter = p[0];
 		}				
+
+		/* Verify commands to two-way devices with a status request */
+		if((p = confreadValueBySectKey(configEntry, "general", "verify")))
+			verifyDefault = strcmp(p, "yes") ? FALSE : TRUE;
+
+		/* Default staleness limit in seconds for two-way devices, 0 for no background refresh */
+		if((p = confreadValueBySectKey(configEntry, "general", "refresh")))
+			refreshSetDefault((atoi(p) > 0) ? (unsigned) atoi(p) : 0);
+
+		/* Shared memory device state table */
+		if((p = confreadValueBySectKey(configEntry, "general", "shm-name")))
+			confreadStringCopy(shmName, p, sizeof(shmName));
+
+		/* Event history directory */
+		if((p = confreadValueBySectKey(configEntry, "general", "history-dir")))
+			confreadStringCopy(historyDir, p, sizeof(historyDir));
+
+		/* Local command socket */
+		if((p = confreadValueBySectKey(configEntry, "general", "local-socket")))
+			confreadStringCopy(localSocket, p, sizeof(localSocket));
+
+		/* Pending scheduled actions file */
+		if((p = confreadValueBySectKey(configEntry, "general", "schedule-file")))
+			confreadStringCopy(scheduleFile, p, sizeof(scheduleFile));
+
+		/* Device state snapshot file */
+		if((p = confreadValueBySectKey(configEntry, "general", "state-file")))
+			confreadStringCopy(stateFile, p, sizeof(stateFile));
+
+		/* Usage statistics file */
+		if((p = confreadValueBySectKey(configEntry, "general", "usage-file")))
+			confreadStringCopy(usageFile, p, sizeof(usageFile));
+
+		/* Discovery progress and results file */
+		if((p = confreadValueBySectKey(configEntry, "general", "discovery-file")))
+			confreadStringCopy(discoveryFile, p, sizeof(discoveryFile));
+
+		/* Transmit queue journal file */
+		if((p = confreadValueBySectKey(configEntry, "general", "journal-file")))
+			confreadStringCopy(journalFile, p, sizeof(journalFile));
+
+		/* Seconds to spend sending what is queued when asked to stop, 0 to stop at once */
+		if((p = confreadValueBySectKey(configEntry, "general", "drain-timeout")))
+			drainTimeout = (atoi(p) > 0) ? (unsigned) atoi(p) : 0;
+
+		/* Queued powerline time budget in seconds, 0 to accept everything */
+		if((p = confreadValueBySectKey(configEntry, "general", "queue-budget")))
+			queueBudgetMs = (unsigned) atoi(p) * 1000;
 	}
 	else
 		debug(DEBUG_UNEXPECTED, "Config file %s not found or not readable", configFile);
 
+	/* Paths from the config file or the defaults are relative to where we were started, not / */
+	absolutePath(pidFile, sizeof(pidFile));
+	absolutePath(logPath, sizeof(logPath));
+	absolutePath(localSocket, sizeof(localSocket));
+	absolutePath(stateFile, sizeof(stateFile));
+	absolutePath(journalFile, sizeof(journalFile));
+	absolutePath(historyDir, sizeof(historyDir));
+	absolutePath(discoveryFile, sizeof(discoveryFile));
+	absolutePath(scheduleFile, sizeof(scheduleFile));
+	absolutePath(usageFile, sizeof(usageFile));
+
+	/* Load the named devices and scenes */
+	loadConfigTables();
+
+	/* Carry on where the process we replaced left off if this is an upgrade */
+	handoffEntry = readHandoff();
+
+	/* Pick up the usage statistics and device state from before the last exit */
+	usageInit(usageFile);
+	devstateRestore(stateFile, handoffEntry ? TRUE : FALSE);
+	if(handoffEntry){
+		occupancyRestoreTimers(handoffEntry, "occupancy-timers");
+		if((p = confreadValueBySectKey(handoffEntry, "handoff", "last-house")))
+			lastHouse = atoi(p);
+	}
+
+	/* Let local processes read device state from shared memory */
+	if((shmName[0]) && (!devstatePublish(shmName)))
+		debug(DEBUG_UNEXPECTED, "Device state not published in shared memory %s", shmName);
+
+	/* Record powerline traffic */
+	if((historyDir[0]) && (!historyOpen(historyDir)))
+		debug(DEBUG_UNEXPECTED, "Event history not kept in %s", historyDir);
+
+	/* Restore the delayed and timed commands saved before the last exit */
+	scheduleInit(scheduleFile, runScheduled);
+
+	/* Pick up a discovery sweep where it left off */
+	discoverInit(discoveryFile);
+	if((configEntry) && (p = confreadValueBySectKey(configEntry, "general", "discovery")) && (!strcmp(p, "yes")))
+		discoverStart(FALSE);
+
 	/* Turn on library debugging for level 5 */
 	if(debugLvl >= 5)
 		xPL_setDebugging(TRUE);
 		
-	/* Fork into the background. */	
-	if(!noBackground) {
+	/* An upgrade carries on logging where the process it replaced did */
+	if((upgraded) && (debugLvl) && (logPath[0]))
+		notify_logpath(logPath);
+
+	/* Fork into the background, unless we already are there */	
+	if((!noBackground) && (!upgraded)) {
 		int retval;
 		
 	    /* Make sure we are not already running (.pid file check). */
@@ -921,13 +2967,27 @@ int main(int argc, char *argv[])
 
 		umask(022);
 		
-		/* Close STDIN, STDOUT, and STDERR */
+		/*
+		* Point STDIN, STDOUT, and STDERR at /dev/null, so nothing we
+		* open later takes those fds and gets passed on by an upgrade
+		*/
 
-		close(0);
-		close(1);
-		close(2);
+		if((fd = open("/dev/null", O_RDWR)) >= 0){
+			dup2(fd, 0);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			if(fd > 2)
+				close(fd);
+		}
+		else{
+			close(0);
+			close(1);
+			close(2);
+		}
  
 	}
+	else if((upgraded) && (!noBackground) && (chdir("/")))
+		fatal_with_reason(errno, "chdir to /");
 	debug(DEBUG_STATUS,"Initializing xPL library");
 	
 	/* Set the xPL interface */
@@ -955,15 +3015,23 @@ int main(int argc, char *argv[])
 	xplx10TriggerMessage = xPL_createBroadcastMessage(xplx10Service, xPL_MESSAGE_TRIGGER);
 	xPL_setSchema(xplx10TriggerMessage, "x10", "basic");
 
+	/* Status message object. Schema is set for each reply */
+	xplx10StatusMessage = xPL_createBroadcastMessage(xplx10Service, xPL_MESSAGE_STATUS);
+
 
   	/* Install signal traps for proper shutdown */
  	signal(SIGTERM, shutdownHandler);
  	signal(SIGINT, shutdownHandler);
+ 	signal(SIGHUP, reloadHandler);
+ 	signal(SIGUSR2, upgradeHandler);
 
 
 	/* Add 1 second tick service */
 	xPL_addTimeoutHandler(tickHandler, 1, NULL);
 
+	/* Hash the supported schemas */
+	schemaTableInit();
+
   	/* And a listener for all xPL messages */
   	xPL_addMessageListener(xPLListener, NULL);
 
@@ -978,7 +3046,15 @@ int main(int argc, char *argv[])
 	debug(DEBUG_STATUS,"Initializing x10 communications on tty: %s", tty);
 	
 	if(!dryRun){
-		myX10 = x10_open(tty, myX10EventHandler);
+		/* On an upgrade the tty is already open and set up */
+		if((handoffEntry) && (p = confreadValueBySectKey(handoffEntry, "handoff", "tty-fd")) &&
+		(myX10 = x10_adopt(atoi(p), myX10EventHandler))){
+			debug(DEBUG_STATUS, "Took over tty %s on fd %d", tty, x10_fd(myX10));
+			if((p = confreadValueBySectKey(handoffEntry, "handoff", "x10-phase")) && (x10_set_phase(myX10, p)))
+				debug(DEBUG_UNEXPECTED, "Bad x10 receive state in handoff: %s", p);
+		}
+		else
+			myX10 = x10_open(tty, myX10EventHandler);
 		if(!myX10)
 			fatal("Could not initialize X10 communications on tty: %s", tty);
 			/* Ask xPL to monitor our serial fd */
@@ -986,11 +3062,35 @@ int main(int argc, char *argv[])
 			fatal("Could not register x10 fd with xPL");
 	}
 
+	/* Local clients share the transmit queue and its budget with xPL */
+	if((localSocket[0]) && (localapiInit(localSocket, queueBudgetMs, localWatch, localUnwatch) < 0))
+		debug(DEBUG_UNEXPECTED, "Local command socket %s not available", localSocket);
+
+	/* Send the commands accepted but not sent before the last exit, and journal new ones */
+	journalOpen(journalFile, replayJournal);
+
+	/* Say how long the upgrade took from the old process saving its state to now */
+	if(handoffEntry){
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		if((p = confreadValueBySectKey(handoffEntry, "handoff", "saved")))
+			debug(DEBUG_STATUS, "Upgrade complete, %.0f ms after the handoff was saved",
+			((double) now.tv_sec + now.tv_usec / 1e6 - atof(p)) * 1000.0);
+		confreadFree(handoffEntry);
+		handoffEntry = NULL;
+	}
+
  	/** Main Loop **/
 
 	for (;;) {
-		/* Let XPL run forever */
-		xPL_processMessages(-1);
+		/* Handle xPL messages, and send a frame between them when there is work queued */
+		xPL_processMessages(txqEmpty() ? TX_IDLE_POLL_MS : 0);
+		txqService(sendQueuedFrame);
+		if(shutdownPending)
+			checkShutdown();
+		else if(upgradePending)
+			checkUpgrade();
   	}
 
 	exit(1);